@@ -23,6 +23,7 @@
 #include <math.h>
 #include <string.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include "PPDGenerator.h"
 #include "flexvdi-port.h"
 
@@ -57,19 +58,26 @@ void paper_description_delete(gpointer p) {
 struct _PPDGenerator {
     GObject parent;
     char * printer_name;
-    FILE * file;
+    GString * buffer;
     char * filename;
     int color;
     int duplex;
-    GSList * paper_sizes;
+    // Each collection keeps its items in insertion order, indexed by a set
+    GPtrArray * paper_sizes;
+    GHashTable * paper_set;
     char * default_paper_size;
-    GSList * trays;
+    GPtrArray * trays;
+    GHashTable * tray_set;
     char * default_tray;
-    GSList * media_types;
+    GPtrArray * media_types;
+    GHashTable * media_type_set;
     char * default_type;
-    GSList * resolutions;
+    GArray * resolutions;
+    GHashTable * resolution_set;
     int default_resolution;
     double left, bottom, right, top;
+    // Scratch buffer of sanitize(), so that generators can run in parallel
+    char sanitized[100];
 };
 
 G_DEFINE_TYPE(PPDGenerator, ppd_generator, G_TYPE_OBJECT);
@@ -82,17 +90,20 @@ static void ppd_generator_class_init(PPDGeneratorClass * class) {
 }
 
 static void ppd_generator_init(PPDGenerator * ppd) {
-    int fd = g_file_open_tmp("fvXXXXXX.ppd", &ppd->filename, NULL);
-    ppd->file = fdopen(fd, "w");
-    if (fd == -1 || ppd->file == NULL) {
-        g_warning("Failed to create temp PPD file");
-    }
+    ppd->paper_sizes = g_ptr_array_new_with_free_func(paper_description_delete);
+    ppd->paper_set = g_hash_table_new(g_str_hash, g_str_equal);
+    ppd->trays = g_ptr_array_new_with_free_func(g_free);
+    ppd->tray_set = g_hash_table_new(g_str_hash, g_str_equal);
+    ppd->media_types = g_ptr_array_new_with_free_func(g_free);
+    ppd->media_type_set = g_hash_table_new(g_str_hash, g_str_equal);
+    ppd->resolutions = g_array_new(FALSE, FALSE, sizeof(int));
+    ppd->resolution_set = g_hash_table_new(g_direct_hash, g_direct_equal);
     ppd->left = ppd->bottom = ppd->right = ppd->top = 0.0;
 }
 
 
 static int is_valid(PPDGenerator * ppd) {
-    return ppd->printer_name && ppd->file && ppd->paper_sizes && ppd->default_paper_size;
+    return ppd->printer_name && ppd->paper_sizes->len && ppd->default_paper_size;
 }
 
 
@@ -105,20 +116,30 @@ PPDGenerator * ppd_generator_new(const char * printer_name) {
 
 static void ppd_generator_finalize(GObject * obj) {
     PPDGenerator * ppd = PPD_GENERATOR(obj);
-    fclose(ppd->file);
+    if (ppd->buffer) g_string_free(ppd->buffer, TRUE);
     g_free(ppd->filename);
     g_free(ppd->printer_name);
     g_free(ppd->default_paper_size);
     g_free(ppd->default_tray);
     g_free(ppd->default_type);
-    g_slist_free_full(ppd->paper_sizes, paper_description_delete);
-    g_slist_free_full(ppd->trays, g_free);
-    g_slist_free_full(ppd->media_types, g_free);
-    g_slist_free(ppd->resolutions);
+    g_hash_table_unref(ppd->paper_set);
+    g_ptr_array_unref(ppd->paper_sizes);
+    g_hash_table_unref(ppd->tray_set);
+    g_ptr_array_unref(ppd->trays);
+    g_hash_table_unref(ppd->media_type_set);
+    g_ptr_array_unref(ppd->media_types);
+    g_hash_table_unref(ppd->resolution_set);
+    g_array_unref(ppd->resolutions);
     G_OBJECT_CLASS(ppd_generator_parent_class)->finalize(obj);
 }
 
 
+void ppd_generator_set_filename(PPDGenerator * ppd, const char * filename) {
+    g_free(ppd->filename);
+    ppd->filename = g_strdup(filename);
+}
+
+
 void ppd_generator_set_color(PPDGenerator * ppd, int color) {
     ppd->color = color;
 }
@@ -130,18 +151,18 @@ void ppd_generator_set_duplex(PPDGenerator * ppd, int duplex) {
 
 
 static gint cmp_paper(gconstpointer a, gconstpointer b) {
-    return strcmp(((PaperDescription *)a)->name, ((PaperDescription *)b)->name);
+    return strcmp((*(PaperDescription **)a)->name, (*(PaperDescription **)b)->name);
 }
 
 
 void ppd_generator_add_paper_size(PPDGenerator * ppd, char * name, double width, double length,
                                   double left, double bottom, double right, double top) {
-    PaperDescription tmp;
-    tmp.name = name;
-    if (!g_slist_find_custom(ppd->paper_sizes, &tmp, cmp_paper)) {
-        ppd->paper_sizes = g_slist_prepend(ppd->paper_sizes,
-                                           paper_description_new(name, width, length,
-                                                                 left, bottom, right, top));
+    if (g_hash_table_contains(ppd->paper_set, name)) {
+        g_free(name);
+    } else {
+        g_hash_table_add(ppd->paper_set, name);
+        g_ptr_array_add(ppd->paper_sizes,
+                        paper_description_new(name, width, length, left, bottom, right, top));
         if (ppd->left < left) ppd->left = left;
         if (ppd->bottom < bottom) ppd->bottom = bottom;
         if (ppd->right < width - right) ppd->right = width - right;
@@ -157,15 +178,14 @@ void ppd_generator_set_default_paper_size(PPDGenerator * ppd, char * name) {
 
 
 static gint cmp_resolution(gconstpointer a, gconstpointer b) {
-    return GPOINTER_TO_INT(a) - GPOINTER_TO_INT(b);
+    return *(const int *)a - *(const int *)b;
 }
 
 
 void ppd_generator_add_resolution(PPDGenerator * ppd, int resolution) {
-    if (!g_slist_find(ppd->paper_sizes, GINT_TO_POINTER(resolution))) {
-        ppd->resolutions = g_slist_insert_sorted(ppd->resolutions,
-                                                 GINT_TO_POINTER(resolution),
-                                                 cmp_resolution);
+    if (!g_hash_table_contains(ppd->resolution_set, GINT_TO_POINTER(resolution))) {
+        g_hash_table_add(ppd->resolution_set, GINT_TO_POINTER(resolution));
+        g_array_append_val(ppd->resolutions, resolution);
         if (resolution > ppd->default_resolution) ppd->default_resolution = resolution;
     }
 }
@@ -176,15 +196,18 @@ void ppd_generator_set_default_resolution(PPDGenerator * ppd, int resolution) {
 }
 
 
-static gint cmp_str(gconstpointer a, gconstpointer b) {
-    return strcmp((const char *)a, (const char *)b);
+static void add_unique(GPtrArray * array, GHashTable * set, char * item) {
+    if (g_hash_table_contains(set, item)) {
+        g_free(item);
+    } else {
+        g_hash_table_add(set, item);
+        g_ptr_array_add(array, item);
+    }
 }
 
 
 void ppd_generator_add_media_type(PPDGenerator * ppd, char * media) {
-    if (!g_slist_find_custom(ppd->media_types, media, cmp_str)) {
-        ppd->media_types = g_slist_prepend(ppd->media_types, media);
-    }
+    add_unique(ppd->media_types, ppd->media_type_set, media);
 }
 
 
@@ -195,9 +218,7 @@ void ppd_generator_set_default_media_type(PPDGenerator * ppd, char * media) {
 
 
 void ppd_generator_add_tray(PPDGenerator * ppd, char * tray) {
-    if (!g_slist_find_custom(ppd->trays, tray, cmp_str)) {
-        ppd->trays = g_slist_prepend(ppd->trays, tray);
-    }
+    add_unique(ppd->trays, ppd->tray_set, tray);
 }
 
 
@@ -207,8 +228,8 @@ void ppd_generator_set_default_tray(PPDGenerator * ppd, char * tray) {
 }
 
 
-static char * sanitize(const char * str) {
-    static char buffer[100];
+static char * sanitize(PPDGenerator * ppd, const char * str) {
+    char * buffer = ppd->sanitized;
     const char * j = str;
     int i = 0;
     while (i < 99 && *j != '\0') {
@@ -224,12 +245,11 @@ static char * sanitize(const char * str) {
 
 
 static void generate_header(PPDGenerator * ppd) {
-    g_autofree gchar * base_name = g_path_get_basename(ppd->filename);
     g_autofree gchar * model_name = g_strdup(ppd->printer_name);
     const char * color_dev = ppd->color ? "True" : "False";
     const char * defaultCS = ppd->color ? "RGB" : "Gray";
     g_strdelimit(model_name, "_", ' ');
-    fprintf(ppd->file,
+    g_string_append_printf(ppd->buffer,
             "*PPD-Adobe: \"4.3\"\n"
             "*FileVersion: \"1.0\"\n"
             "*FormatVersion: \"4.3\"\n"
@@ -255,25 +275,24 @@ static void generate_header(PPDGenerator * ppd) {
             "*cupsFilter: \"application/pdf  0  pdftopdf-nocopies\"\n"
             "*cupsLanguages: \"en\"\n"
             "\n"
-            , model_name, model_name, model_name, base_name, model_name, color_dev, defaultCS);
+            , model_name, model_name, model_name, "FLEXVDI.PPD", model_name, color_dev, defaultCS);
 }
 
 
 static void generate_paper_sizes(PPDGenerator * ppd) {
-    GSList * i;
+    guint i;
     int max_size = 0;
-    ppd->paper_sizes = g_slist_sort(ppd->paper_sizes, cmp_paper);
-    for (i = ppd->paper_sizes; i != NULL; i = g_slist_next(i)) {
-        PaperDescription * desc = (PaperDescription *)i->data;
+    for (i = 0; i < ppd->paper_sizes->len; ++i) {
+        PaperDescription * desc = g_ptr_array_index(ppd->paper_sizes, i);
         if (max_size < desc->width) max_size = desc->width;
         if (max_size < desc->length) max_size = desc->length;
     }
-    fprintf(ppd->file,
+    g_string_append_printf(ppd->buffer,
             "*%% == Paper stuff\n"
             "*HWMargins: %d %d %d %d\n"
             , (int)ceil(ppd->left), (int)ceil(ppd->bottom)
             , (int)ceil(ppd->right), (int)ceil(ppd->top));
-    fprintf(ppd->file,
+    g_string_append_printf(ppd->buffer,
             "*%% Ghostscript pdfwrite ignores Orientation, so set the\n"
             "*%% custom page width/length and then use an Install procedure\n"
             "*%% to rotate the image.\n"
@@ -304,82 +323,82 @@ static void generate_paper_sizes(PPDGenerator * ppd) {
             "*LandscapeOrientation: Any\n\n"
             , max_size, max_size, max_size, max_size, max_size, max_size);
 
-    fprintf(ppd->file,
+    g_string_append_printf(ppd->buffer,
             "*OpenUI *PageSize: PickOne\n"
             "*DefaultPageSize: %s\n"
             "*OrderDependency: 20 AnySetup *PageSize\n"
-            , sanitize(ppd->default_paper_size));
-    for (i = ppd->paper_sizes; i != NULL; i = g_slist_next(i)) {
-        PaperDescription * desc = (PaperDescription *)i->data;
-        fprintf(ppd->file,
+            , sanitize(ppd, ppd->default_paper_size));
+    for (i = 0; i < ppd->paper_sizes->len; ++i) {
+        PaperDescription * desc = g_ptr_array_index(ppd->paper_sizes, i);
+        g_string_append_printf(ppd->buffer,
                 "*PageSize %.34s/%s: \"<< /PageSize [%.2f %.2f] /ImagingBBox null >> setpagedevice\"\n"
-                , sanitize(desc->name), desc->name, desc->width, desc->length);
+                , sanitize(ppd, desc->name), desc->name, desc->width, desc->length);
     }
-    fprintf(ppd->file,
+    g_string_append_printf(ppd->buffer,
             "*CloseUI: *PageSize\n\n"
 
             "*OpenUI *PageRegion: PickOne\n"
             "*DefaultPageRegion: %s\n"
             "*OrderDependency: 20 AnySetup *PageRegion\n"
-            , sanitize(ppd->default_paper_size));
-    for (i = ppd->paper_sizes; i != NULL; i = g_slist_next(i)) {
-        PaperDescription * desc = (PaperDescription *)i->data;
-        fprintf(ppd->file,
+            , sanitize(ppd, ppd->default_paper_size));
+    for (i = 0; i < ppd->paper_sizes->len; ++i) {
+        PaperDescription * desc = g_ptr_array_index(ppd->paper_sizes, i);
+        g_string_append_printf(ppd->buffer,
                 "*PageRegion %.34s/%s: \"<< /PageSize [%.2f %.2f] /ImagingBBox null >> setpagedevice\"\n"
-                , sanitize(desc->name), desc->name, desc->width, desc->length);
+                , sanitize(ppd, desc->name), desc->name, desc->width, desc->length);
     }
-    fprintf(ppd->file,
+    g_string_append_printf(ppd->buffer,
             "*CloseUI: *PageRegion\n\n"
 
             "*DefaultImageableArea: %s\n"
             , ppd->default_paper_size);
-    for (i = ppd->paper_sizes; i != NULL; i = g_slist_next(i)) {
-        PaperDescription * desc = (PaperDescription *)i->data;
-        fprintf(ppd->file,
+    for (i = 0; i < ppd->paper_sizes->len; ++i) {
+        PaperDescription * desc = g_ptr_array_index(ppd->paper_sizes, i);
+        g_string_append_printf(ppd->buffer,
                 "*ImageableArea %.34s/%s: \"%.2f %.2f %.2f %.2f\"\n"
-                , sanitize(desc->name), desc->name
+                , sanitize(ppd, desc->name), desc->name
                 , desc->left, desc->bottom, desc->right, desc->top);
     }
-    fprintf(ppd->file,
+    g_string_append_printf(ppd->buffer,
             "\n*DefaultPaperDimension: %s\n"
             , ppd->default_paper_size);
-    for (i = ppd->paper_sizes; i != NULL; i = g_slist_next(i)) {
-        PaperDescription * desc = (PaperDescription *)i->data;
-        fprintf(ppd->file,
+    for (i = 0; i < ppd->paper_sizes->len; ++i) {
+        PaperDescription * desc = g_ptr_array_index(ppd->paper_sizes, i);
+        g_string_append_printf(ppd->buffer,
                 "*PaperDimension %.34s/%s: \"%.2f %.2f\"\n"
-                , sanitize(desc->name), desc->name, desc->width, desc->length);
+                , sanitize(ppd, desc->name), desc->name, desc->width, desc->length);
     }
-    fprintf(ppd->file, "\n");
+    g_string_append_printf(ppd->buffer, "\n");
 }
 
 
 static void generate_resolutions(PPDGenerator * ppd) {
-    GSList * i;
+    guint i;
     if (ppd->default_resolution == 0) {
         ppd->default_resolution = 300;
     }
-    if (!ppd->resolutions) {
-        ppd->resolutions = g_slist_append(NULL, GINT_TO_POINTER(ppd->default_resolution));
+    if (!ppd->resolutions->len) {
+        g_array_append_val(ppd->resolutions, ppd->default_resolution);
     }
-    fprintf(ppd->file,
+    g_string_append_printf(ppd->buffer,
             "*%% == Valid resolutions\n"
             "*OpenUI *Resolution: PickOne\n"
             "*DefaultResolution: %ddpi\n"
             "*OrderDependency: 10 AnySetup *Resolution\n"
             , ppd->default_resolution > 0 ? ppd->default_resolution : 300);
-    for (i = ppd->resolutions; i != NULL; i = g_slist_next(i)) {
-        int r = GPOINTER_TO_INT(i->data);
-        fprintf(ppd->file,
+    for (i = 0; i < ppd->resolutions->len; ++i) {
+        int r = g_array_index(ppd->resolutions, int, i);
+        g_string_append_printf(ppd->buffer,
                 "*Resolution %ddpi: \"<< /HWResolution [%d %d] >> setpagedevice\"\n"
                 , r, r, r);
     }
-    fprintf(ppd->file, "*CloseUI: *Resolution\n\n");
+    g_string_append_printf(ppd->buffer, "*CloseUI: *Resolution\n\n");
 }
 
 
 static void generate_duplex(PPDGenerator * ppd) {
     if (ppd->duplex) {
-        fprintf(ppd->file,
+        g_string_append_printf(ppd->buffer,
                 "*%% == Duplex\n"
                 "*OpenUI *Duplex/Double-Sided Printing: PickOne\n"
                 "*OrderDependency: 30 AnySetup *Duplex\n"
@@ -394,7 +413,7 @@ static void generate_duplex(PPDGenerator * ppd) {
 
 static void generate_color(PPDGenerator * ppd) {
     if (ppd->color) {
-        fprintf(ppd->file,
+        g_string_append_printf(ppd->buffer,
                 "*%% == Color\n"
                 "*OpenUI *ColorModel/Color Mode: PickOne\n"
                 "*OrderDependency: 30 AnySetup *ColorModel\n"
@@ -403,7 +422,7 @@ static void generate_color(PPDGenerator * ppd) {
                 "*ColorModel RGB/Color: \"\"\n"
                 "*CloseUI: *ColorModel\n\n");
     } else {
-        fprintf(ppd->file,
+        g_string_append_printf(ppd->buffer,
                 "*%% == Color\n"
                 "*OpenUI *ColorModel/Color Mode: PickOne\n"
                 "*OrderDependency: 30 AnySetup *ColorModel\n"
@@ -415,55 +434,53 @@ static void generate_color(PPDGenerator * ppd) {
 
 
 static void generate_trays(PPDGenerator * ppd) {
-    GSList * i;
-    int j;
-    if (ppd->trays != NULL) {
-        ppd->trays = g_slist_reverse(ppd->trays);
+    guint i;
+    if (ppd->trays->len) {
         char * default_tray = ppd->default_tray;
-        if (!default_tray) default_tray = (char *)ppd->trays->data;
+        if (!default_tray) default_tray = g_ptr_array_index(ppd->trays, 0);
 
-        fprintf(ppd->file,
+        g_string_append_printf(ppd->buffer,
                 "*%% == Printer paper trays\n"
                 "*OpenUI *InputSlot/Input Slot: PickOne\n"
                 "*OrderDependency: 30 AnySetup *InputSlot\n"
                 "*DefaultInputSlot: %s\n"
-               , sanitize(default_tray));
-        for (i = ppd->trays, j = 0; i != NULL; i = g_slist_next(i), ++j) {
-            fprintf(ppd->file,
+               , sanitize(ppd, default_tray));
+        for (i = 0; i < ppd->trays->len; ++i) {
+            const char * tray = g_ptr_array_index(ppd->trays, i);
+            g_string_append_printf(ppd->buffer,
                     "*InputSlot %s/%s: \"\"\n"
-                    , sanitize((const char *)i->data), (const char *)i->data);
+                    , sanitize(ppd, tray), tray);
         }
-        fprintf(ppd->file, "*CloseUI: *InputSlot\n\n");
+        g_string_append_printf(ppd->buffer, "*CloseUI: *InputSlot\n\n");
     }
 }
 
 
 static void generate_media_types(PPDGenerator * ppd) {
-    GSList * i;
-    int j;
-    if (ppd->media_types != NULL) {
-        ppd->media_types = g_slist_reverse(ppd->media_types);
+    guint i;
+    if (ppd->media_types->len) {
         char * default_type = ppd->default_type;
-        if (!default_type) default_type = (char *)ppd->media_types->data;
+        if (!default_type) default_type = g_ptr_array_index(ppd->media_types, 0);
 
-        fprintf(ppd->file,
+        g_string_append_printf(ppd->buffer,
                 "*%% == Media types\n"
                 "*OpenUI *MediaType/Media Type: PickOne\n"
                 "*OrderDependency: 30 AnySetup *MediaType\n"
                 "*DefaultMediaType: %s\n"
-               , sanitize(default_type));
-        for (i = ppd->media_types, j = 0; i != NULL; i = g_slist_next(i), ++j) {
-            fprintf(ppd->file,
+               , sanitize(ppd, default_type));
+        for (i = 0; i < ppd->media_types->len; ++i) {
+            const char * media_type = g_ptr_array_index(ppd->media_types, i);
+            g_string_append_printf(ppd->buffer,
                     "*MediaType %s/%s: \"\"\n"
-                    , sanitize((const char *)i->data), (const char *)i->data);
+                    , sanitize(ppd, media_type), media_type);
         }
-        fprintf(ppd->file, "*CloseUI: *MediaType\n\n");
+        g_string_append_printf(ppd->buffer, "*CloseUI: *MediaType\n\n");
     }
 }
 
 
 static void generate_fonts(PPDGenerator * ppd) {
-    fprintf(ppd->file,
+    g_string_append_printf(ppd->buffer,
             "*%% == Fonts\n"
             "*DefaultFont: Courier\n"
             "*Font Bookman-Demi: Standard \"(1.05)\" Standard ROM\n"
@@ -517,23 +534,99 @@ static void generate_fonts(PPDGenerator * ppd) {
 }
 
 
-gchar * ppd_generator_run(PPDGenerator * ppd) {
+static void checksum_add_string(GChecksum * checksum, const char * str) {
+    if (str) g_checksum_update(checksum, (const guchar *)str, strlen(str) + 1);
+    else g_checksum_update(checksum, (const guchar *)"", 1);
+}
+
+
+static void checksum_add_int(GChecksum * checksum, gint64 value) {
+    g_checksum_update(checksum, (const guchar *)&value, sizeof(value));
+}
+
+
+static void checksum_add_double(GChecksum * checksum, double value) {
+    g_checksum_update(checksum, (const guchar *)&value, sizeof(value));
+}
+
+
+gchar * ppd_generator_get_fingerprint(PPDGenerator * ppd) {
+    guint i;
+    GChecksum * checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    checksum_add_int(checksum, PPD_GENERATOR_VERSION);
+    checksum_add_string(checksum, ppd->printer_name);
+    checksum_add_int(checksum, ppd->color);
+    checksum_add_int(checksum, ppd->duplex);
+    for (i = 0; i < ppd->paper_sizes->len; ++i) {
+        PaperDescription * desc = g_ptr_array_index(ppd->paper_sizes, i);
+        checksum_add_string(checksum, desc->name);
+        checksum_add_double(checksum, desc->width);
+        checksum_add_double(checksum, desc->length);
+        checksum_add_double(checksum, desc->left);
+        checksum_add_double(checksum, desc->bottom);
+        checksum_add_double(checksum, desc->right);
+        checksum_add_double(checksum, desc->top);
+    }
+    checksum_add_string(checksum, ppd->default_paper_size);
+    for (i = 0; i < ppd->trays->len; ++i)
+        checksum_add_string(checksum, g_ptr_array_index(ppd->trays, i));
+    checksum_add_string(checksum, ppd->default_tray);
+    for (i = 0; i < ppd->media_types->len; ++i)
+        checksum_add_string(checksum, g_ptr_array_index(ppd->media_types, i));
+    checksum_add_string(checksum, ppd->default_type);
+    for (i = 0; i < ppd->resolutions->len; ++i)
+        checksum_add_int(checksum, g_array_index(ppd->resolutions, int, i));
+    checksum_add_int(checksum, ppd->default_resolution);
+    gchar * result = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    return result;
+}
+
+
+const char * ppd_generator_generate(PPDGenerator * ppd, gsize * length) {
     if (!is_valid(ppd)) {
         g_warning("Invalid PPD data for printer %s", ppd->printer_name);
         return NULL;
     }
-    char * old_locale = setlocale(LC_NUMERIC, "C");
-    setlocale(LC_NUMERIC, "C");
-    generate_header(ppd);
-    generate_paper_sizes(ppd);
-    generate_resolutions(ppd);
-    generate_duplex(ppd);
-    generate_color(ppd);
-    generate_trays(ppd);
-    generate_media_types(ppd);
-    // TODO: UI constraints
-    generate_fonts(ppd);
-    setlocale(LC_NUMERIC, old_locale);
+    if (!ppd->buffer) {
+        ppd->buffer = g_string_sized_new(16384);
+        // Sort once, right before emission
+        g_ptr_array_sort(ppd->paper_sizes, cmp_paper);
+        g_array_sort(ppd->resolutions, cmp_resolution);
+        char * old_locale = setlocale(LC_NUMERIC, "C");
+        setlocale(LC_NUMERIC, "C");
+        generate_header(ppd);
+        generate_paper_sizes(ppd);
+        generate_resolutions(ppd);
+        generate_duplex(ppd);
+        generate_color(ppd);
+        generate_trays(ppd);
+        generate_media_types(ppd);
+        // TODO: UI constraints
+        generate_fonts(ppd);
+        setlocale(LC_NUMERIC, old_locale);
+    }
+    if (length) *length = ppd->buffer->len;
+    return ppd->buffer->str;
+}
 
+
+gchar * ppd_generator_run(PPDGenerator * ppd) {
+    g_autoptr(GError) error = NULL;
+    gsize length;
+    if (!ppd->filename) {
+        int fd = g_file_open_tmp("fvXXXXXX.ppd", &ppd->filename, &error);
+        if (fd == -1) {
+            g_warning("Failed to create temp PPD file: %s", error->message);
+            return NULL;
+        }
+        g_close(fd, NULL);
+    }
+    const char * contents = ppd_generator_generate(ppd, &length);
+    if (!contents) return NULL;
+    if (!g_file_set_contents(ppd->filename, contents, length, &error)) {
+        g_warning("Failed to write PPD file: %s", error->message);
+        return NULL;
+    }
     return ppd->filename;
 }
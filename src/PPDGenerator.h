@@ -26,6 +26,7 @@
 G_DECLARE_FINAL_TYPE(PPDGenerator, ppd_generator, PPD, GENERATOR, GObject)
 
 PPDGenerator * ppd_generator_new(const char * printer_name);
+void ppd_generator_set_filename(PPDGenerator * ppd, const char * filename);
 void ppd_generator_set_color(PPDGenerator * ppd, int color);
 void ppd_generator_set_duplex(PPDGenerator * ppd, int duplex);
 void ppd_generator_add_paper_size(PPDGenerator * ppd, char * name,
@@ -35,10 +36,39 @@ void ppd_generator_add_paper_size(PPDGenerator * ppd, char * name,
 void ppd_generator_set_default_paper_size(PPDGenerator * ppd, char * name);
 void ppd_generator_add_resolution(PPDGenerator * ppd, int resolution);
 void ppd_generator_set_default_resolution(PPDGenerator * ppd, int resolution);
+
+/*
+ * ppd_generator_add_media_type, ppd_generator_add_tray
+ *
+ * Trays and media types are emitted in the order they are added, which must be
+ * the order of the printer backend. The guest sends the chosen one back as its
+ * index in the PPD (the media-source and media-type job options), and the
+ * backends look that index up in their own list. Repeated names are dropped.
+ */
 void ppd_generator_add_media_type(PPDGenerator * ppd, char * media);
 void ppd_generator_set_default_media_type(PPDGenerator * ppd, char * media);
 void ppd_generator_add_tray(PPDGenerator * ppd, char * tray);
 void ppd_generator_set_default_tray(PPDGenerator * ppd, char * tray);
+char * ppd_generator_get_fingerprint(PPDGenerator * ppd);
+
+/*
+ * Bump when the generated output changes, so that cached PPDs are discarded.
+ */
+#define PPD_GENERATOR_VERSION 2
+
+/*
+ * ppd_generator_generate
+ *
+ * Renders the PPD into memory. The result belongs to the generator.
+ */
+const char * ppd_generator_generate(PPDGenerator * ppd, gsize * length);
+
+/*
+ * ppd_generator_run
+ *
+ * Writes the PPD to the file set with ppd_generator_set_filename, or to a new
+ * temporary file. Returns the name of the file.
+ */
 char * ppd_generator_run(PPDGenerator * ppd);
 
 #endif /* _PPD_GENERATOR_H */
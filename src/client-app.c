@@ -28,10 +28,12 @@
 
 #include "client-app.h"
 #include "client-log.h"
+#include "client-timeline.h"
 #include "configuration.h"
 #include "client-win.h"
 #include "client-request.h"
 #include "client-conn.h"
+#include "gateway-select.h"
 #include "spice-win.h"
 #include "flexvdi-port.h"
 #include "serialredir.h"
@@ -75,6 +77,12 @@ struct _ClientApp {
     ClientConf * conf;
     ClientAppWindow * main_window;
     ClientRequest * current_request;
+    ClientRequest * speculative_authmode;
+    gboolean speculative_authmode_done;
+    gint64 prewarm_time;
+    gboolean prewarm_pending;
+    JsonObject * gateway_params;
+    GCancellable * gateway_cancellable;
     ClientConn * connection;
     const gchar * username;
     const gchar * password;
@@ -203,6 +211,7 @@ static gboolean client_app_local_command_line(GApplication * gapp, gchar *** arg
 static void button_pressed_handler(ClientAppWindow * win, int button, gpointer user_data);
 static gboolean key_event_handler(GtkWidget * widget, GdkEvent * event, gpointer user_data);
 static void desktop_selected_handler(ClientAppWindow * win, gpointer user_data);
+static void login_typing_handler(ClientAppWindow * win, gpointer user_data);
 static gboolean delete_cb(GtkWidget * widget, GdkEvent * event, gpointer user_data);
 static void network_changed(GNetworkMonitor * net_monitor, gboolean network_available, gpointer user_data);
 
@@ -232,18 +241,25 @@ static GActionEntry app_entries[] = {
     { "quit", quit_activated, NULL, NULL, NULL }
 };
 
+static void client_app_start_speculative_authmode(ClientApp * app);
+
 static void client_app_startup(GApplication * gapp) {
+    ClientApp * app = CLIENT_APP(gapp);
+    client_timeline_begin("app-startup");
     g_set_print_handler(old_print_func);
 
+    // Initialize GTK while the configuration file is loaded
+    G_APPLICATION_CLASS(client_app_parent_class)->startup(gapp);
+    client_conf_wait_loaded(app->conf);
+    client_app_start_speculative_authmode(app);
+
 #ifdef ENABLE_SERIALREDIR
-    ClientApp * app = CLIENT_APP(gapp);
     serial_port_init(app->conf);
 #endif
 
-    G_APPLICATION_CLASS(client_app_parent_class)->startup(gapp);
-
     g_action_map_add_action_entries(G_ACTION_MAP(gapp), app_entries,
         G_N_ELEMENTS(app_entries), gapp);
+    client_timeline_end("app-startup");
 }
 
 /*
@@ -252,8 +268,10 @@ static void client_app_startup(GApplication * gapp) {
  */
 static void client_app_activate(GApplication * gapp) {
     ClientApp * app = CLIENT_APP(gapp);
+    client_timeline_begin("main-window");
     app->main_window = client_app_window_new(app, app->conf);
     gtk_widget_show_all(GTK_WIDGET(app->main_window));
+    client_timeline_end("main-window");
 
     if (client_conf_get_kiosk_mode(app->conf))
         client_app_window_hide_config_button(app->main_window);
@@ -268,6 +286,8 @@ static void client_app_activate(GApplication * gapp) {
         G_CALLBACK(key_event_handler), app);
     g_signal_connect(app->main_window, "desktop-selected",
         G_CALLBACK(desktop_selected_handler), app);
+    g_signal_connect(app->main_window, "login-typing",
+        G_CALLBACK(login_typing_handler), app);
     g_signal_connect(app->main_window, "delete-event",
         G_CALLBACK(delete_cb), app);
 
@@ -292,6 +312,7 @@ static void network_changed(GNetworkMonitor * net_monitor, gboolean network_avai
     g_debug("Network is available NOW");
     g_signal_handlers_disconnect_by_func(net_monitor, G_CALLBACK(network_changed), app);
     if (client_conf_get_uri(app->conf) != NULL) {
+        g_clear_object(&app->speculative_authmode);
         client_app_connect_with_spice_uri(app, client_conf_get_uri(app->conf));
         client_app_window_status(app->main_window, "Connecting to desktop...");
         client_app_window_set_central_widget(app->main_window, "login");
@@ -453,6 +474,74 @@ static void client_app_configure(ClientApp * app, const gchar * error) {
 
 static void authmode_request_cb(ClientRequest * req, gpointer user_data);
 
+/*
+ * Speculative authmode response handler. If the login page has already taken
+ * the request, handle the response, otherwise keep it for the login page.
+ */
+static void speculative_authmode_cb(ClientRequest * req, gpointer user_data) {
+    ClientApp * app = CLIENT_APP(user_data);
+    if (app->current_request == req)
+        authmode_request_cb(req, app);
+    else
+        app->speculative_authmode_done = TRUE;
+}
+
+
+/*
+ * Start the authmode request while the main window is built, if the manager
+ * is already known. The first login page takes it instead of sending its own,
+ * and the connection it opens is kept alive by the Soup session for the rest of
+ * the login requests.
+ */
+static void client_app_start_speculative_authmode(ClientApp * app) {
+    if (!client_conf_get_host(app->conf) || client_conf_get_uri(app->conf) ||
+        !client_conf_has_terminal_id(app->conf) ||
+        !g_network_monitor_get_network_available(g_network_monitor_get_default()))
+        return;
+
+    g_autofree gchar * req_body = g_strdup_printf(
+        "{\"hwaddress\": \"%s\"}", client_conf_get_terminal_id(app->conf));
+    client_timeline_begin("authmode-request");
+    app->speculative_authmode = client_request_new_with_data(app->conf,
+        "/vdi/authmode", req_body, req_body, speculative_authmode_cb, app);
+}
+
+
+// Seconds a pre-warmed connection to the manager is expected to stay open
+#define PREWARM_INTERVAL 15
+
+/*
+ * Login typing handler. Keep the connection to the manager hot while the user
+ * types, so that the credentials are sent on it right away. The Soup session
+ * keeps idle connections for a minute, but servers usually close them earlier.
+ */
+static void login_typing_handler(ClientAppWindow * win, gpointer user_data) {
+    ClientApp * app = CLIENT_APP(user_data);
+    gint64 now = g_get_monotonic_time();
+    if (!app->prewarm_pending || now - app->prewarm_time < PREWARM_INTERVAL * G_USEC_PER_SEC)
+        return;
+
+    app->prewarm_time = now;
+    client_request_prewarm(app->conf, NULL);
+}
+
+
+/*
+ * Warm up the connections the login needs while the login page is shown. The
+ * authmode request opens the one to the manager; the WebSocket gateway of the
+ * last session is resolved and handshaked here, so that the tunnels resume its
+ * TLS session.
+ */
+static void client_app_prewarm(ClientApp * app) {
+    app->prewarm_time = g_get_monotonic_time();
+    app->prewarm_pending = TRUE;
+
+    g_autofree gchar * gateway = client_conf_get_last_gateway(app->conf);
+    if (gateway && g_strcmp0(gateway, client_conf_get_host(app->conf)))
+        client_request_prewarm(app->conf, gateway);
+}
+
+
 /*
  * Show the login page, and start a new authmode request.
  */
@@ -467,10 +556,32 @@ static void client_app_show_login(ClientApp * app, const gchar * error) {
     client_app_window_set_central_widget_sensitive(app->main_window, FALSE);
 
     app->username = app->password = app->desktop = "";
+    client_app_prewarm(app);
+
+    // A gateway selection still running belongs to the previous desktop request
+    if (app->gateway_cancellable) {
+        g_cancellable_cancel(app->gateway_cancellable);
+        g_clear_object(&app->gateway_cancellable);
+        g_clear_pointer(&app->gateway_params, json_object_unref);
+    }
 
     g_clear_object(&app->current_request);
+    if (app->speculative_authmode) {
+        ClientRequest * req = app->current_request = g_steal_pointer(&app->speculative_authmode);
+        if (app->speculative_authmode_done) {
+            client_timeline_mark("authmode-speculative-hit");
+            g_object_ref(req);
+            authmode_request_cb(req, app);
+            g_object_unref(req);
+        } else {
+            client_timeline_mark("authmode-speculative-pending");
+        }
+        return;
+    }
+
     g_autofree gchar * req_body = g_strdup_printf(
         "{\"hwaddress\": \"%s\"}", client_conf_get_terminal_id(app->conf));
+    client_timeline_begin("authmode-request");
     app->current_request = client_request_new_with_data(app->conf,
         "/vdi/authmode", req_body, req_body, authmode_request_cb, app);
 }
@@ -483,6 +594,7 @@ static void authmode_request_cb(ClientRequest * req, gpointer user_data) {
     ClientApp * app = CLIENT_APP(user_data);
     g_autoptr(GError) error = NULL;
     JsonNode * root = client_request_get_result(req, &error);
+    client_timeline_end("authmode-request");
 
     if (error) {
         client_app_configure(app, "Failed to contact server");
@@ -516,11 +628,23 @@ static void authmode_request_cb(ClientRequest * req, gpointer user_data) {
 
 static void desktop_request_cb(ClientRequest * req, gpointer user_data);
 
+// Seconds between desktop requests while it is being prepared
+#define DESKTOP_POLL_INTERVAL 3
+// Seconds the broker may hold a desktop request until the desktop is ready
+#define DESKTOP_LONG_POLL_WAIT 25
+
 /*
  * Start a new desktop request with currently selected username, password
- * and desktop name (which may be empty).
+ * and desktop name (which may be empty). Polls for a desktop that is being
+ * prepared use long polling when the broker supports it.
  */
+static void client_app_request_desktop_with_wait(ClientApp * app, gint wait);
+
 static void client_app_request_desktop(ClientApp * app) {
+    client_app_request_desktop_with_wait(app, 0);
+}
+
+static void client_app_request_desktop_with_wait(ClientApp * app, gint wait) {
     client_app_window_status(app->main_window, "Requesting desktop policy...");
     client_app_window_set_central_widget_sensitive(app->main_window, FALSE);
 
@@ -539,13 +663,14 @@ static void client_app_request_desktop(ClientApp * app) {
         client_conf_get_terminal_id(app->conf),
         user, "******", app->desktop);
 
-    app->current_request = client_request_new_with_data(app->conf,
-        "/vdi/desktop", req_body, loggable_req_body, desktop_request_cb, app);
+    client_timeline_begin("desktop-request");
+    app->current_request = client_request_new_long_poll(app->conf,
+        "/vdi/desktop", req_body, loggable_req_body, wait, desktop_request_cb, app);
 }
 
 
 static gboolean client_app_repeat_request_desktop(gpointer user_data) {
-    client_app_request_desktop(CLIENT_APP(user_data));
+    client_app_request_desktop_with_wait(CLIENT_APP(user_data), DESKTOP_LONG_POLL_WAIT);
     return FALSE; // Cancel timeout
 }
 
@@ -561,6 +686,12 @@ static void desktop_request_cb(ClientRequest * req, gpointer user_data) {
     g_autoptr(GError) error = NULL;
     gboolean invalid = FALSE;
     JsonNode * root = client_request_get_result(req, &error);
+    client_timeline_end("desktop-request");
+    if (app->prewarm_pending) {
+        app->prewarm_pending = FALSE;
+        client_timeline_mark(client_request_reused_connection(req) ?
+                             "broker-prewarm-hit" : "broker-prewarm-miss");
+    }
 
     if (error) {
         client_app_show_login(app, "Failed to contact server");
@@ -575,8 +706,16 @@ static void desktop_request_cb(ClientRequest * req, gpointer user_data) {
 
         } else if (g_strcmp0(status, "Pending") == 0) {
             client_app_window_status(app->main_window, "Preparing desktop...");
-            // Retry (forever) after 3 seconds
-            g_timeout_add_seconds(3, client_app_repeat_request_desktop, app);
+            // Retry (forever) right away if the broker held the request until now,
+            // otherwise after the delay it asks for, or DESKTOP_POLL_INTERVAL seconds
+            gint delay = client_request_get_retry_after(req);
+            if (json_object_has_member(response, "retry_after"))
+                delay = json_object_get_int_member(response, "retry_after");
+            if (client_request_long_poll_applied(req))
+                delay = 0;
+            else if (delay < 0)
+                delay = DESKTOP_POLL_INTERVAL;
+            g_timeout_add_seconds(delay, client_app_repeat_request_desktop, app);
 
         } else if (g_strcmp0(status, "Error") == 0) {
             const gchar * message = json_object_get_string_member(response, "message");
@@ -661,6 +800,8 @@ static void client_app_connect(ClientApp * app) {
     g_signal_connect(app->connection, "disconnected",
                      G_CALLBACK(connection_disconnected), app);
 
+    print_job_manager_set_memory_spool_limit(app->pjb,
+        (gsize)MAX(client_conf_get_print_memory_spool(app->conf), 0) * 1024 * 1024);
     FlexvdiPort * guest_port = client_conn_get_guest_agent_port(app->connection);
     g_signal_connect_swapped(guest_port, "message",
                              G_CALLBACK(print_job_manager_handle_message), app->pjb);
@@ -673,14 +814,48 @@ static void client_app_connect(ClientApp * app) {
                          G_CALLBACK(usb_connect_failed), app);
     }
 
+    client_timeline_mark("spice-connect");
     client_conn_connect(app->connection);
 }
 
 /*
- * Get connection parameters from the desktop response
+ * Gateway selected handler. Connect through the selected gateway, or through
+ * the one in the desktop response if none of them answered. Nothing is done if
+ * the login page was shown again meanwhile.
+ */
+static void gateway_selected(GObject * source, GAsyncResult * res, gpointer user_data) {
+    ClientApp * app = CLIENT_APP(user_data);
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar * gateway = gateway_select_finish(app->conf, res, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) return;
+    JsonObject * params = g_steal_pointer(&app->gateway_params);
+    g_clear_object(&app->gateway_cancellable);
+
+    if (gateway)
+        json_object_set_string_member(params, "spice_address", gateway);
+    else
+        g_warning("Failed to select a gateway: %s", error->message);
+    app->connection = client_conn_new(app->conf, params);
+    client_app_connect(app);
+    json_object_unref(params);
+}
+
+/*
+ * Get connection parameters from the desktop response. WebSocket sessions with
+ * several candidate gateways connect through the one with the lowest latency.
  */
 static void client_app_connect_with_response(ClientApp * app, JsonObject * params) {
     client_conf_get_options_from_response(app->conf, params);
+    if (client_conn_params_use_ws(params)) {
+        g_auto(GStrv) gateways = gateway_select_candidates(app->conf, params);
+        if (g_strv_length(gateways) > 1) {
+            app->gateway_params = json_object_ref(params);
+            app->gateway_cancellable = g_cancellable_new();
+            gateway_select_async(app->conf, gateways, app->gateway_cancellable,
+                                 gateway_selected, app);
+            return;
+        }
+    }
     app->connection = client_conn_new(app->conf, params);
     client_app_connect(app);
 }
@@ -753,6 +928,9 @@ static void connection_disconnected(ClientConn * conn, ClientConnDisconnectReaso
                                     gpointer user_data) {
     ClientApp * app = CLIENT_APP(user_data);
 
+    if (reason >= CLIENT_CONN_DISCONNECT_CONN_ERROR)
+        client_log_dump_recorder("disconnection");
+
     if (app->main_window) {
         client_app_show_login(app, "Failed to establish the connection, see the log file for further information.");
         client_app_window_set_central_widget_sensitive(app->main_window, TRUE);
@@ -847,6 +1025,9 @@ static void display_monitors(SpiceChannel * display, GParamSpec * pspec, ClientA
 
 static void spice_win_display_mark(SpiceChannel * channel, gint mark, SpiceWindow * win) {
     if (mark) {
+        // The first mark ends the startup, later calls do nothing
+        client_timeline_mark("first-display-mark");
+        client_timeline_report();
         gtk_widget_show(GTK_WIDGET(win));
     } else {
         gtk_widget_hide(GTK_WIDGET(win));
@@ -17,12 +17,15 @@
     along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <stdlib.h>
+
 #include "client-conn.h"
 #include "ws-tunnel.h"
 #ifdef ENABLE_SERIALREDIR
 #include "serialredir.h"
 #endif
 #include "conn-forward.h"
+#include "client-timeline.h"
 
 
 struct _ClientConn {
@@ -111,21 +114,41 @@ static void client_conn_finalize(GObject * obj) {
 }
 
 
+gboolean client_conn_params_use_ws(JsonObject * params) {
+    return json_object_has_member(params, "use_ws") && (
+        json_object_get_boolean_member(params, "use_ws") ||
+        !g_strcmp0(json_object_get_string_member(params, "use_ws"), "true"));
+}
+
+
 ClientConn * client_conn_new(ClientConf * conf, JsonObject * params) {
     ClientConn * conn = CLIENT_CONN(g_object_new(CLIENT_CONN_TYPE, NULL));
 
     g_object_set(conn->session,
                  "password", json_object_get_string_member(params, "spice_password"),
                  NULL);
-    conn->use_ws = json_object_has_member(params, "use_ws") && (
-        json_object_get_boolean_member(params, "use_ws") ||
-        !g_strcmp0(json_object_get_string_member(params, "use_ws"), "true"));
+    conn->use_ws = client_conn_params_use_ws(params);
     if (conn->use_ws) {
-        conn->ws_host = g_strdup(json_object_get_string_member(params, "spice_address"));
+        // The gateway may come with its own port, otherwise it listens on the manager port
         const gchar * port = client_conf_get_port(conf);
-        conn->ws_port = g_strdup(port ? port : "443");
+        const gchar * address = json_object_get_string_member(params, "spice_address");
+        g_autoptr(GSocketConnectable) gateway = address ?
+            g_network_address_parse(address, port ? atoi(port) : 443, NULL) : NULL;
+        if (gateway) {
+            GNetworkAddress * naddr = G_NETWORK_ADDRESS(gateway);
+            conn->ws_host = g_strdup(g_network_address_get_hostname(naddr));
+            conn->ws_port = g_strdup_printf("%u", g_network_address_get_port(naddr));
+        } else {
+            conn->ws_host = g_strdup(address);
+            conn->ws_port = g_strdup(port ? port : "443");
+        }
         conn->ws_token = g_strdup(json_object_get_string_member(params, "spice_port"));
         conn->soup = client_conf_get_soup_session(conf);
+        // The login page pre-warms the gateway of the last session
+        g_autofree gchar * last_gateway = client_conf_get_last_gateway(conf);
+        client_timeline_mark(g_strcmp0(last_gateway, address) ?
+                             "gateway-prewarm-miss" : "gateway-prewarm-hit");
+        client_conf_set_last_gateway(conf, address);
     } else {
         g_object_set(conn->session,
                      "host", json_object_get_string_member(params, "spice_address"),
@@ -181,6 +204,8 @@ static void open_ws_tunnel(SpiceChannel * channel, int with_tls, gpointer user_d
 static void port_channel(SpiceChannel * channel, GParamSpec * pspec, ClientConn * conn);
 static void main_channel_event(SpiceChannel * channel, SpiceChannelEvent event,
                                ClientConn * conn);
+static void timeline_channel_event(SpiceChannel * channel, SpiceChannelEvent event,
+                                   gpointer user_data);
 
 /*
  * New channel handler. Finishes the connection process of each channel.
@@ -196,6 +221,7 @@ static void channel_new(SpiceSession * s, SpiceChannel * channel, gpointer data)
 
     if (conn->use_ws)
         g_signal_connect(channel, "open-fd", G_CALLBACK(open_ws_tunnel), conn);
+    g_signal_connect(channel, "channel-event", G_CALLBACK(timeline_channel_event), NULL);
 
     if (SPICE_IS_MAIN_CHANNEL(channel)) {
         conn->main = SPICE_MAIN_CHANNEL(channel);
@@ -224,6 +250,21 @@ static void channel_new(SpiceSession * s, SpiceChannel * channel, gpointer data)
 }
 
 
+/*
+ * Record when each channel opens in the startup timeline.
+ */
+static void timeline_channel_event(SpiceChannel * channel, SpiceChannelEvent event,
+                                   gpointer user_data) {
+    if (event == SPICE_CHANNEL_OPENED) {
+        int id, type;
+        g_object_get(channel, "channel-id", &id, "channel-type", &type, NULL);
+        g_autofree gchar * name =
+            g_strdup_printf("channel-open:%s-%d", spice_channel_type_to_string(type), id);
+        client_timeline_mark(name);
+    }
+}
+
+
 /*
  * Channel destroy handler.
  */
@@ -55,6 +55,14 @@ G_DECLARE_FINAL_TYPE(ClientConn, client_conn, CLIENT, CONN, GObject)
  */
 ClientConn * client_conn_new(ClientConf * conf, JsonObject * params);
 
+/*
+ * client_conn_params_use_ws
+ *
+ * Whether the parameters received from the flexVDI Manager ask for a connection
+ * through a WebSocket gateway.
+ */
+gboolean client_conn_params_use_ws(JsonObject * params);
+
 /*
  * client_conn_new_with_uri
  *
@@ -19,6 +19,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
 #ifdef _WIN32
 #include <io.h>
 #endif
@@ -26,44 +29,440 @@
 #ifdef ANDROID
 #include <android/log.h>
 #endif
+#if defined(G_OS_UNIX) && !defined(ANDROID)
+#include <glib-unix.h>
+#include <signal.h>
+#endif
 #include "client-log.h"
 
 
-typedef struct _LevelForDomain {
-    gchar * domain;
-    GLogLevelFlags level;
-} LevelForDomain;
-
-
-static GList * level_for_domains = NULL;
+/*
+ * Log levels are looked up for every message, so domain levels are kept in a hash
+ * table. The most and least verbose levels of all domains are cached, so that most
+ * checks do not even need the table.
+ */
+static GHashTable * level_for_domains = NULL;
+static GRWLock levels_lock;
 static GLogLevelFlags default_level = G_LOG_LEVEL_MESSAGE;
+static gint max_level = G_LOG_LEVEL_MESSAGE;
+static gint min_level = G_LOG_LEVEL_MESSAGE;
 static GLogLevelFlags fatal_level = G_LOG_LEVEL_ERROR;
+// Lines up to this level go to the flight recorder when they are not logged
+static gint record_level = 0;
 static FILE * old_stdout = NULL;
 
 
-int client_log_get_level_for_domain(const gchar * domain) {
-    GList * i;
-    for (i = level_for_domains; i; i = i->next) {
-        LevelForDomain * lfd = (LevelForDomain *)i->data;
-        if (g_str_equal(lfd->domain, domain)) return lfd->level;
+#ifndef ANDROID
+/*
+ * Log lines are formatted by the thread that logs them, pushed onto a lock-free
+ * stack and written in batches by a background writer thread. The stack is
+ * reversed before writing, so lines keep their order.
+ */
+#define LOG_BATCH_SIZE 65536
+
+typedef struct _LogRecord {
+    struct _LogRecord * next;
+    gsize len;
+    gchar line[];
+} LogRecord;
+
+typedef struct _LogTimestamp {
+    gint64 second;
+    gchar str[32];
+} LogTimestamp;
+
+static LogRecord * pending_records = NULL;
+static GMutex writer_mutex;
+static GCond writer_cond;
+static GMutex output_mutex;
+static GThread * writer_thread = NULL;
+static GPrivate log_timestamp = G_PRIVATE_INIT(g_free);
+static gchar log_batch[LOG_BATCH_SIZE];
+
+
+static void push_record(LogRecord * record) {
+    LogRecord * head;
+    do {
+        head = g_atomic_pointer_get(&pending_records);
+        record->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&pending_records, head, record));
+
+    // Only the first record of a batch needs to wake the writer up
+    if (head == NULL) {
+        g_mutex_lock(&writer_mutex);
+        g_cond_signal(&writer_cond);
+        g_mutex_unlock(&writer_mutex);
+    }
+}
+
+
+static LogRecord * take_records() {
+    LogRecord * head;
+    do {
+        head = g_atomic_pointer_get(&pending_records);
+    } while (head && !g_atomic_pointer_compare_and_exchange(&pending_records, head, NULL));
+
+    LogRecord * reversed = NULL;
+    while (head) {
+        LogRecord * next = head->next;
+        head->next = reversed;
+        reversed = head;
+        head = next;
+    }
+    return reversed;
+}
+
+
+/*
+ * When logging to a file, it is rotated by the writer once it grows over
+ * rotate_size: it is renamed to a temporary segment and reopened, and a
+ * background thread compresses the segment to <file>.1.gz, shifting the older
+ * archives and removing those over rotate_files. Compressing never blocks logging.
+ */
+#define DEFAULT_ROTATE_SIZE (10 * 1024 * 1024)
+#define DEFAULT_ROTATE_FILES 5
+
+static gchar * log_file_path = NULL;
+static gint64 log_file_size = 0;
+static gint64 rotate_size = DEFAULT_ROTATE_SIZE;
+static gint rotate_files = DEFAULT_ROTATE_FILES;
+static GThreadPool * compressor = NULL;
+
+
+static gchar * archive_path(int index) {
+    return g_strdup_printf("%s.%d.gz", log_file_path, index);
+}
+
+
+static void compress_segment(gpointer data, gpointer user_data) {
+    g_autofree gchar * segment = (gchar *)data;
+    int files = g_atomic_int_get(&rotate_files), i;
+
+    g_autofree gchar * oldest = archive_path(files - 1);
+    g_unlink(oldest);
+    for (i = files - 2; i >= 1; --i) {
+        g_autofree gchar * from = archive_path(i);
+        g_autofree gchar * to = archive_path(i + 1);
+        g_rename(from, to);
+    }
+    if (files < 2) {
+        g_unlink(segment);
+        return;
+    }
+
+    g_autofree gchar * archive = archive_path(1);
+    g_autoptr(GFile) in_file = g_file_new_for_path(segment);
+    g_autoptr(GFile) out_file = g_file_new_for_path(archive);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GFileInputStream) in = g_file_read(in_file, NULL, &error);
+    g_autoptr(GFileOutputStream) out = in ?
+        g_file_replace(out_file, NULL, FALSE, G_FILE_CREATE_PRIVATE, NULL, &error) : NULL;
+    if (out) {
+        g_autoptr(GZlibCompressor) gzip = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+        g_autoptr(GOutputStream) gz_out =
+            g_converter_output_stream_new(G_OUTPUT_STREAM(out), G_CONVERTER(gzip));
+        g_output_stream_splice(gz_out, G_INPUT_STREAM(in),
+            G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+            NULL, &error);
+    }
+    if (error) {
+        g_warning("Failed to compress log segment %s: %s", segment, error->message);
+        g_unlink(archive);
+    }
+    g_unlink(segment);
+}
+
+
+/*
+ * Must be called with output_mutex held.
+ */
+static void rotate_if_needed() {
+    if (!compressor || rotate_size <= 0 || log_file_size < rotate_size) return;
+
+    fflush(stdout);
+    g_autofree gchar * segment =
+        g_strdup_printf("%s.%" G_GINT64_FORMAT, log_file_path, g_get_real_time());
+#ifdef _WIN32
+    // Open files cannot be renamed
+    freopen("NUL", "a", stderr);
+    freopen("NUL", "a", stdout);
+#endif
+    gboolean renamed = g_rename(log_file_path, segment) == 0;
+    freopen(log_file_path, "a", stderr);
+    freopen(log_file_path, "a", stdout);
+    setvbuf(stderr, NULL, _IONBF, 2);
+    log_file_size = 0;
+    if (renamed)
+        g_thread_pool_push(compressor, g_steal_pointer(&segment), NULL);
+}
+
+
+static void output(const gchar * data, gsize len) {
+    log_file_size += fwrite(data, 1, len, stderr);
+}
+
+
+/*
+ * Must be called with output_mutex held. Lines are copied into a large batch
+ * buffer, so that stderr (which is unbuffered) gets one write per batch.
+ */
+static void batch_line(const gchar * line, gsize len, gsize * used) {
+    if (*used + len > LOG_BATCH_SIZE) {
+        output(log_batch, *used);
+        *used = 0;
+    }
+    if (len > LOG_BATCH_SIZE) {
+        output(line, len);
+    } else {
+        memcpy(log_batch + *used, line, len);
+        *used += len;
     }
-    return default_level;
 }
 
 
-static void update_level_for_domain(const gchar * domain, GLogLevelFlags level) {
-    GList * i;
-    for (i = level_for_domains; i; i = i->next) {
-        LevelForDomain * lfd = (LevelForDomain *)i->data;
-        if (g_str_equal(lfd->domain, domain)) {
-            lfd->level = level;
-            return;
+static void write_records(LogRecord * records) {
+    gsize used = 0;
+    while (records) {
+        LogRecord * next = records->next;
+        batch_line(records->line, records->len, &used);
+        g_free(records);
+        records = next;
+    }
+    if (used) output(log_batch, used);
+    rotate_if_needed();
+}
+
+
+static gpointer log_writer(gpointer user_data) {
+    while (TRUE) {
+        g_mutex_lock(&writer_mutex);
+        while (g_atomic_pointer_get(&pending_records) == NULL)
+            g_cond_wait(&writer_cond, &writer_mutex);
+        g_mutex_unlock(&writer_mutex);
+
+        g_mutex_lock(&output_mutex);
+        write_records(take_records());
+        g_mutex_unlock(&output_mutex);
+    }
+    return NULL;
+}
+
+
+void client_log_flush() {
+    g_mutex_lock(&output_mutex);
+    write_records(take_records());
+    fflush(stderr);
+    g_mutex_unlock(&output_mutex);
+}
+
+
+/*
+ * Formatting the date is expensive, so each thread caches the string of the
+ * current second and only appends the milliseconds.
+ */
+static const gchar * get_timestamp(gint64 now) {
+    LogTimestamp * ts = g_private_get(&log_timestamp);
+    if (!ts) {
+        ts = g_new0(LogTimestamp, 1);
+        ts->second = -1;
+        g_private_set(&log_timestamp, ts);
+    }
+    gint64 second = now / G_USEC_PER_SEC;
+    if (second != ts->second) {
+        g_autoptr(GDateTime) date = g_date_time_new_from_unix_local(second);
+        g_autofree gchar * date_str = g_date_time_format(date, "%Y/%m/%d %H:%M:%S");
+        g_strlcpy(ts->str, date_str, sizeof(ts->str));
+        ts->second = second;
+    }
+    return ts->str;
+}
+
+
+static void enqueue_line(const gchar * log_domain, const gchar * log_level_str,
+                         const gchar * message) {
+    gint64 now = g_get_real_time();
+    const gchar * now_str = get_timestamp(now);
+    gsize size = strlen(now_str) + strlen(log_domain) + strlen(log_level_str) + strlen(message) + 16;
+    LogRecord * record = g_malloc(sizeof(LogRecord) + size);
+    record->len = g_snprintf(record->line, size, "%s.%03d: %s-%s: %s\n", now_str,
+                             (int)(now % G_USEC_PER_SEC / 1000), log_domain, log_level_str, message);
+    if (writer_thread) {
+        push_record(record);
+    } else {
+        g_mutex_lock(&output_mutex);
+        record->next = NULL;
+        write_records(record);
+        g_mutex_unlock(&output_mutex);
+    }
+}
+
+
+/*
+ * The flight recorder keeps the last RECORDER_SLOTS lines that were below the log
+ * level, so that they can be dumped when something goes wrong. Slots are claimed
+ * with an atomic counter, and each one carries the sequence number of the line it
+ * holds, or 0 while it is being written; the dump skips slots that change under it.
+ */
+#define RECORDER_SLOTS 1024
+#define RECORDER_LINE_SIZE 256
+
+typedef struct _RecorderSlot {
+    gint seq;
+    gchar line[RECORDER_LINE_SIZE];
+} RecorderSlot;
+
+static RecorderSlot recorder[RECORDER_SLOTS];
+static gint recorder_next = 0;
+static guint recorder_dumped = 0;
+
+
+static void record_line(const gchar * log_domain, const gchar * log_level_str,
+                        const gchar * message) {
+    gint64 now = g_get_real_time();
+    const gchar * now_str = get_timestamp(now);
+    guint seq = (guint)g_atomic_int_add(&recorder_next, 1);
+    RecorderSlot * slot = &recorder[seq % RECORDER_SLOTS];
+    g_atomic_int_set(&slot->seq, 0);
+    gint len = g_snprintf(slot->line, RECORDER_LINE_SIZE, "%s.%03d: %s-%s: %s\n", now_str,
+                          (int)(now % G_USEC_PER_SEC / 1000), log_domain, log_level_str, message);
+    if (len >= RECORDER_LINE_SIZE) slot->line[RECORDER_LINE_SIZE - 2] = '\n';
+    g_atomic_int_set(&slot->seq, seq + 1);
+}
+
+
+void client_log_dump_recorder(const gchar * reason) {
+    gchar line[RECORDER_LINE_SIZE];
+    gsize used = 0;
+    guint seq;
+
+    g_mutex_lock(&output_mutex);
+    write_records(take_records());
+    guint end = (guint)g_atomic_int_get(&recorder_next);
+    guint start = end > RECORDER_SLOTS ? end - RECORDER_SLOTS : 0;
+    if (start < recorder_dumped) start = recorder_dumped;
+    if (start < end) {
+        g_autofree gchar * header = g_strdup_printf(
+            "----- %u recorded debug lines before %s -----\n", end - start, reason);
+        batch_line(header, strlen(header), &used);
+        for (seq = start; seq != end; ++seq) {
+            RecorderSlot * slot = &recorder[seq % RECORDER_SLOTS];
+            if ((guint)g_atomic_int_get(&slot->seq) != seq + 1) continue;
+            memcpy(line, slot->line, RECORDER_LINE_SIZE);
+            if ((guint)g_atomic_int_get(&slot->seq) != seq + 1) continue;
+            line[RECORDER_LINE_SIZE - 1] = '\0';
+            batch_line(line, strlen(line), &used);
         }
+        const gchar * footer = "----- end of recorded debug lines -----\n";
+        batch_line(footer, strlen(footer), &used);
+        output(log_batch, used);
+        recorder_dumped = end;
+        rotate_if_needed();
     }
-    LevelForDomain * lfd = g_new0(LevelForDomain, 1);
-    lfd->domain = g_strdup(domain);
-    lfd->level = level;
-    level_for_domains = g_list_prepend(level_for_domains, lfd);
+    fflush(stderr);
+    g_mutex_unlock(&output_mutex);
+}
+
+
+void client_log_set_recorder_level(GLogLevelFlags level) {
+    g_atomic_int_set(&record_level, level);
+}
+
+
+gboolean client_log_set_rotation(const gchar * rotation) {
+    gchar * end;
+    gint64 size = g_ascii_strtoll(rotation, &end, 10);
+    gint files = DEFAULT_ROTATE_FILES;
+    if (end == rotation || size < 0) return FALSE;
+    switch (g_ascii_toupper(*end)) {
+        case 'K': size *= 1024; ++end; break;
+        case 'G': size *= 1024 * 1024 * 1024; ++end; break;
+        case 'M': ++end; // Fall through
+        default: size *= 1024 * 1024; break;
+    }
+    if (*end == ',') {
+        files = strtol(end + 1, &end, 10);
+        if (files < 1) return FALSE;
+    }
+    if (*end != '\0') return FALSE;
+
+    g_mutex_lock(&output_mutex);
+    rotate_size = size;
+    g_atomic_int_set(&rotate_files, files);
+    g_mutex_unlock(&output_mutex);
+    return TRUE;
+}
+
+
+/*
+ * Compress the segments left behind by a previous run that exited before
+ * compressing them.
+ */
+static void compress_old_segments() {
+    g_autofree gchar * dir_path = g_path_get_dirname(log_file_path);
+    g_autofree gchar * base_name = g_path_get_basename(log_file_path);
+    g_autofree gchar * prefix = g_strconcat(base_name, ".", NULL);
+    g_autoptr(GDir) dir = g_dir_open(dir_path, 0, NULL);
+    const gchar * name;
+    while (dir && (name = g_dir_read_name(dir))) {
+        if (g_str_has_prefix(name, prefix)) {
+            const gchar * suffix = name + strlen(prefix), * c;
+            for (c = suffix; g_ascii_isdigit(*c); ++c);
+            // Archives have a small index and a .gz extension, segments a timestamp
+            if (*c == '\0' && c - suffix > 10)
+                g_thread_pool_push(compressor, g_build_filename(dir_path, name, NULL), NULL);
+        }
+    }
+}
+
+
+static void log_at_exit() {
+    client_log_flush();
+    // Wait for the pending compressions
+    g_mutex_lock(&output_mutex);
+    GThreadPool * pool = compressor;
+    compressor = NULL;
+    g_mutex_unlock(&output_mutex);
+    if (pool) g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+
+#ifdef G_OS_UNIX
+static gboolean dump_on_signal(gpointer user_data) {
+    client_log_dump_recorder("SIGUSR1");
+    return G_SOURCE_CONTINUE;
+}
+#endif
+#else
+void client_log_flush() {}
+void client_log_dump_recorder(const gchar * reason) {}
+void client_log_set_recorder_level(GLogLevelFlags level) {}
+gboolean client_log_set_rotation(const gchar * rotation) { return TRUE; }
+#endif
+
+
+int client_log_get_level_for_domain(const gchar * domain) {
+    GLogLevelFlags level;
+    gpointer value;
+    g_rw_lock_reader_lock(&levels_lock);
+    if (domain && level_for_domains &&
+        g_hash_table_lookup_extended(level_for_domains, domain, NULL, &value))
+        level = GPOINTER_TO_INT(value);
+    else
+        level = default_level;
+    g_rw_lock_reader_unlock(&levels_lock);
+    return level;
+}
+
+
+static gboolean is_logged(const gchar * domain, GLogLevelFlags level) {
+    if (level > g_atomic_int_get(&max_level)) return FALSE;
+    if (level <= g_atomic_int_get(&min_level)) return TRUE;
+    return level <= client_log_get_level_for_domain(domain);
+}
+
+
+gboolean client_log_is_enabled(const gchar * domain, GLogLevelFlags level) {
+    return is_logged(domain, level);
 }
 
 
@@ -74,17 +473,8 @@ static GLogWriterOutput log_to_file(GLogLevelFlags log_level, const GLogField *
     gboolean fatal = log_level & G_LOG_FLAG_FATAL;
     log_level &= G_LOG_LEVEL_MASK;
 
-    GLogLevelFlags max_level = default_level;
-    if (level_for_domains != NULL) {
-        for (i = 0; i < n_fields; ++i) {
-            if (g_str_equal(fields[i].key, "GLIB_DOMAIN")) {
-                log_domain = (const gchar *)fields[i].value;
-                max_level = client_log_get_level_for_domain(log_domain);
-                break;
-            }
-        }
-    }
-    if (log_level > max_level) return G_LOG_WRITER_HANDLED;
+    gboolean recorded = log_level <= g_atomic_int_get(&record_level);
+    if (!recorded && log_level > g_atomic_int_get(&max_level)) return G_LOG_WRITER_HANDLED;
 
     for (i = 0; (log_domain == NULL || message == NULL) && i < n_fields; ++i) {
         if (g_str_equal(fields[i].key, "GLIB_DOMAIN")) {
@@ -93,6 +483,8 @@ static GLogWriterOutput log_to_file(GLogLevelFlags log_level, const GLogField *
             message = (const gchar *)fields[i].value;
         }
     }
+    gboolean logged = is_logged(log_domain, log_level);
+    if (!logged && !recorded) return G_LOG_WRITER_HANDLED;
 
     switch (log_level) {
         case G_LOG_LEVEL_ERROR: log_level_str = "ERROR"; break;
@@ -115,10 +507,17 @@ static GLogWriterOutput log_to_file(GLogLevelFlags log_level, const GLogField *
     }
     __android_log_print(android_log_level, log_domain, "%s", message);
 #else
-    g_autoptr(GDateTime) now = g_date_time_new_now_local();
-    g_autofree gchar * now_str = g_date_time_format(now, "%Y/%m/%d %H:%M:%S");
-    fprintf(stderr, "%s.%03d: %s-%s: %s\n", now_str, g_date_time_get_microsecond(now)/1000,
-            log_domain, log_level_str, message);
+    if (!log_domain) log_domain = "(null)";
+    if (!message) message = "(null)";
+    if (!logged) {
+        record_line(log_domain, log_level_str, message);
+        return G_LOG_WRITER_HANDLED;
+    }
+    // Do not lose the lines that lead to a crash
+    gboolean flush = fatal || log_level <= G_LOG_LEVEL_CRITICAL || log_level <= fatal_level;
+    if (flush) client_log_dump_recorder(log_level_str);
+    enqueue_line(log_domain, log_level_str, message);
+    if (flush) client_log_flush();
 #endif
 
     if (fatal || log_level <= fatal_level) G_BREAKPOINT();
@@ -151,8 +550,32 @@ void client_log_setup() {
         }
         freopen(file_path, "a", stderr);
         freopen(file_path, "a", stdout);
+
+        GStatBuf st;
+        if (g_stat(file_path, &st) == 0) log_file_size = st.st_size;
+        log_file_path = g_steal_pointer(&file_path);
+        const gchar * rotation_str = g_getenv("FLEXVDI_LOG_ROTATE");
+        if (rotation_str && !client_log_set_rotation(rotation_str))
+            fprintf(stderr, "Invalid FLEXVDI_LOG_ROTATE value %s\n", rotation_str);
+        compressor = g_thread_pool_new(compress_segment, NULL, 1, TRUE, NULL);
+        compress_old_segments();
     }
     setvbuf(stderr, NULL, _IONBF, 2);
+    if (!writer_thread) {
+        writer_thread = g_thread_new("log-writer", log_writer, NULL);
+        atexit(log_at_exit);
+    }
+
+    GLogLevelFlags recorder_level = G_LOG_LEVEL_DEBUG;
+    const gchar * recorder_str = g_getenv("FLEXVDI_LOG_RECORDER");
+    if (recorder_str && g_str_equal(recorder_str, "off"))
+        recorder_level = 0;
+    else if (recorder_str)
+        map_level(strtol(recorder_str, NULL, 10), &recorder_level);
+    client_log_set_recorder_level(recorder_level);
+#ifdef G_OS_UNIX
+    g_unix_signal_add(SIGUSR1, dump_on_signal, NULL);
+#endif
 #endif
 
     g_log_set_writer_func(log_to_file, NULL, NULL);
@@ -171,24 +594,23 @@ void print_to_stdout(const gchar * string) {
 
 
 void client_log_set_log_levels(const gchar * verbose_str) {
-    g_list_free_full(level_for_domains, g_free);
-    level_for_domains = NULL;
-    default_level = G_LOG_LEVEL_MESSAGE;
+    GHashTable * levels = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GLogLevelFlags new_default_level = G_LOG_LEVEL_MESSAGE;
 
-    gchar ** levels = g_strsplit(verbose_str, ",", 0), ** level;
-    for (level = levels; *level; ++level) {
+    gchar ** level_strs = g_strsplit(verbose_str, ",", 0), ** level;
+    for (level = level_strs; *level; ++level) {
         if (**level == '\0') continue;
 
         gchar ** terms = g_strsplit(*level, ":", 0);
         if (*(terms + 1) == NULL) {
-            map_level(strtol(*terms, NULL, 10), &default_level);
+            map_level(strtol(*terms, NULL, 10), &new_default_level);
         } else {
             GLogLevelFlags glevel;
             if (map_level(strtol(*(terms + 1), NULL, 10), &glevel)) {
                 if (g_str_equal(*terms, "all")) {
-                    default_level = glevel;
+                    new_default_level = glevel;
                 } else {
-                    update_level_for_domain(*terms, glevel);
+                    g_hash_table_insert(levels, g_strdup(*terms), GINT_TO_POINTER(glevel));
                 }
             }
         }
@@ -196,7 +618,25 @@ void client_log_set_log_levels(const gchar * verbose_str) {
         g_strfreev(terms);
     }
 
-    g_strfreev(levels);
+    g_strfreev(level_strs);
+
+    gint new_max_level = new_default_level, new_min_level = new_default_level;
+    GHashTableIter it;
+    gpointer value;
+    g_hash_table_iter_init(&it, levels);
+    while (g_hash_table_iter_next(&it, NULL, &value)) {
+        new_max_level = MAX(new_max_level, GPOINTER_TO_INT(value));
+        new_min_level = MIN(new_min_level, GPOINTER_TO_INT(value));
+    }
+
+    g_rw_lock_writer_lock(&levels_lock);
+    GHashTable * old_levels = level_for_domains;
+    level_for_domains = levels;
+    default_level = new_default_level;
+    g_atomic_int_set(&max_level, new_max_level);
+    g_atomic_int_set(&min_level, new_min_level);
+    g_rw_lock_writer_unlock(&levels_lock);
+    if (old_levels) g_hash_table_unref(old_levels);
 
     if (client_log_get_level_for_domain("GSpice") == G_LOG_LEVEL_DEBUG)
         g_setenv("SPICE_DEBUG", "1", TRUE);
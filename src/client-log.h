@@ -30,6 +30,47 @@
  */
 void client_log_setup();
 
+/*
+ * client_log_flush
+ *
+ * Write all the pending log lines before returning. Log lines are written
+ * in batches by a background thread, so call this before anything that may
+ * prevent it from running (e.g. aborting).
+ */
+void client_log_flush();
+
+/*
+ * client_log_dump_recorder
+ *
+ * Write the lines kept by the flight recorder since the last dump, with reason
+ * in the header. The flight recorder keeps the most recent lines that are below
+ * the log level, up to the recorder level. It is dumped automatically before
+ * critical messages and on SIGUSR1. Lines skipped with client_debug/client_info
+ * are not recorded, and neither is GSpice debug output, which spice-gtk only
+ * produces when the GSpice domain is logged at debug level.
+ */
+void client_log_dump_recorder(const gchar * reason);
+
+/*
+ * client_log_set_recorder_level
+ *
+ * Set the most verbose level kept by the flight recorder, or 0 to disable it.
+ * client_log_setup sets it from FLEXVDI_LOG_RECORDER (0 to 5, or "off"), or to
+ * Debug by default.
+ */
+void client_log_set_recorder_level(GLogLevelFlags level);
+
+/*
+ * client_log_set_rotation
+ *
+ * Set when the log file is rotated. rotation has the format size[K|M|G][,files]:
+ * the log file is rotated when it grows over size (MiB by default, 0 to never
+ * rotate), and at most files files are kept, counting the current one and the
+ * compressed archives. client_log_setup reads it from FLEXVDI_LOG_ROTATE, the
+ * default being 10M,5. Returns FALSE if rotation is not valid.
+ */
+gboolean client_log_set_rotation(const gchar * rotation);
+
 /*
  * client_log_set_log_levels
  *
@@ -48,6 +89,32 @@ void client_log_set_log_levels(const gchar * levels);
  */
 int client_log_get_level_for_domain(const gchar * domain);
 
+/*
+ * client_log_is_enabled
+ *
+ * Whether messages of a certain level are logged to the log file for a domain.
+ * This is cheap, usually just a comparison, so it can be used to skip expensive
+ * work that is only needed to produce a log message. The flight recorder is not
+ * taken into account, so that hot paths stay cheap when it records debug lines.
+ */
+gboolean client_log_is_enabled(const gchar * domain, GLogLevelFlags level);
+
+/*
+ * client_log_debug_enabled, client_debug, client_info
+ *
+ * Like g_debug and g_info, but the arguments are not evaluated and the message is
+ * not formatted when the level is disabled for G_LOG_DOMAIN. Use them in hot paths.
+ */
+#define client_log_debug_enabled() client_log_is_enabled(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG)
+
+#define client_debug(...) G_STMT_START { \
+    if (client_log_is_enabled(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG)) g_debug(__VA_ARGS__); \
+} G_STMT_END
+
+#define client_info(...) G_STMT_START { \
+    if (client_log_is_enabled(G_LOG_DOMAIN, G_LOG_LEVEL_INFO)) g_info(__VA_ARGS__); \
+} G_STMT_END
+
 /*
  * print_to_stdout
  *
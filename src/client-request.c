@@ -17,11 +17,14 @@
     along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <stdlib.h>
 #include <string.h>
 #include <libsoup/soup.h>
 #include <json-glib/json-glib.h>
 
 #include "client-request.h"
+#include "client-log.h"
+#include "client-timeline.h"
 
 
 struct _ClientRequest {
@@ -33,6 +36,8 @@ struct _ClientRequest {
     gpointer user_data;
     GError * error;
     GInputStream * stream;
+    SoupMessage * msg;
+    gboolean new_connection;
 };
 
 G_DEFINE_TYPE(ClientRequest, client_request, G_TYPE_OBJECT);
@@ -51,6 +56,7 @@ static void client_request_dispose(GObject * obj) {
     g_clear_object(&req->cancel_mgr_request);
     g_clear_object(&req->parser);
     g_clear_object(&req->stream);
+    g_clear_object(&req->msg);
 
     G_OBJECT_CLASS(client_request_parent_class)->dispose(obj);
 }
@@ -75,6 +81,27 @@ void client_request_cancel(ClientRequest * req) {
 }
 
 
+gint client_request_get_retry_after(ClientRequest * req) {
+    const gchar * retry_after = req->msg ?
+        soup_message_headers_get_one(req->msg->response_headers, "Retry-After") : NULL;
+    if (retry_after && g_ascii_isdigit(*retry_after))
+        return strtol(retry_after, NULL, 10);
+    return -1;
+}
+
+
+gboolean client_request_long_poll_applied(ClientRequest * req) {
+    const gchar * applied = req->msg ?
+        soup_message_headers_get_one(req->msg->response_headers, "Preference-Applied") : NULL;
+    return applied && g_str_has_prefix(applied, "wait=");
+}
+
+
+gboolean client_request_reused_connection(ClientRequest * req) {
+    return !req->new_connection;
+}
+
+
 JsonNode * client_request_get_result(ClientRequest * req, GError ** error) {
     if (error)
         *error = req->error;
@@ -101,7 +128,7 @@ static void request_parsed_cb(GObject * object, GAsyncResult * res, gpointer use
     }
 
     req->error = error;
-    if (!req->error) {
+    if (!req->error && client_log_debug_enabled()) {
         g_autoptr(JsonGenerator) gen = json_generator_new();
         json_generator_set_root(gen, json_parser_get_root(req->parser));
         g_autofree gchar * response = json_generator_to_data(gen, NULL);
@@ -151,6 +178,26 @@ static ClientRequest * client_request_new_base(ClientConf * conf,
     return req;
 }
 
+/*
+ * Network event handler. Events other than the request being sent only happen
+ * when the message opens a new connection instead of reusing a kept-alive one.
+ */
+static void request_network_event_cb(SoupMessage * msg, GSocketClientEvent event,
+                                     GIOStream * connection, gpointer user_data) {
+    ClientRequest * req = CLIENT_REQUEST(user_data);
+    if (event == G_SOCKET_CLIENT_RESOLVING || event == G_SOCKET_CLIENT_CONNECTING)
+        req->new_connection = TRUE;
+}
+
+
+static void client_request_send(ClientRequest * req, SoupMessage * msg) {
+    req->msg = msg;
+    g_signal_connect_object(msg, "network-event", G_CALLBACK(request_network_event_cb), req, 0);
+    soup_session_send_async(req->soup, msg, req->cancel_mgr_request,
+                            request_finished_cb, g_object_ref(req));
+}
+
+
 ClientRequest * client_request_new(ClientConf * conf, const gchar * path,
         ClientRequestCallback cb, gpointer user_data) {
     ClientRequest * req = client_request_new_base(conf, cb, user_data);
@@ -158,8 +205,7 @@ ClientRequest * client_request_new(ClientConf * conf, const gchar * path,
     g_autofree gchar * uri = client_conf_get_connection_uri(conf, path);
     SoupMessage * msg = soup_message_new("GET", uri);
     g_debug("GET request to %s", uri);
-    soup_session_send_async(req->soup, msg, req->cancel_mgr_request,
-                            request_finished_cb, g_object_ref(req));
+    client_request_send(req, msg);
 
     return req;
 }
@@ -168,6 +214,13 @@ ClientRequest * client_request_new(ClientConf * conf, const gchar * path,
 ClientRequest * client_request_new_with_data(ClientConf * conf, const gchar * path,
         const gchar * post_data, const gchar * loggable_post_data,
         ClientRequestCallback cb, gpointer user_data) {
+    return client_request_new_long_poll(conf, path, post_data, loggable_post_data, 0, cb, user_data);
+}
+
+
+ClientRequest * client_request_new_long_poll(ClientConf * conf, const gchar * path,
+        const gchar * post_data, const gchar * loggable_post_data, gint wait,
+        ClientRequestCallback cb, gpointer user_data) {
     ClientRequest * req = client_request_new_base(conf, cb, user_data);
 
     g_autofree gchar * uri = client_conf_get_connection_uri(conf, path);
@@ -175,8 +228,50 @@ ClientRequest * client_request_new_with_data(ClientConf * conf, const gchar * pa
     
     g_debug("POST request to %s, body:\n%s", uri, loggable_post_data);
     soup_message_set_request(msg, "text/json", SOUP_MEMORY_COPY, post_data, strlen(post_data));
-    soup_session_send_async(req->soup, msg, req->cancel_mgr_request,
-                            request_finished_cb, g_object_ref(req));
+    if (wait > 0) {
+        // RFC 7240, brokers that do not support it just answer right away
+        g_autofree gchar * prefer = g_strdup_printf("wait=%d", wait);
+        soup_message_headers_replace(msg->request_headers, "Prefer", prefer);
+    }
+    client_request_send(req, msg);
 
     return req;
 }
+
+
+/*
+ * Prewarm response handler. Any response, even an error status, leaves the
+ * connection open in the Soup session pool.
+ */
+static void prewarm_finished_cb(SoupSession * soup, SoupMessage * msg, gpointer user_data) {
+    g_autofree gchar * span = user_data;
+    client_timeline_end(span);
+    if (SOUP_STATUS_IS_TRANSPORT_ERROR(msg->status_code))
+        g_debug("Failed to pre-warm a connection: %s", msg->reason_phrase);
+    else
+        g_debug("Pre-warmed connection, status %u", msg->status_code);
+}
+
+
+void client_request_prewarm(ClientConf * conf, const gchar * host) {
+    g_autofree gchar * uri = NULL;
+    if (host) {
+        // The host may come with its own port, otherwise use the manager port
+        const gchar * port = client_conf_get_port(conf);
+        g_autoptr(GSocketConnectable) address =
+            g_network_address_parse(host, port && port[0] ? atoi(port) : 443, NULL);
+        if (!address) return;
+        uri = g_strdup_printf("https://%s:%u/",
+                              g_network_address_get_hostname(G_NETWORK_ADDRESS(address)),
+                              g_network_address_get_port(G_NETWORK_ADDRESS(address)));
+    } else {
+        uri = client_conf_get_connection_uri(conf, "/");
+    }
+    SoupMessage * msg = uri ? soup_message_new("HEAD", uri) : NULL;
+    if (!msg) return;
+
+    g_debug("Pre-warming connection to %s", uri);
+    gchar * span = g_strdup_printf("prewarm:%s", host ? host : client_conf_get_host(conf));
+    client_timeline_begin(span);
+    soup_session_queue_message(client_conf_get_soup_session(conf), msg, prewarm_finished_cb, span);
+}
@@ -53,6 +53,51 @@ ClientRequest * client_request_new(ClientConf * conf, const gchar * path,
  */
 ClientRequest * client_request_new_with_data(ClientConf * conf, const gchar * path,
     const gchar * post_data, const gchar * loggable_post_data, ClientRequestCallback cb, gpointer user_data);
+
+/*
+ * client_request_new_long_poll
+ *
+ * Create a new POST request, with data, that asks the server to hold the response
+ * for up to wait seconds until there is something new (long polling).
+ */
+ClientRequest * client_request_new_long_poll(ClientConf * conf, const gchar * path,
+    const gchar * post_data, const gchar * loggable_post_data, gint wait,
+    ClientRequestCallback cb, gpointer user_data);
+
+/*
+ * client_request_long_poll_applied
+ *
+ * Whether the server held the response of a long poll request, so that the next
+ * poll can be sent right away.
+ */
+gboolean client_request_long_poll_applied(ClientRequest * req);
+
+/*
+ * client_request_get_retry_after
+ *
+ * Get the delay in seconds before the next request that the server asked for in
+ * a Retry-After header, or -1 if it did not.
+ */
+gint client_request_get_retry_after(ClientRequest * req);
+
+/*
+ * client_request_reused_connection
+ *
+ * Whether the request was sent on a kept-alive connection, instead of opening
+ * a new one.
+ */
+gboolean client_request_reused_connection(ClientRequest * req);
+
+/*
+ * client_request_prewarm
+ *
+ * Resolve host ("host[:port]", with the manager port by default) and open a TLS
+ * connection to it in the background, so that the next requests start on a hot
+ * connection and the next handshakes can resume its TLS session. Pass a NULL host
+ * to pre-warm the connection to the manager.
+ */
+void client_request_prewarm(ClientConf * conf, const gchar * host);
+
 /*
  * client_request_cancel
  * 
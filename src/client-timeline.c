@@ -0,0 +1,194 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "client-timeline.h"
+
+/*
+ * Upper bound of recorded points, in case the startup never finishes.
+ */
+#define TIMELINE_MAX_EVENTS 1024
+
+typedef struct _TimelineEvent {
+    gchar * name;
+    gint64 start, end;      // end is -1 while the span is open, start for instants
+    gboolean instant;
+    guint thread;
+} TimelineEvent;
+
+static GMutex timeline_mutex;
+static GArray * events = NULL;
+static gint64 origin = 0;
+static gboolean reported = FALSE;
+static GHashTable * thread_ids = NULL;
+
+
+static void clear_event(gpointer data) {
+    g_free(((TimelineEvent *)data)->name);
+}
+
+
+/*
+ * Must be called with timeline_mutex held.
+ */
+static void init_timeline(gint64 now) {
+    if (!events) {
+        events = g_array_new(FALSE, FALSE, sizeof(TimelineEvent));
+        g_array_set_clear_func(events, clear_event);
+        thread_ids = g_hash_table_new(NULL, NULL);
+    }
+    if (!origin) origin = now;
+}
+
+
+/*
+ * Small thread numbers make traces easier to read than pointers.
+ * Must be called with timeline_mutex held.
+ */
+static guint current_thread_id() {
+    gpointer thread = g_thread_self();
+    guint id = GPOINTER_TO_UINT(g_hash_table_lookup(thread_ids, thread));
+    if (!id) {
+        id = g_hash_table_size(thread_ids) + 1;
+        g_hash_table_insert(thread_ids, thread, GUINT_TO_POINTER(id));
+    }
+    return id;
+}
+
+
+static void add_event(const gchar * name, gboolean instant) {
+    gint64 now = g_get_monotonic_time();
+    g_mutex_lock(&timeline_mutex);
+    init_timeline(now);
+    // Points after the report would never be seen
+    if (reported || events->len >= TIMELINE_MAX_EVENTS) {
+        g_mutex_unlock(&timeline_mutex);
+        return;
+    }
+    TimelineEvent event = {
+        .name = g_strdup(name), .start = now, .end = instant ? now : -1,
+        .instant = instant, .thread = current_thread_id()
+    };
+    g_array_append_val(events, event);
+    g_mutex_unlock(&timeline_mutex);
+}
+
+
+void client_timeline_start() {
+    g_mutex_lock(&timeline_mutex);
+    init_timeline(g_get_monotonic_time());
+    g_mutex_unlock(&timeline_mutex);
+}
+
+
+void client_timeline_mark(const gchar * name) {
+    add_event(name, TRUE);
+}
+
+
+void client_timeline_begin(const gchar * name) {
+    add_event(name, FALSE);
+}
+
+
+void client_timeline_end(const gchar * name) {
+    gint64 now = g_get_monotonic_time();
+    int i;
+    g_mutex_lock(&timeline_mutex);
+    for (i = events && !reported ? (int)events->len - 1 : -1; i >= 0; --i) {
+        TimelineEvent * event = &g_array_index(events, TimelineEvent, i);
+        if (event->end < 0 && g_str_equal(event->name, name)) {
+            event->end = now;
+            break;
+        }
+    }
+    g_mutex_unlock(&timeline_mutex);
+}
+
+
+gchar * client_timeline_summary() {
+    GString * summary = g_string_new(NULL);
+    int i;
+    g_mutex_lock(&timeline_mutex);
+    for (i = 0; events && i < events->len; ++i) {
+        TimelineEvent * event = &g_array_index(events, TimelineEvent, i);
+        if (i > 0) g_string_append_c(summary, ' ');
+        g_string_append_printf(summary, "%s=%.1f", event->name, (event->start - origin) / 1000.0);
+        if (!event->instant && event->end >= 0)
+            g_string_append_printf(summary, "+%.1f", (event->end - event->start) / 1000.0);
+        else if (!event->instant)
+            g_string_append(summary, "+?");
+    }
+    g_mutex_unlock(&timeline_mutex);
+    return g_string_free(summary, FALSE);
+}
+
+
+gboolean client_timeline_write_trace(const gchar * file_name, GError ** error) {
+    GString * trace = g_string_new("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    int i;
+    g_mutex_lock(&timeline_mutex);
+    for (i = 0; events && i < events->len; ++i) {
+        TimelineEvent * event = &g_array_index(events, TimelineEvent, i);
+        g_autofree gchar * name = g_strescape(event->name, NULL);
+        g_string_append_printf(trace,
+            "%s{\"name\": \"%s\", \"cat\": \"startup\", \"pid\": 1, \"tid\": %u, \"ts\": %" G_GINT64_FORMAT,
+            i > 0 ? ",\n" : "", name, event->thread, event->start - origin);
+        if (event->instant)
+            g_string_append(trace, ", \"ph\": \"i\", \"s\": \"g\"}");
+        else if (event->end >= 0)
+            g_string_append_printf(trace, ", \"ph\": \"X\", \"dur\": %" G_GINT64_FORMAT "}",
+                                   event->end - event->start);
+        else
+            g_string_append(trace, ", \"ph\": \"B\"}");
+    }
+    g_mutex_unlock(&timeline_mutex);
+    g_string_append(trace, "\n]}\n");
+
+    gboolean result = g_file_set_contents(file_name, trace->str, trace->len, error);
+    g_string_free(trace, TRUE);
+    return result;
+}
+
+
+void client_timeline_report() {
+    g_mutex_lock(&timeline_mutex);
+    gboolean already_reported = reported;
+    reported = TRUE;
+    g_mutex_unlock(&timeline_mutex);
+    if (already_reported) return;
+
+    g_autofree gchar * summary = client_timeline_summary();
+    g_message("Startup timeline (ms): %s", summary);
+
+    const gchar * trace_file = g_getenv("FLEXVDI_STARTUP_TRACE");
+    if (trace_file) {
+        g_autoptr(GError) error = NULL;
+        if (!client_timeline_write_trace(trace_file, &error))
+            g_warning("Failed to write startup trace: %s", error->message);
+    }
+}
+
+
+void client_timeline_reset() {
+    g_mutex_lock(&timeline_mutex);
+    if (events) g_array_set_size(events, 0);
+    origin = 0;
+    reported = FALSE;
+    g_mutex_unlock(&timeline_mutex);
+}
@@ -0,0 +1,92 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CLIENT_TIMELINE_H
+#define _CLIENT_TIMELINE_H
+
+#include <glib.h>
+
+
+/*
+ * Startup timeline
+ *
+ * Monotonic timestamps of the key points from launch to the first frame. Points
+ * are either instants (client_timeline_mark) or spans (client_timeline_begin and
+ * client_timeline_end, matched by name). They can be recorded from any thread.
+ * Nothing is recorded after client_timeline_report, until the next reset.
+ */
+
+/*
+ * client_timeline_start
+ *
+ * Set the origin of the timeline. Call it as early as possible. Otherwise, the
+ * first recorded point is the origin.
+ */
+void client_timeline_start();
+
+/*
+ * client_timeline_mark
+ *
+ * Record an instant.
+ */
+void client_timeline_mark(const gchar * name);
+
+/*
+ * client_timeline_begin, client_timeline_end
+ *
+ * Record the beginning and the end of a span. client_timeline_end closes the
+ * last open span with the same name.
+ */
+void client_timeline_begin(const gchar * name);
+void client_timeline_end(const gchar * name);
+
+/*
+ * client_timeline_summary
+ *
+ * Get the timeline as a single line: "name=start" for instants and
+ * "name=start+duration" for spans, in milliseconds since the origin.
+ */
+gchar * client_timeline_summary();
+
+/*
+ * client_timeline_write_trace
+ *
+ * Write the timeline to a file in Chrome trace event format (JSON), which can be
+ * loaded in chrome://tracing or Perfetto.
+ */
+gboolean client_timeline_write_trace(const gchar * file_name, GError ** error);
+
+/*
+ * client_timeline_report
+ *
+ * Log the summary line and, if FLEXVDI_STARTUP_TRACE is set, write the trace to
+ * that file. Only the first call does something, so it can be called at every
+ * point that may end the startup.
+ */
+void client_timeline_report();
+
+/*
+ * client_timeline_reset
+ *
+ * Forget all the recorded points, and allow a new report.
+ */
+void client_timeline_reset();
+
+
+#endif /* _CLIENT_TIMELINE_H */
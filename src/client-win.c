@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include "client-win.h"
+#include "client-timeline.h"
 
 
 struct _ClientAppWindow {
@@ -55,6 +56,7 @@ struct _ClientAppWindow {
 enum {
     CLIENT_APP_BUTTON_PRESSED = 0,
     CLIENT_APP_DESKTOP_SELECTED,
+    CLIENT_APP_LOGIN_TYPING,
     CLIENT_APP_LAST_SIGNAL
 };
 
@@ -115,11 +117,23 @@ static void client_app_window_class_init(ClientAppWindowClass * class) {
                      g_cclosure_marshal_VOID__VOID,
                      G_TYPE_NONE,
                      0);
+
+    // Emited when the user edits the username or the password in the login page
+    signals[CLIENT_APP_LOGIN_TYPING] =
+        g_signal_new("login-typing",
+                     CLIENT_APP_WINDOW_TYPE,
+                     G_SIGNAL_RUN_FIRST,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_marshal_VOID__VOID,
+                     G_TYPE_NONE,
+                     0);
 }
 
 
 static void button_pressed_handler(GtkButton * button, gpointer user_data);
 static void entry_activate_handler(GtkEntry * entry, gpointer user_data);
+static void entry_changed_handler(GtkEditable * editable, gpointer user_data);
 static void desktop_selected_handler(GtkTreeView * tree_view, GtkTreePath * path,
                                      GtkTreeViewColumn * column, gpointer user_data);
 
@@ -138,6 +152,8 @@ static void client_app_window_init(ClientAppWindow * win) {
     g_signal_connect(win->connect, "clicked", G_CALLBACK(button_pressed_handler), win);
     g_signal_connect(win->back, "clicked", G_CALLBACK(button_pressed_handler), win);
     g_signal_connect(win->password, "activate", G_CALLBACK(entry_activate_handler), win);
+    g_signal_connect(win->username, "changed", G_CALLBACK(entry_changed_handler), win);
+    g_signal_connect(win->password, "changed", G_CALLBACK(entry_changed_handler), win);
     g_signal_connect(win->desktops, "row-activated", G_CALLBACK(desktop_selected_handler), win);
 }
 
@@ -163,6 +179,7 @@ ClientAppWindow * client_app_window_new(ClientApp * app, ClientConf * conf) {
     /* Set the CSS rules for all the widgets in the current screen. This includes other
        windows too, but it is done here because this is the first window and there is
        only one */
+    client_timeline_begin("css-load");
     GtkCssProvider * css_provider = gtk_css_provider_new();
     gtk_css_provider_load_from_resource(css_provider, "/com/flexvdi/client/style.css");
     GdkScreen * screen = gtk_widget_get_screen(GTK_WIDGET(win));
@@ -178,6 +195,7 @@ ClientAppWindow * client_app_window_new(ClientApp * app, ClientConf * conf) {
         gtk_style_context_add_provider_for_screen(screen, GTK_STYLE_PROVIDER(css_provider),
                                                   GTK_STYLE_PROVIDER_PRIORITY_USER + 2);
     }
+    client_timeline_end("css-load");
 
     g_autofree gchar * custom_toolbar_logo = client_conf_get_custom_toolbar_logo(conf);
     if (custom_toolbar_logo != NULL) {
@@ -236,6 +254,15 @@ static void entry_activate_handler(GtkEntry * entry, gpointer user_data) {
 }
 
 
+/*
+ * Entry box changed, for the login page when the user types.
+ */
+static void entry_changed_handler(GtkEditable * editable, gpointer user_data) {
+    ClientAppWindow * win = CLIENT_APP_WINDOW(user_data);
+    g_signal_emit(win, signals[CLIENT_APP_LOGIN_TYPING], 0);
+}
+
+
 /*
  * Desktop selected handler, for double-clicks on the desktop list.
  */
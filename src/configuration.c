@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include "configuration.h"
 #include "client-log.h"
+#include "client-timeline.h"
 
 struct _ClientConf {
     GObject parent;
@@ -29,6 +30,8 @@ struct _ClientConf {
     GKeyFile * file;
     gchar * file_name;
     gboolean had_file;
+    GThread * load_thread;
+    GThread * terminal_id_thread;
     SoupSession * soup;
     // Main options
     gchar * host;
@@ -37,6 +40,8 @@ struct _ClientConf {
     gchar * password;
     gchar * passfile;
     gchar * terminal_id;
+    // IDs replaced by a validation, callers may still hold them
+    GSList * old_terminal_ids;
     gchar * uri;
     gboolean kiosk_mode;
     // Session options
@@ -45,6 +50,7 @@ struct _ClientConf {
     gboolean fullscreen;
     gint inactivity_timeout;
     gboolean disable_printing;
+    gint print_memory_spool;
     gboolean auto_clipboard;
     gboolean auto_usbredir;
     gboolean disable_copy_from_guest;
@@ -61,6 +67,7 @@ struct _ClientConf {
     // Device options
     gchar ** redir_remote;
     gchar ** redir_local;
+    gchar ** gateways;
     gchar * usb_auto_filter;
     gchar * usb_connect_filter;
     gchar ** serial_params;
@@ -82,6 +89,7 @@ static void client_conf_load(ClientConf * conf);
 static gboolean set_proxy_uri(const gchar * option_name, const gchar * value, gpointer data, GError ** error);
 static gboolean set_toolbar_edge(const gchar * option_name, const gchar * value, gpointer data, GError ** error);
 static gboolean set_log_level(const gchar * option_name, const gchar * value, gpointer data, GError ** error);
+static gboolean set_log_rotation(const gchar * option_name, const gchar * value, gpointer data, GError ** error);
 static gboolean add_option_to_table(const gchar * option_name, const gchar * value, gpointer data, GError ** error);
 
 static void client_conf_init(ClientConf * conf) {
@@ -108,6 +116,12 @@ static void client_conf_init(ClientConf * conf) {
         "Enable kiosk mode", NULL },
         { "log-level", 'v', 0, G_OPTION_ARG_CALLBACK, set_log_level,
         "Log level for each domain, or for all messages if domain is ommited. 0 = ERROR, 5 = DEBUG", "<[domain:]level,...>" },
+        { "log-rotate", 0, 0, G_OPTION_ARG_CALLBACK, set_log_rotation,
+        "Rotate the log file when it grows over size (default 10M, 0 = never), keeping this many files (default 5)",
+        "<size[K|M|G][,files]>" },
+        { "gateway", 0, 0, G_OPTION_ARG_STRING_ARRAY, &conf->gateways,
+        "Candidate WebSocket gateway; the one with the lowest latency is used. Can appear multiple times",
+        "<host[:port]>" },
         { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
     };
     gsize num_main_options = G_N_ELEMENTS(main_options) - 1;
@@ -121,6 +135,8 @@ static void client_conf_init(ClientConf * conf) {
         "Close the client after a certain time of inactivity", "<seconds>" },
         { "flexvdi-disable-printing", 0, 0, G_OPTION_ARG_NONE, &conf->disable_printing,
         "Disable printing support", NULL },
+        { "print-memory-spool", 0, 0, G_OPTION_ARG_INT, &conf->print_memory_spool,
+        "Spool print jobs in memory up to this size, then on disk (0 = always on disk)", "<MiB>" },
         { "auto-clipboard", 0, 0, G_OPTION_ARG_NONE, &conf->auto_clipboard,
         "Automatically share clipboard between guest and client", NULL },
         { "no-auto-clipboard", 0, G_OPTION_FLAG_HIDDEN | G_OPTION_FLAG_REVERSE,
@@ -166,7 +182,9 @@ static void client_conf_init(ClientConf * conf) {
           "Filter selecting USB devices to redirect on connect", "<filter-string>" },
         { "flexvdi-serial-port", 0, 0, G_OPTION_ARG_STRING_ARRAY, &conf->serial_params,
         "Add serial port redirection. Can appear multiple times. "
-        "Example: /dev/ttyS0,9600,8N1", "<device,speed,mode>" },
+        "Example: /dev/ttyS0,9600,8N1. Optionally, data from the device is sent in chunks "
+        "of up to chunk bytes, or after timeout ms without new data",
+        "<device,speed,mode[,chunk[,timeout]]>" },
         { "share-printer", 'P', 0, G_OPTION_ARG_STRING_ARRAY, &conf->printers,
         "Share a client's printer with the virtual desktop. Can appear multiple times",
         "<printer_name>" },
@@ -212,6 +230,10 @@ static void client_conf_init(ClientConf * conf) {
 
 static void client_conf_finalize(GObject * obj) {
     ClientConf * conf = CLIENT_CONF(obj);
+    if (conf->load_thread)
+        g_thread_join(conf->load_thread);
+    if (conf->terminal_id_thread)
+        g_free(g_thread_join(conf->terminal_id_thread));
     g_free(conf->file_name);
     g_free(conf->main_options);
     g_free(conf->session_options);
@@ -227,10 +249,12 @@ static void client_conf_finalize(GObject * obj) {
     g_strfreev(conf->serial_params);
     g_strfreev(conf->redir_remote);
     g_strfreev(conf->redir_local);
+    g_strfreev(conf->gateways);
     g_free(conf->usb_auto_filter);
     g_free(conf->usb_connect_filter);
     g_free(conf->preferred_compression);
     g_free(conf->terminal_id);
+    g_slist_free_full(conf->old_terminal_ids, g_free);
     g_free(conf->shared_folder);
     g_strfreev(conf->printers);
     g_key_file_free(conf->file);
@@ -518,6 +542,11 @@ gboolean client_conf_get_disable_printing(ClientConf * conf) {
 }
 
 
+gint client_conf_get_print_memory_spool(ClientConf * conf) {
+    return conf->print_memory_spool;
+}
+
+
 gboolean client_conf_get_disable_copy_from_guest(ClientConf * conf) {
     return conf->disable_copy_from_guest;
 }
@@ -568,6 +597,11 @@ gchar ** client_conf_get_local_redirections(ClientConf * conf) {
 }
 
 
+gchar ** client_conf_get_gateways(ClientConf * conf) {
+    return conf->gateways;
+}
+
+
 gchar ** client_conf_get_remote_redirections(ClientConf * conf) {
     return conf->redir_remote;
 }
@@ -630,15 +664,92 @@ static void write_int(GKeyFile * file, const gchar * group, const gchar * key, g
  */
 gchar * discover_terminal_id();
 
+static gpointer discover_terminal_id_thread(gpointer user_data) {
+    client_timeline_begin("terminal-id");
+    gchar * id = discover_terminal_id();
+    client_timeline_end("terminal-id");
+    return id;
+}
+
+
+/*
+ * Save a newly discovered terminal ID. The "terminal-id-discovered" key tells
+ * later runs that it comes from the hardware and can be validated against it;
+ * neither random IDs nor IDs set by the user are ever replaced.
+ */
+static void set_discovered_terminal_id(ClientConf * conf, gchar * id) {
+    gboolean discovered = id[0] != '\0';
+    // The previous ID was handed out by client_conf_get_terminal_id
+    if (conf->terminal_id)
+        conf->old_terminal_ids = g_slist_prepend(conf->old_terminal_ids, conf->terminal_id);
+    if (discovered) {
+        conf->terminal_id = id;
+    } else {
+        g_free(id);
+        conf->terminal_id = g_uuid_string_random();
+    }
+    write_string(conf->file, "General", "terminal-id", conf->terminal_id);
+    g_key_file_set_boolean(conf->file, "General", "terminal-id-discovered", discovered);
+    client_conf_save(conf);
+}
+
+
+static void terminal_id_validated(GObject * source_object, GAsyncResult * res, gpointer user_data) {
+    ClientConf * conf = CLIENT_CONF(source_object);
+    g_autofree gchar * id = g_task_propagate_pointer(G_TASK(res), NULL);
+    if (id && id[0] != '\0' && g_strcmp0(id, conf->terminal_id)) {
+        g_message("Terminal ID changed from %s to %s", conf->terminal_id, id);
+        set_discovered_terminal_id(conf, g_steal_pointer(&id));
+    }
+}
+
+
+static void validate_terminal_id(GTask * task, gpointer source_object,
+                                 gpointer task_data, GCancellable * cancellable) {
+    g_task_return_pointer(task, discover_terminal_id_thread(NULL), g_free);
+}
+
+
+/*
+ * Discovering the terminal ID enumerates the network interfaces, which can be
+ * slow, so it runs in a thread while the UI is built. When the ID is already
+ * cached (warm start) it is used right away, and the discovery only validates it
+ * in the background; a change is applied when it finishes, so requests made from
+ * then on use the new ID. Strings returned before stay valid.
+ */
+static void start_terminal_id_discovery(ClientConf * conf) {
+    if (!conf->terminal_id) {
+        client_timeline_mark("cold-start");
+        conf->terminal_id_thread = g_thread_new("terminal-id", discover_terminal_id_thread, NULL);
+    } else {
+        client_timeline_mark("warm-start");
+        if (!g_hash_table_contains(conf->cmdline_options, "terminal-id") &&
+            g_key_file_get_boolean(conf->file, "General", "terminal-id-discovered", NULL)) {
+            g_autoptr(GTask) task = g_task_new(conf, NULL, terminal_id_validated, NULL);
+            g_task_run_in_thread(task, validate_terminal_id);
+        }
+    }
+}
+
+
+// Whether the terminal ID is known, so that getting it does not wait for the discovery
+gboolean client_conf_has_terminal_id(ClientConf * conf) {
+    return conf->terminal_id != NULL;
+}
+
+
 const gchar * client_conf_get_terminal_id(ClientConf * conf) {
     if (!conf->terminal_id) {
-        conf->terminal_id = discover_terminal_id();
-        if (conf->terminal_id[0] == '\0') {
-            g_free(conf->terminal_id);
-            conf->terminal_id = g_uuid_string_random();
+        gchar * id;
+        if (conf->terminal_id_thread) {
+            client_timeline_begin("terminal-id-wait");
+            id = g_thread_join(conf->terminal_id_thread);
+            conf->terminal_id_thread = NULL;
+            client_timeline_end("terminal-id-wait");
+        } else {
+            id = discover_terminal_id_thread(NULL);
         }
-        write_string(conf->file, "General", "terminal-id", conf->terminal_id);
-        client_conf_save(conf);
+        set_discovered_terminal_id(conf, id);
     }
     return conf->terminal_id;
 }
@@ -688,6 +799,36 @@ void client_conf_set_fullscreen(ClientConf * conf, gboolean fs) {
 }
 
 
+gchar * client_conf_get_last_gateway(ClientConf * conf) {
+    client_conf_wait_loaded(conf);
+    return g_key_file_get_string(conf->file, "General", "last-gateway", NULL);
+}
+
+
+void client_conf_set_last_gateway(ClientConf * conf, const gchar * gateway) {
+    g_autofree gchar * last = client_conf_get_last_gateway(conf);
+    if (!g_strcmp0(last, gateway)) return;
+
+    write_string(conf->file, "General", "last-gateway", (gchar *)gateway);
+    client_conf_save(conf);
+}
+
+
+gchar * client_conf_get_network_gateway(ClientConf * conf, const gchar * network) {
+    client_conf_wait_loaded(conf);
+    return g_key_file_get_string(conf->file, "Gateways", network, NULL);
+}
+
+
+void client_conf_set_network_gateway(ClientConf * conf, const gchar * network, const gchar * gateway) {
+    g_autofree gchar * last = client_conf_get_network_gateway(conf, network);
+    if (!g_strcmp0(last, gateway)) return;
+
+    write_string(conf->file, "Gateways", network, (gchar *)gateway);
+    client_conf_save(conf);
+}
+
+
 static gboolean set_proxy_uri(const gchar * option_name, const gchar * value, gpointer data, GError ** error) {
     ClientConf * conf = CLIENT_CONF(data);
     g_free(conf->proxy_uri);
@@ -746,6 +887,16 @@ static gboolean set_log_level(const gchar * option_name, const gchar * value, gp
 }
 
 
+static gboolean set_log_rotation(const gchar * option_name, const gchar * value, gpointer data, GError ** error) {
+    if (!client_log_set_rotation(value)) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "Invalid log rotation %s", value);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
 void client_conf_share_printer(ClientConf * conf, const gchar * printer, gboolean share) {
     // Insert/remove the printer from the list, but appear only once
     gchar ** sel_printer = conf->printers;
@@ -864,25 +1015,58 @@ gboolean client_conf_get_window_size(ClientConf * conf, gint id,
 static void try_migrate_legacy_config_file(const gchar * new_file_name);
 
 /*
- * client_conf_load
+ * load_config_file
  *
- * Load the configuration file
+ * Read the configuration file, migrating the legacy one first if needed. This runs
+ * in a thread while the application starts up, and nothing else touches conf->file
+ * until client_conf_wait_loaded joins it.
  */
-static void client_conf_load(ClientConf * conf) {
+static gpointer load_config_file(gpointer user_data) {
+    ClientConf * conf = CLIENT_CONF(user_data);
     GError * error = NULL;
-    int i;
-    gchar * cb_arg;
 
-    if (!g_file_test(conf->file_name, G_FILE_TEST_EXISTS))
+    client_timeline_begin("config-load");
+    if (!g_file_test(conf->file_name, G_FILE_TEST_EXISTS)) {
+        client_timeline_begin("legacy-config-migration");
         try_migrate_legacy_config_file(conf->file_name);
+        client_timeline_end("legacy-config-migration");
+    }
 
-    if (!g_key_file_load_from_file(conf->file, conf->file_name,
-            G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, &error)) {
+    gboolean loaded = g_key_file_load_from_file(conf->file, conf->file_name,
+            G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, &error);
+    if (!loaded) {
         if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
             g_warning("Error loading settings file: %s", error->message);
         g_error_free(error);
-        return;
     }
+    client_timeline_end("config-load");
+    return GINT_TO_POINTER(loaded);
+}
+
+
+/*
+ * client_conf_load
+ *
+ * Start loading the configuration file in the background.
+ */
+static void client_conf_load(ClientConf * conf) {
+    conf->load_thread = g_thread_new("config-load", load_config_file, conf);
+}
+
+
+static void start_terminal_id_discovery(ClientConf * conf);
+
+/*
+ * apply_config_file
+ *
+ * Set the options from the loaded configuration file, except those provided in
+ * the command line.
+ */
+static void apply_config_file(ClientConf * conf) {
+    GError * error = NULL;
+    int i;
+    gchar * cb_arg;
+
     conf->had_file = TRUE;
 
     // Load options in a section for each option group
@@ -935,6 +1119,18 @@ static void client_conf_load(ClientConf * conf) {
 }
 
 
+void client_conf_wait_loaded(ClientConf * conf) {
+    if (!conf->load_thread) return;
+
+    client_timeline_begin("config-wait");
+    gboolean loaded = GPOINTER_TO_INT(g_thread_join(conf->load_thread));
+    conf->load_thread = NULL;
+    client_timeline_end("config-wait");
+    if (loaded) apply_config_file(conf);
+    start_terminal_id_discovery(conf);
+}
+
+
 gchar * client_conf_get_custom_style_file(ClientConf * conf) {
     return g_key_file_get_string(conf->file, "Custom", "css", NULL);
 }
@@ -970,6 +1166,7 @@ void client_conf_save(ClientConf * conf) {
 #ifdef ANDROID
     return;
 #endif
+    client_conf_wait_loaded(conf);
 
     GError * error = NULL;
     save_config_file(conf->file, conf->file_name, &error);
@@ -101,6 +101,15 @@ void client_conf_set_gtk_session_options(ClientConf * conf, GObject * gtk_sessio
  */
 void client_conf_set_display_options(ClientConf * conf, GObject * display, gboolean grab_enable);
 
+/*
+ * client_conf_wait_loaded
+ *
+ * The configuration file is loaded in the background once the command-line options
+ * have been handled. Wait for it and apply its options. Call it before using any
+ * option; it does nothing after the first call.
+ */
+void client_conf_wait_loaded(ClientConf * conf);
+
 /*
  * client_conf_had_file
  *
@@ -124,7 +133,9 @@ gchar * client_conf_get_connection_uri(ClientConf * conf, const gchar * path);
 gboolean client_conf_get_fullscreen(ClientConf * conf);
 gchar ** client_conf_get_serial_params(ClientConf * conf);
 gboolean client_conf_get_disable_printing(ClientConf * conf);
+gint client_conf_get_print_memory_spool(ClientConf * conf);
 const gchar * client_conf_get_terminal_id(ClientConf * conf);
+gboolean client_conf_has_terminal_id(ClientConf * conf);
 gboolean client_conf_get_disable_copy_from_guest(ClientConf * conf);
 gboolean client_conf_get_disable_paste_to_guest(ClientConf * conf);
 gboolean client_conf_get_disable_power_actions(ClientConf * conf);
@@ -136,6 +147,7 @@ SoupSession * client_conf_get_soup_session(ClientConf * conf);
 WindowEdge client_conf_get_toolbar_edge(ClientConf * conf);
 gchar ** client_conf_get_local_redirections(ClientConf * conf);
 gchar ** client_conf_get_remote_redirections(ClientConf * conf);
+gchar ** client_conf_get_gateways(ClientConf * conf);
 
 /*
  * Setters for those options that can be saved to disk.
@@ -152,6 +164,20 @@ void client_conf_set_window_size(ClientConf * conf, gint id,
 gboolean client_conf_get_window_size(ClientConf * conf, gint id,
     int * width, int * height, gboolean * maximized, int * monitor);
 
+/*
+ * The WebSocket gateway of the last session, so that the next one can warm up
+ * a connection to it while the user logs in. It is saved right away.
+ */
+gchar * client_conf_get_last_gateway(ClientConf * conf);
+void client_conf_set_last_gateway(ClientConf * conf, const gchar * gateway);
+
+/*
+ * The gateway selected on each network, so that it is used right away the next
+ * time. It is saved right away.
+ */
+gchar * client_conf_get_network_gateway(ClientConf * conf, const gchar * network);
+void client_conf_set_network_gateway(ClientConf * conf, const gchar * network, const gchar * gateway);
+
 /*
  * Custom style getters
  */
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <flexdp.h>
 #include "conn-forward.h"
+#include "client-log.h"
 
 struct _ConnForwarder {
     GObject parent;
@@ -468,10 +469,10 @@ static void connection_write_callback(GObject * source_object, GAsyncResult * re
         connection_close_unref(conn);
     } else {
         bytes = (GBytes *)g_queue_pop_head(conn->write_buffer);
-        g_debug("Written %d bytes on connection %u", num_written, conn->id);
+        client_debug("Written %d bytes on connection %u", num_written, conn->id);
         remaining = g_bytes_get_size(bytes) - num_written;
         if (remaining) {
-            g_debug("Still %d bytes to go on connection %u", remaining, conn->id);
+            client_debug("Still %d bytes to go on connection %u", remaining, conn->id);
             new_bytes = g_bytes_new_from_bytes(bytes, num_written, remaining);
             g_queue_push_head(conn->write_buffer, new_bytes);
         }
@@ -599,7 +600,7 @@ static void handle_close(ConnForwarder * cf, FlexVDIForwardCloseMsg * msg) {
 
 static void handle_ack(ConnForwarder * cf, FlexVDIForwardAckMsg * msg) {
     Connection * conn = g_hash_table_lookup(cf->connections, GUINT_TO_POINTER(msg->id));
-    g_debug("ACK command for connection %u with %d bytes", msg->id, (int)msg->size);
+    client_debug("ACK command for connection %u with %d bytes", msg->id, (int)msg->size);
     if (conn) {
         if (conn->connecting) {
             conn->connecting = FALSE;
@@ -0,0 +1,294 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "gateway-select.h"
+#include "client-timeline.h"
+
+#ifdef G_LOG_DOMAIN
+#undef G_LOG_DOMAIN
+#endif
+#define G_LOG_DOMAIN "flexvdi-gw"
+
+
+// Seconds to wait for a gateway to answer a probe
+#define PROBE_TIMEOUT 5
+
+
+static void add_candidate(GPtrArray * candidates, const gchar * gateway) {
+    guint i;
+    if (!gateway || !gateway[0]) return;
+    for (i = 0; i < candidates->len; ++i)
+        if (!g_strcmp0(g_ptr_array_index(candidates, i), gateway)) return;
+    g_ptr_array_add(candidates, g_strdup(gateway));
+}
+
+
+gchar ** gateway_select_candidates(ClientConf * conf, JsonObject * params) {
+    GPtrArray * candidates = g_ptr_array_new();
+    gchar ** gateway;
+    guint i;
+
+    if (json_object_has_member(params, "spice_address"))
+        add_candidate(candidates, json_object_get_string_member(params, "spice_address"));
+    JsonNode * node = json_object_get_member(params, "gateways");
+    if (node && JSON_NODE_HOLDS_ARRAY(node)) {
+        JsonArray * gateways = json_node_get_array(node);
+        for (i = 0; i < json_array_get_length(gateways); ++i) {
+            JsonNode * element = json_array_get_element(gateways, i);
+            if (JSON_NODE_HOLDS_VALUE(element))
+                add_candidate(candidates, json_node_get_string(element));
+        }
+    }
+    for (gateway = client_conf_get_gateways(conf); gateway && *gateway; ++gateway)
+        add_candidate(candidates, *gateway);
+
+    g_ptr_array_add(candidates, NULL);
+    return (gchar **)g_ptr_array_free(candidates, FALSE);
+}
+
+
+/*
+ * Identify the current network by the local address that the system would use to
+ * reach a gateway, masked to its subnet (/24 for IPv4, /64 for IPv6), so that it
+ * does not change when DHCP hands out another address. Connecting a datagram socket
+ * sends nothing, it just selects the route.
+ */
+static gchar * get_network_key(GSocketAddress * dest) {
+    if (!G_IS_INET_SOCKET_ADDRESS(dest)) return NULL;
+    GInetAddress * dest_addr = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(dest));
+    GSocketFamily family = g_inet_address_get_family(dest_addr);
+    g_autoptr(GSocket) sock =
+        g_socket_new(family, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, NULL);
+    if (!sock || !g_socket_connect(sock, dest, NULL, NULL)) return NULL;
+    g_autoptr(GSocketAddress) local = g_socket_get_local_address(sock, NULL);
+    if (!local) return NULL;
+
+    GInetAddress * local_addr = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(local));
+    gsize size = g_inet_address_get_native_size(local_addr);
+    guint prefix = size == 4 ? 24 : 64;
+    guint8 bytes[16];
+    memcpy(bytes, g_inet_address_to_bytes(local_addr), size);
+    memset(bytes + prefix / 8, 0, size - prefix / 8);
+    g_autoptr(GInetAddress) network = g_inet_address_new_from_bytes(bytes, family);
+    g_autofree gchar * network_str = g_inet_address_to_string(network);
+    return g_strdup_printf("%s/%u", network_str, prefix);
+}
+
+
+typedef struct {
+    ClientConf * conf;
+    gchar ** candidates;
+    guint16 default_port;
+    gchar * network;
+    GSocketClient * client;
+    GCancellable * cancel_probes;
+    GCancellable * cancellable;
+    gulong cancel_handler;
+    gint64 start;
+    gint pending;
+    gchar * winner;
+    gboolean returned;
+} Selection;
+
+static void selection_free(Selection * sel) {
+    if (sel->cancellable) {
+        g_cancellable_disconnect(sel->cancellable, sel->cancel_handler);
+        g_object_unref(sel->cancellable);
+    }
+    g_strfreev(sel->candidates);
+    g_free(sel->network);
+    g_free(sel->winner);
+    g_object_unref(sel->client);
+    g_object_unref(sel->cancel_probes);
+    g_free(sel);
+}
+
+
+/*
+ * Complete the selection, only once; probes that go on after a cached gateway
+ * is selected just refresh the cache.
+ */
+static void selection_return(GTask * task, const gchar * gateway) {
+    Selection * sel = g_task_get_task_data(task);
+    if (sel->returned) return;
+    sel->returned = TRUE;
+    client_timeline_end("gateway-select");
+    if (gateway)
+        g_task_return_pointer(task, g_strdup(gateway), g_free);
+    else if (!g_task_return_error_if_cancelled(task))
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_HOST_UNREACHABLE,
+                                "None of the %u gateways answered", g_strv_length(sel->candidates));
+}
+
+
+static void cancel_probes(GCancellable * cancellable, gpointer user_data) {
+    g_cancellable_cancel(G_CANCELLABLE(user_data));
+}
+
+
+// Gateways use the same certificates as the manager, which are not checked either
+static gboolean accept_certificate(GTlsConnection * conn, GTlsCertificate * cert,
+                                   GTlsCertificateFlags errors, gpointer user_data) {
+    return TRUE;
+}
+
+
+static void probe_event(GSocketClient * client, GSocketClientEvent event,
+                        GSocketConnectable * connectable, GIOStream * connection,
+                        gpointer user_data) {
+    if (event == G_SOCKET_CLIENT_TLS_HANDSHAKING)
+        g_signal_connect(connection, "accept-certificate", G_CALLBACK(accept_certificate), NULL);
+}
+
+
+typedef struct {
+    GTask * task;
+    gchar * gateway;
+} Probe;
+
+/*
+ * Probe finished handler. The first gateway to complete the TLS handshake wins;
+ * the other probes are cancelled.
+ */
+static void probe_finished(GObject * source, GAsyncResult * res, gpointer user_data) {
+    Probe * probe = user_data;
+    GTask * task = probe->task;
+    Selection * sel = g_task_get_task_data(task);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GSocketConnection) conn =
+        g_socket_client_connect_to_host_finish(G_SOCKET_CLIENT(source), res, &error);
+    gint64 rtt = (g_get_monotonic_time() - sel->start) / 1000;
+
+    if (conn && !sel->winner) {
+        sel->winner = g_strdup(probe->gateway);
+        g_message("Gateway %s answered first among %u, in %" G_GINT64_FORMAT " ms",
+                  sel->winner, g_strv_length(sel->candidates), rtt);
+        g_cancellable_cancel(sel->cancel_probes);
+        if (sel->network)
+            client_conf_set_network_gateway(sel->conf, sel->network, sel->winner);
+        selection_return(task, sel->winner);
+    } else if (error && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_message("Gateway %s did not answer: %s", probe->gateway, error->message);
+    }
+
+    if (--sel->pending == 0)
+        selection_return(task, NULL);
+    g_free(probe->gateway);
+    g_free(probe);
+    g_object_unref(task);
+}
+
+
+static void start_probes(GTask * task) {
+    Selection * sel = g_task_get_task_data(task);
+    gchar ** gateway;
+
+    sel->start = g_get_monotonic_time();
+    for (gateway = sel->candidates; *gateway; ++gateway) {
+        Probe * probe = g_new0(Probe, 1);
+        probe->task = g_object_ref(task);
+        probe->gateway = g_strdup(*gateway);
+        sel->pending++;
+        g_debug("Probing gateway %s", *gateway);
+        g_socket_client_connect_to_host_async(sel->client, *gateway, sel->default_port,
+                                              sel->cancel_probes, probe_finished, probe);
+    }
+}
+
+
+/*
+ * The first candidate has been resolved, look for the gateway selected before
+ * on this network, and probe them all.
+ */
+static void network_resolved(GObject * source, GAsyncResult * res, gpointer user_data) {
+    GTask * task = G_TASK(user_data);
+    Selection * sel = g_task_get_task_data(task);
+    g_autoptr(GSocketAddress) address =
+        g_socket_address_enumerator_next_finish(G_SOCKET_ADDRESS_ENUMERATOR(source), res, NULL);
+
+    if (address)
+        sel->network = get_network_key(address);
+    g_autofree gchar * cached =
+        sel->network ? client_conf_get_network_gateway(sel->conf, sel->network) : NULL;
+    if (cached && g_strv_contains((const gchar * const *)sel->candidates, cached)) {
+        g_message("Using gateway %s, selected before on network %s", cached, sel->network);
+        selection_return(task, cached);
+    }
+
+    if (g_cancellable_is_cancelled(sel->cancel_probes))
+        selection_return(task, NULL);
+    else
+        start_probes(task);
+    g_object_unref(task);
+}
+
+
+void gateway_select_async(ClientConf * conf, gchar ** candidates, GCancellable * cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data) {
+    GTask * task = g_task_new(conf, cancellable, callback, user_data);
+    g_task_set_source_tag(task, gateway_select_async);
+
+    guint num_candidates = candidates ? g_strv_length(candidates) : 0;
+    if (num_candidates <= 1) {
+        if (num_candidates)
+            g_task_return_pointer(task, g_strdup(candidates[0]), g_free);
+        else
+            g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No candidate gateways");
+        g_object_unref(task);
+        return;
+    }
+
+    Selection * sel = g_new0(Selection, 1);
+    sel->conf = conf;
+    sel->candidates = g_strdupv(candidates);
+    const gchar * port = client_conf_get_port(conf);
+    sel->default_port = port && port[0] ? atoi(port) : 443;
+    sel->client = g_socket_client_new();
+    g_socket_client_set_tls(sel->client, TRUE);
+    g_socket_client_set_timeout(sel->client, PROBE_TIMEOUT);
+    g_signal_connect(sel->client, "event", G_CALLBACK(probe_event), NULL);
+    sel->cancel_probes = g_cancellable_new();
+    if (cancellable) {
+        sel->cancellable = g_object_ref(cancellable);
+        sel->cancel_handler = g_cancellable_connect(cancellable, G_CALLBACK(cancel_probes),
+                                                    sel->cancel_probes, NULL);
+    }
+    g_task_set_task_data(task, sel, (GDestroyNotify)selection_free);
+    client_timeline_begin("gateway-select");
+
+    g_autoptr(GSocketConnectable) first =
+        g_network_address_parse(candidates[0], sel->default_port, NULL);
+    if (first) {
+        g_autoptr(GSocketAddressEnumerator) enumerator = g_socket_connectable_enumerate(first);
+        g_socket_address_enumerator_next_async(enumerator, sel->cancel_probes,
+                                               network_resolved, task);
+    } else {
+        start_probes(task);
+        g_object_unref(task);
+    }
+}
+
+
+gchar * gateway_select_finish(ClientConf * conf, GAsyncResult * result, GError ** error) {
+    g_return_val_if_fail(g_task_is_valid(result, conf), NULL);
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
@@ -0,0 +1,65 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GATEWAY_SELECT_H
+#define _GATEWAY_SELECT_H
+
+#include <gio/gio.h>
+#include <json-glib/json-glib.h>
+
+#include "configuration.h"
+
+
+/*
+ * Gateway selection
+ *
+ * A deployment may offer several WebSocket gateways, e.g. one per region. The client
+ * probes all of them in parallel and connects through the one that answers first.
+ */
+
+/*
+ * gateway_select_candidates
+ *
+ * Get the candidate gateways of a WebSocket session: the spice_address of the
+ * desktop response, those listed in its "gateways" member, and those in the
+ * configuration, without repetitions. Free with g_strfreev.
+ */
+gchar ** gateway_select_candidates(ClientConf * conf, JsonObject * params);
+
+/*
+ * gateway_select_async
+ *
+ * Select the gateway with the lowest latency among the candidates ("host[:port]",
+ * with the manager port by default), measured as the time to open a TCP connection
+ * and complete the TLS handshake. The choice is cached per network: when the cached
+ * gateway is still a candidate it is selected right away, and the candidates are
+ * probed in the background to refresh it for the next time.
+ */
+void gateway_select_async(ClientConf * conf, gchar ** candidates, GCancellable * cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data);
+
+/*
+ * gateway_select_finish
+ *
+ * Get the selected gateway, or NULL and an error if none of the candidates answered.
+ */
+gchar * gateway_select_finish(ClientConf * conf, GAsyncResult * result, GError ** error);
+
+
+#endif /* _GATEWAY_SELECT_H */
@@ -19,9 +19,11 @@
 
 #include "client-app.h"
 #include "client-log.h"
+#include "client-timeline.h"
 
 
 int main (int argc, char * argv[]) {
+    client_timeline_start();
     client_log_setup();
     return g_application_run(G_APPLICATION(client_app_new()), argc, argv);
 }
@@ -27,12 +27,102 @@
 #include "flexvdi-port.h"
 
 
+/*
+ * Process-wide cache of CUPS destinations and printer connections. The
+ * destination list and every connected printer expire after CUPS_CACHE_TTL.
+ * Printers are also invalidated when they disappear from the destination list
+ * or when a request to them fails. A cached printer is used by one thread at a
+ * time; concurrent users of the same printer get a private connection. A job
+ * that fails on a cached connection is retried once on a new one, in case the
+ * server closed it while it was idle.
+ */
+#define CUPS_CACHE_TTL (60 * G_TIME_SPAN_SECOND)
+
+typedef struct CupsPrinter {
+    gchar * name;
+    cups_dest_t * dest;
+    cups_dinfo_t * dinfo;
+    http_t * http;
+    gint64 expires;
+    // Protected by the cache lock
+    gboolean cached, stale, in_use;
+    // Checked out from the cache rather than connected for this request
+    gboolean reused;
+} CupsPrinter;
+
+static struct {
+    GMutex lock;
+    cups_dest_t * dests;
+    int num_dests;
+    gint64 dests_expire;
+    GHashTable * printers;
+    guint dest_hits, dest_misses;
+    guint printer_hits, printer_misses;
+} cache;
+
+
+static void cups_printer_destroy(CupsPrinter * cups) {
+    cupsFreeDestInfo(cups->dinfo);
+    httpClose(cups->http);
+    cupsFreeDests(1, cups->dest);
+    g_free(cups->name);
+    g_free(cups);
+}
+
+
+static gboolean cups_dest_exists(const char * printer) {
+    g_autofree gchar * name = g_strdup(printer);
+    gchar * instance;
+    if ((instance = g_strrstr(name, "/")) != NULL)
+        *instance++ = '\0';
+    return cupsGetDest(name, instance, cache.num_dests, cache.dests) != NULL;
+}
+
+
+/*
+ * Takes the cache lock, refreshing the destination list when it has expired.
+ * The list is queried without the lock, so that other threads can still use
+ * the cached printers meanwhile.
+ */
+static void cups_cache_lock_dests() {
+    g_mutex_lock(&cache.lock);
+    if (cache.dests && g_get_monotonic_time() < cache.dests_expire) {
+        ++cache.dest_hits;
+        return;
+    }
+    ++cache.dest_misses;
+    g_debug("CUPS destination list expired (%u hits, %u misses)",
+            cache.dest_hits, cache.dest_misses);
+    g_mutex_unlock(&cache.lock);
+
+    cups_dest_t * dests;
+    int num_dests = cupsGetDests(&dests);
+    g_mutex_lock(&cache.lock);
+    cupsFreeDests(cache.num_dests, cache.dests);
+    cache.dests = dests;
+    cache.num_dests = num_dests;
+    cache.dests_expire = g_get_monotonic_time() + CUPS_CACHE_TTL;
+    if (!cache.printers)
+        cache.printers = g_hash_table_new(g_str_hash, g_str_equal);
+
+    GHashTableIter it;
+    CupsPrinter * cups;
+    g_hash_table_iter_init(&it, cache.printers);
+    while (g_hash_table_iter_next(&it, NULL, (gpointer *)&cups)) {
+        if (!cups_dest_exists(cups->name)) {
+            g_debug("Printer %s is gone, invalidating it", cups->name);
+            cups->stale = TRUE;
+        }
+    }
+}
+
+
 int flexvdi_get_printer_list(GSList ** printers) {
     int i;
-    cups_dest_t * dests, * dest;
-    int num_dests = cupsGetDests(&dests);
+    cups_dest_t * dest;
     *printers = NULL;
-    for (i = num_dests, dest = dests; i > 0; --i, ++dest) {
+    cups_cache_lock_dests();
+    for (i = cache.num_dests, dest = cache.dests; i > 0; --i, ++dest) {
         if (dest->instance) {
             char * full_instance = g_strconcat(dest->name, "/", dest->instance, NULL);
             *printers = g_slist_prepend(*printers, full_instance);
@@ -40,46 +130,105 @@ int flexvdi_get_printer_list(GSList ** printers) {
             *printers = g_slist_prepend(*printers, g_strdup(dest->name));
         }
     }
-    cupsFreeDests(num_dests, dests);
+    g_mutex_unlock(&cache.lock);
     return TRUE;
 }
 
 
-typedef struct CupsPrinter {
-    cups_dest_t * dests, * dest;
-    int num_dests;
-    cups_dinfo_t * dinfo;
-    http_t * http;
-} CupsPrinter;
+/*
+ * Checks out a cached printer, if there is a valid one that is not in use.
+ * Must be called with the cache lock held.
+ */
+static CupsPrinter * cups_cache_checkout(const char * printer, gboolean * busy) {
+    CupsPrinter * cups = g_hash_table_lookup(cache.printers, printer);
+    *busy = FALSE;
+    if (!cups) return NULL;
+    if (cups->in_use) {
+        *busy = TRUE;
+        return NULL;
+    }
+    if (!cups->stale && g_get_monotonic_time() < cups->expires) {
+        cups->in_use = cups->reused = TRUE;
+        return cups;
+    }
+    g_hash_table_remove(cache.printers, printer);
+    cups_printer_destroy(cups);
+    return NULL;
+}
 
 
 static CupsPrinter * cups_printer_new(const char * printer) {
-    CupsPrinter * cups = (CupsPrinter *)g_malloc0(sizeof(CupsPrinter));
-    g_autofree gchar * name = g_strdup(printer), * instance;
+    gboolean busy;
+    cups_dest_t * dest = NULL;
+
+    cups_cache_lock_dests();
+    CupsPrinter * cups = cups_cache_checkout(printer, &busy);
+    if (cups) {
+        ++cache.printer_hits;
+        g_debug("CUPS cache hit for %s (%u hits, %u misses)", printer,
+                cache.printer_hits, cache.printer_misses);
+        g_mutex_unlock(&cache.lock);
+        return cups;
+    }
+    ++cache.printer_misses;
+    g_debug("CUPS cache miss for %s%s (%u hits, %u misses)", printer,
+            busy ? ", in use" : "", cache.printer_hits, cache.printer_misses);
+    g_autofree gchar * name = g_strdup(printer);
+    gchar * instance;
     if ((instance = g_strrstr(name, "/")) != NULL)
         *instance++ = '\0';
-    cups->num_dests = cupsGetDests(&cups->dests);
-    if (cups->dests) {
-        cups->dest = cupsGetDest(name, instance, cups->num_dests, cups->dests);
-        if (cups->dest) {
-            cups->http = cupsConnectDest(cups->dest, CUPS_DEST_FLAGS_NONE,
-                                         30000, NULL, NULL, 0, NULL, NULL);
-            if (cups->http) {
-                cups->dinfo = cupsCopyDestInfo(cups->http, cups->dest);
-            }
+    cups_dest_t * cached_dest = cupsGetDest(name, instance, cache.num_dests, cache.dests);
+    if (cached_dest)
+        cupsCopyDest(cached_dest, 0, &dest);
+    g_mutex_unlock(&cache.lock);
+
+    cups = (CupsPrinter *)g_malloc0(sizeof(CupsPrinter));
+    cups->name = g_strdup(printer);
+    cups->dest = dest;
+    if (cups->dest) {
+        cups->http = cupsConnectDest(cups->dest, CUPS_DEST_FLAGS_NONE,
+                                     30000, NULL, NULL, 0, NULL, NULL);
+        if (cups->http) {
+            cups->dinfo = cupsCopyDestInfo(cups->http, cups->dest);
         }
     }
-    if (!cups->dinfo)
+    if (!cups->dinfo) {
         g_warning("Failed to contact CUPS for printer %s", printer);
+    } else if (!busy) {
+        g_mutex_lock(&cache.lock);
+        if (!g_hash_table_contains(cache.printers, cups->name)) {
+            cups->cached = TRUE;
+            cups->expires = g_get_monotonic_time() + CUPS_CACHE_TTL;
+            cups->in_use = TRUE;
+            g_hash_table_insert(cache.printers, cups->name, cups);
+        }
+        g_mutex_unlock(&cache.lock);
+    }
     return cups;
 }
 
 
+/*
+ * Marks the printer for removal from the cache, after a failed request.
+ */
+static void cups_printer_invalidate(CupsPrinter * cups) {
+    g_mutex_lock(&cache.lock);
+    cups->stale = TRUE;
+    g_mutex_unlock(&cache.lock);
+}
+
+
 static void cups_printer_delete(CupsPrinter * cups) {
-    cupsFreeDestInfo(cups->dinfo);
-    httpClose(cups->http);
-    cupsFreeDests(cups->num_dests, cups->dests);
-    g_free(cups);
+    if (cups->cached) {
+        g_mutex_lock(&cache.lock);
+        gboolean stale = cups->stale;
+        if (stale)
+            g_hash_table_remove(cache.printers, cups->name);
+        cups->in_use = FALSE;
+        g_mutex_unlock(&cache.lock);
+        if (!stale) return;
+    }
+    cups_printer_destroy(cups);
 }
 
 
@@ -182,30 +331,58 @@ static void cups_printer_get_media_types(PPDGenerator * ppd, CupsPrinter * cups)
 }
 
 
-char * get_ppd_file(const char * printer) {
-    char * result = NULL;
+/*
+ * CUPS updates printer-config-change-time whenever the queue or its PPD
+ * change. It is asked for alone, on the default connection, instead of
+ * copying the whole destination info.
+ */
+char * get_printer_config_marker(const char * printer) {
+    static const char * attrs[] = { "printer-config-change-time" };
+    g_autofree gchar * name = g_strdup(printer);
+    gchar * instance;
+    if ((instance = g_strrstr(name, "/")) != NULL)
+        *instance++ = '\0';
+    cups_cache_lock_dests();
+    cups_dest_t * dest = cupsGetDest(name, instance, cache.num_dests, cache.dests);
+    g_autofree gchar * uri = dest ?
+        g_strdup(cupsGetOption("printer-uri-supported", dest->num_options, dest->options)) : NULL;
+    g_mutex_unlock(&cache.lock);
+    if (!uri) return NULL;
+
+    ipp_t * request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
+    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri", NULL, uri);
+    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes",
+                  G_N_ELEMENTS(attrs), NULL, attrs);
+    ipp_t * response = cupsDoRequest(CUPS_HTTP_DEFAULT, request, "/");
+    ipp_attribute_t * attr = response ?
+        ippFindAttribute(response, "printer-config-change-time", IPP_TAG_INTEGER) : NULL;
+    char * marker = attr ? g_strdup_printf("%s %d", uri, ippGetInteger(attr, 0)) : NULL;
+    ippDelete(response);
+    return marker;
+}
+
+
+PPDGenerator * get_ppd_generator(const char * printer) {
     PPDGenerator * ppd = ppd_generator_new(printer);
-    if (ppd) {
-        CupsPrinter * cups = cups_printer_new(printer);
-        if (cups->dinfo) {
-            ppd_generator_set_color(ppd, cups_printer_attr_has_others(cups, CUPS_PRINT_COLOR_MODE, "monochrome"));
-            ppd_generator_set_duplex(ppd, cups_printer_attr_has_others(cups, CUPS_SIDES, "one-sided"));
-            cups_printer_get_resolutions(ppd, cups);
-            cups_printer_get_papers(ppd, cups);
-            cups_printer_get_media_sources(ppd, cups);
-            cups_printer_get_media_types(ppd, cups);
-            result = g_strdup(ppd_generator_run(ppd));
-        }
-        cups_printer_delete(cups);
+    CupsPrinter * cups = cups_printer_new(printer);
+    if (cups->dinfo) {
+        ppd_generator_set_color(ppd, cups_printer_attr_has_others(cups, CUPS_PRINT_COLOR_MODE, "monochrome"));
+        ppd_generator_set_duplex(ppd, cups_printer_attr_has_others(cups, CUPS_SIDES, "one-sided"));
+        cups_printer_get_resolutions(ppd, cups);
+        cups_printer_get_papers(ppd, cups);
+        cups_printer_get_media_sources(ppd, cups);
+        cups_printer_get_media_types(ppd, cups);
+    } else {
+        g_clear_object(&ppd);
     }
-    g_object_unref(ppd);
-    return result;
+    cups_printer_delete(cups);
+    return ppd;
 }
 
 
-static int cups_printer_get_media_option(CupsPrinter * cups, char * job_options,
+static int cups_printer_get_media_option(CupsPrinter * cups, GHashTable * job_options,
                                          int num_options, cups_option_t ** options) {
-    g_autofree gchar * media = get_job_options(job_options, "media");
+    const char * media = job_options_get(job_options, "media");
     if (media) {
         int width, length, result;
         cups_size_t size;
@@ -226,9 +403,9 @@ static int cups_printer_get_media_option(CupsPrinter * cups, char * job_options,
 }
 
 
-static int cups_printer_get_media_source_opt(CupsPrinter * cups, char * job_options,
+static int cups_printer_get_media_source_opt(CupsPrinter * cups, GHashTable * job_options,
                                              int num_options, cups_option_t ** options) {
-    g_autofree gchar * media_source = get_job_options(job_options, "media-source");
+    const char * media_source = job_options_get(job_options, "media-source");
     ipp_attribute_t * attr = cups_printer_attr_supported(cups, CUPS_MEDIA_SOURCE);
     if (media_source) {
         int value = atoi(media_source);
@@ -242,9 +419,9 @@ static int cups_printer_get_media_source_opt(CupsPrinter * cups, char * job_opti
 }
 
 
-static int cups_printer_get_media_type_opt(CupsPrinter * cups, char * job_options,
+static int cups_printer_get_media_type_opt(CupsPrinter * cups, GHashTable * job_options,
                                            int num_options, cups_option_t ** options) {
-    g_autofree gchar * media_type = get_job_options(job_options, "media-type");
+    const char * media_type = job_options_get(job_options, "media-type");
     ipp_attribute_t * attr = cups_printer_attr_supported(cups, CUPS_MEDIA_TYPE);
     if (media_type) {
         int value = atoi(media_type);
@@ -258,13 +435,13 @@ static int cups_printer_get_media_type_opt(CupsPrinter * cups, char * job_option
 }
 
 
-static int cups_printer_job_options_to_cups(CupsPrinter * cups, char * job_options,
+static int cups_printer_job_options_to_cups(CupsPrinter * cups, GHashTable * job_options,
                                             cups_option_t ** options) {
-    g_autofree gchar * sides = get_job_options(job_options, "sides"),
-                     * copies = get_job_options(job_options, "copies"),
-                     * nocollate = get_job_options(job_options, "noCollate"),
-                     * resolution = get_job_options(job_options, "Resolution"),
-                     * color = get_job_options(job_options, "color");
+    const char * sides = job_options_get(job_options, "sides"),
+               * copies = job_options_get(job_options, "copies"),
+               * nocollate = job_options_get(job_options, "noCollate"),
+               * resolution = job_options_get(job_options, "Resolution"),
+               * color = job_options_get(job_options, "color");
 
     *options = NULL;
     int num_options = 0;
@@ -287,24 +464,138 @@ static int cups_printer_job_options_to_cups(CupsPrinter * cups, char * job_optio
 
 
 int print_job(PrintJob * job) {
-    g_autofree gchar * printer = get_job_options(job->options, "printer");
-    g_autofree gchar * title = get_job_options(job->options, "title");
-    int result = FALSE;
+    const char * printer = job_options_get(job->option_table, "printer");
+    const char * title = job_options_get(job->option_table, "title");
+    int result = FALSE, retry = TRUE;
 
-    if (printer) {
+    while (printer && !result && retry) {
+        gint64 start = g_get_monotonic_time();
         CupsPrinter * cups = cups_printer_new(printer);
+        gint64 connected = g_get_monotonic_time();
+        job->connect_time += connected - start;
+        retry = FALSE;
         if (cups->dinfo) {
             cups_option_t * options;
-            int num_options = cups_printer_job_options_to_cups(cups, job->options, &options), i;
-            cupsPrintFile2(cups->http, printer, job->name, title ? title : "",
-                           num_options, options);
+            int num_options = cups_printer_job_options_to_cups(cups, job->option_table, &options), i;
+            job->map_time += g_get_monotonic_time() - connected;
+            result = cupsPrintFile2(cups->http, printer, job->name, title ? title : "",
+                                    num_options, options) != 0;
             for (i = 0; i < num_options; ++i) {
                 g_debug("%s = %s", options[i].name, options[i].value);
             }
-            result = TRUE;
+            cupsFreeOptions(num_options, options);
+            if (!result) {
+                g_warning("Failed to print on %s: %s", printer, cupsLastErrorString());
+                cups_printer_invalidate(cups);
+                retry = cups->reused;
+            }
         }
         cups_printer_delete(cups);
     }
 
     return result;
 }
+
+
+typedef struct CupsStream {
+    CupsPrinter * cups;
+    int job_id;
+} CupsStream;
+
+
+/*
+ * Creates the CUPS job and starts its document. Returns the job id, or 0 on
+ * failure, with the printer already invalidated.
+ */
+static int cups_stream_start(PrintJob * job, CupsPrinter * cups, gint64 connected) {
+    const char * title = job_options_get(job->option_table, "title");
+    int job_id = 0;
+    cups_option_t * options;
+    int num_options = cups_printer_job_options_to_cups(cups, job->option_table, &options);
+    job->map_time += g_get_monotonic_time() - connected;
+    ipp_status_t status = cupsCreateDestJob(cups->http, cups->dest, cups->dinfo, &job_id,
+                                            title ? title : "", num_options, options);
+    cupsFreeOptions(num_options, options);
+    if (status != IPP_STATUS_OK) {
+        g_warning("Failed to create CUPS job on %s: %s", cups->name, cupsLastErrorString());
+        cups_printer_invalidate(cups);
+        return 0;
+    }
+
+    if (cupsStartDestDocument(cups->http, cups->dest, cups->dinfo, job_id, title ? title : "",
+                              CUPS_FORMAT_PDF, 0, NULL, 1) != HTTP_STATUS_CONTINUE) {
+        g_warning("Failed to start CUPS document on %s: %s", cups->name, cupsLastErrorString());
+        cupsCancelDestJob(cups->http, cups->dest, job_id);
+        cups_printer_invalidate(cups);
+        return 0;
+    }
+    return job_id;
+}
+
+
+int print_job_stream_open(PrintJob * job) {
+    const char * printer = job_options_get(job->option_table, "printer");
+    int retry = TRUE;
+
+    while (printer && retry) {
+        gint64 start = g_get_monotonic_time();
+        CupsPrinter * cups = cups_printer_new(printer);
+        gint64 connected = g_get_monotonic_time();
+        job->connect_time += connected - start;
+        int job_id = cups->dinfo ? cups_stream_start(job, cups, connected) : 0;
+        if (job_id) {
+            g_debug("Streaming job %u to %s as CUPS job %d", job->id, printer, job_id);
+            CupsStream * stream = g_new(CupsStream, 1);
+            stream->cups = cups;
+            stream->job_id = job_id;
+            job->stream = stream;
+            return TRUE;
+        }
+        retry = cups->dinfo && cups->reused;
+        cups_printer_delete(cups);
+    }
+    return FALSE;
+}
+
+
+int print_job_stream_write(PrintJob * job, const char * data, size_t size) {
+    CupsStream * stream = (CupsStream *)job->stream;
+    if (cupsWriteRequestData(stream->cups->http, data, size) != HTTP_STATUS_CONTINUE) {
+        g_warning("Failed to send data of CUPS job %d: %s", stream->job_id, cupsLastErrorString());
+        cups_printer_invalidate(stream->cups);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+static void cups_stream_delete(PrintJob * job) {
+    CupsStream * stream = (CupsStream *)job->stream;
+    cups_printer_delete(stream->cups);
+    g_free(stream);
+    job->stream = NULL;
+}
+
+
+int print_job_stream_close(PrintJob * job) {
+    CupsStream * stream = (CupsStream *)job->stream;
+    CupsPrinter * cups = stream->cups;
+    int result = cupsFinishDestDocument(cups->http, cups->dest, cups->dinfo) == IPP_STATUS_OK;
+    if (!result) {
+        g_warning("Failed to finish CUPS job %d: %s", stream->job_id, cupsLastErrorString());
+        // The job is printed again from the spool file, do not leave a half one
+        cupsCancelDestJob(cups->http, cups->dest, stream->job_id);
+        cups_printer_invalidate(cups);
+    }
+    cups_stream_delete(job);
+    return result;
+}
+
+
+void print_job_stream_cancel(PrintJob * job) {
+    CupsStream * stream = (CupsStream *)job->stream;
+    CupsPrinter * cups = stream->cups;
+    cupsFinishDestDocument(cups->http, cups->dest, cups->dinfo);
+    cupsCancelDestJob(cups->http, cups->dest, stream->job_id);
+    cups_stream_delete(job);
+}
@@ -19,6 +19,7 @@
 
 #include <glib.h>
 #include "printclient-priv.h"
+#include "PPDGenerator.h"
 
 
 int flexvdi_get_printer_list(GSList ** printers) {
@@ -27,7 +28,12 @@ int flexvdi_get_printer_list(GSList ** printers) {
 }
 
 
-char * get_ppd_file(const char * printer) {
+PPDGenerator * get_ppd_generator(const char * printer) {
+    return NULL;
+}
+
+
+char * get_printer_config_marker(const char * printer) {
     return NULL;
 }
 
@@ -35,3 +41,22 @@ char * get_ppd_file(const char * printer) {
 int print_job(PrintJob * job) {
     return FALSE;
 }
+
+
+int print_job_stream_open(PrintJob * job) {
+    return FALSE;
+}
+
+
+int print_job_stream_write(PrintJob * job, const char * data, size_t size) {
+    return FALSE;
+}
+
+
+int print_job_stream_close(PrintJob * job) {
+    return FALSE;
+}
+
+
+void print_job_stream_cancel(PrintJob * job) {
+}
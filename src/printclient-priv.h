@@ -20,16 +20,94 @@
 #ifndef _PRINTCLIENT_PRIV_H_
 #define _PRINTCLIENT_PRIV_H_
 
+#include <glib.h>
+#include <gio/gio.h>
 #include "flexdp.h"
+#include "PPDGenerator.h"
+
+typedef enum PrintJobStreamState {
+    // Spooled to a file and printed with print_job()
+    STREAM_NONE,
+    STREAM_CONNECTING,
+    STREAM_OPEN,
+    // The stream failed or fell behind, the job goes on with a spool file
+    STREAM_FALLBACK,
+} PrintJobStreamState;
 
 typedef struct PrintJob {
     int file_handle;
     char * name;
     char * options;
+    // Options parsed into a table of name -> value, flags have an empty value
+    GHashTable * option_table;
+    // Backend state of a streamed job, NULL when spooling to a file
+    void * stream;
+    gboolean streamed;
+    // Streamed jobs are fed by the print worker and sent by a submit worker.
+    // Sent data is kept for as long as it fits in the replay buffer, so that
+    // the job can still fall back to a spool file. Protected by lock.
+    GMutex lock;
+    GCond cond;
+    PrintJobStreamState stream_state;
+    GQueue unsent, sent;
+    gsize unsent_bytes, sent_bytes;
+    gboolean replayable, buffer_warned;
+    gboolean spool_done, submit_done, aborted;
+    // Spooling state
+    uint32_t id;
+    GQueue pending;
+    gboolean scheduled;
+    gboolean spool_error;
+    gboolean printed;
+    // Memory spooling: file_handle is an anonymous memory file while in_memory
+    gboolean in_memory;
+    gsize memory_limit;
+    guint64 memory_bytes, disk_bytes;
+    // Compressed jobs: bytes counts the received data, raw_bytes the decompressed data
+    GConverter * decompressor;
+    gboolean decompressed;
+    guint64 raw_bytes;
+    gint64 decode_time;
+    guint64 bytes;
+    guint chunks;
+    // Time the main loop waited for the print workers, and data waited in the job queue
+    gint64 stall_time, stall_max;
+    gint64 queue_time, queue_max;
+    // Timeline in monotonic time: job message, data messages, end of data,
+    // end of spooling and submission to the printing system
+    gint64 created, first_data, last_data, completed, spooled, submitted;
+    // Time spent by the backend connecting to the printer and mapping the options
+    gint64 connect_time, map_time;
 } PrintJob;
 
+// Queries the printer capabilities, returns NULL if the printer is not available
+PPDGenerator * get_ppd_generator(const char * printer);
+// Returns a value that changes whenever the printer configuration does, and is much
+// cheaper to get than the capabilities, or NULL if the backend has none
+char * get_printer_config_marker(const char * printer);
+// Returns the PPD of the printer, from the PPD cache if its capabilities did not change.
+// The time spent querying the printer and generating the PPD is optionally returned,
+// and whether it was found by the configuration marker, without querying the capabilities.
+GBytes * get_ppd(const char * printer, gint64 * query_time, gint64 * generate_time,
+                 gboolean * marker_hit);
+// Writes the PPD of the printer to a new temporary file
 char * get_ppd_file(const char * printer);
 int print_job(PrintJob * job);
-char * get_job_options(char * options, const char * opName);
+
+/*
+ * Streaming backends send job data to the printer as it arrives. Opening
+ * returns FALSE when the job must be spooled to a file and printed with
+ * print_job() instead. Once opened, the stream is always finished by either
+ * print_job_stream_close() or print_job_stream_cancel(). Streams are run by
+ * the submit workers; if one fails, the job is spooled to a file from its
+ * replay buffer and printed with print_job().
+ */
+int print_job_stream_open(PrintJob * job);
+int print_job_stream_write(PrintJob * job, const char * data, size_t size);
+int print_job_stream_close(PrintJob * job);
+void print_job_stream_cancel(PrintJob * job);
+GHashTable * job_options_parse(const char * options);
+const char * job_options_get(GHashTable * options, const char * name);
+int job_options_get_int(GHashTable * options, const char * name, int default_value);
 
 #endif /* _PRINTCLIENT_PRIV_H_ */
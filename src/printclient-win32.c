@@ -296,12 +296,12 @@ static wchar_t * as_utf16(char * utf8) {
 }
 
 
-char * get_ppd_file(const char * printer) {
-    PPDGenerator * ppd = ppd_generator_new(printer);
-    char * result = NULL;
+PPDGenerator * get_ppd_generator(const char * printer) {
+    PPDGenerator * ppd = NULL;
 
     ClientPrinter * cprinter = client_printer_new(as_utf16(g_strdup(printer)));
     if (cprinter) {
+        ppd = ppd_generator_new(printer);
         ppd_generator_set_color(ppd,
             client_printer_get_capabilities(cprinter, DC_COLORDEVICE, NULL));
         ppd_generator_set_duplex(ppd,
@@ -311,24 +311,22 @@ char * get_ppd_file(const char * printer) {
         client_printer_get_media_sources(cprinter, ppd);
         client_printer_get_media_types(cprinter, ppd);
         client_printer_delete(cprinter);
-        result = g_strdup(ppd_generator_run(ppd));
     }
 
-    g_object_unref(ppd);
-    return result;
+    return ppd;
 }
 
 
-static int job_option_get_int(char * options, const char * opName, int defaultValue) {
-    g_autofree gchar * option = get_job_options(options, opName);
-    return option ? atoi(option) : defaultValue;
+char * get_printer_config_marker(const char * printer) {
+    // The spooler has no cheap change marker, the capabilities are always queried
+    return NULL;
 }
 
 
 static void client_printer_get_media_source_option(ClientPrinter * printer,
-                                                   char * jobOptions,
+                                                   GHashTable * jobOptions,
                                                    DEVMODE * options) {
-    int mediaSource = job_option_get_int(jobOptions, "media-source", 0);
+    int mediaSource = job_options_get_int(jobOptions, "media-source", 0);
     if (mediaSource < 0 || mediaSource >= client_printer_get_capabilities(printer, DC_BINNAMES, NULL)) {
         g_debug("Media source %d outside [0,%d)",
                    mediaSource, client_printer_get_capabilities(printer, DC_BINNAMES, NULL));
@@ -340,9 +338,9 @@ static void client_printer_get_media_source_option(ClientPrinter * printer,
 
 
 static void client_printer_get_media_type_option(ClientPrinter * printer,
-                                                 char * jobOptions,
+                                                 GHashTable * jobOptions,
                                                  DEVMODE * options) {
-    int mediaType = job_option_get_int(jobOptions, "media-type", 0);
+    int mediaType = job_options_get_int(jobOptions, "media-type", 0);
     if (mediaType < 0 || mediaType >= client_printer_get_capabilities(printer, DC_MEDIATYPENAMES, NULL)) {
         g_debug("Media type %d outside [0,%d)",
                    mediaType, client_printer_get_capabilities(printer, DC_MEDIATYPENAMES, NULL));
@@ -353,8 +351,8 @@ static void client_printer_get_media_type_option(ClientPrinter * printer,
 }
 
 
-static void client_printer_get_duplex_option(char * jobOptions, DEVMODE * options) {
-    g_autofree gchar * sides = get_job_options(jobOptions, "sides");
+static void client_printer_get_duplex_option(GHashTable * jobOptions, DEVMODE * options) {
+    const char * sides = job_options_get(jobOptions, "sides");
     if (sides) {
         options->dmFields |= DM_DUPLEX;
         if (!strcmp(sides, "two-sided-short-edge")) {
@@ -368,13 +366,13 @@ static void client_printer_get_duplex_option(char * jobOptions, DEVMODE * option
 }
 
 
-static void client_printer_get_collate_option(char * jobOptions, DEVMODE * options) {
-    g_autofree gchar * nocollate = get_job_options(jobOptions, "noCollate");
+static void client_printer_get_collate_option(GHashTable * jobOptions, DEVMODE * options) {
+    const char * nocollate = job_options_get(jobOptions, "noCollate");
     if (nocollate) {
         options->dmFields |= DM_COLLATE;
         options->dmCollate = DMCOLLATE_FALSE;
     } else {
-        g_autofree gchar * collate = get_job_options(jobOptions, "Collate");
+        const char * collate = job_options_get(jobOptions, "Collate");
         if (collate) {
             options->dmFields |= DM_COLLATE;
             options->dmCollate = DMCOLLATE_TRUE;
@@ -383,8 +381,8 @@ static void client_printer_get_collate_option(char * jobOptions, DEVMODE * optio
 }
 
 
-static void client_printer_get_resolution_option(char * jobOptions, DEVMODE * options) {
-    int resolution = job_option_get_int(jobOptions, "Resolution", 0);
+static void client_printer_get_resolution_option(GHashTable * jobOptions, DEVMODE * options) {
+    int resolution = job_options_get_int(jobOptions, "Resolution", 0);
     if (resolution) {
         options->dmFields |= DM_PRINTQUALITY | DM_YRESOLUTION;
         options->dmPrintQuality = options->dmYResolution = resolution;
@@ -393,7 +391,7 @@ static void client_printer_get_resolution_option(char * jobOptions, DEVMODE * op
 
 
 static DEVMODE * job_options_to_DevMode(ClientPrinter * printer, const char * pdf,
-                                        char * jobOptions) {
+                                        GHashTable * jobOptions) {
     DEVMODE * options = client_printer_get_doc_props(printer);
     if (options) {
         client_printer_get_media_size_from_file(printer, pdf, options);
@@ -403,8 +401,8 @@ static DEVMODE * job_options_to_DevMode(ClientPrinter * printer, const char * pd
         client_printer_get_collate_option(jobOptions, options);
         client_printer_get_resolution_option(jobOptions, options);
         options->dmFields |= DM_COPIES;
-        options->dmCopies = job_option_get_int(jobOptions, "copies", 1);
-        g_autofree gchar * color = get_job_options(jobOptions, "color");
+        options->dmCopies = job_options_get_int(jobOptions, "copies", 1);
+        const char * color = job_options_get(jobOptions, "color");
         options->dmFields |= DM_COLOR;
         options->dmColor = color ? DMCOLOR_COLOR : DMCOLOR_MONOCHROME;
     }
@@ -476,15 +474,20 @@ static void print_file(ClientPrinter * printer, const char * pdf,
 
 int print_job(PrintJob * job) {
     g_debug("Printing file %s with options %s", job->name, job->options);
-    gchar * printer_name = get_job_options(job->options, "printer");
+    const char * printer_name = job_options_get(job->option_table, "printer");
 
     if (printer_name) {
-        ClientPrinter * printer = client_printer_new(as_utf16(printer_name));
+        gint64 start = g_get_monotonic_time();
+        ClientPrinter * printer = client_printer_new(as_utf16(g_strdup(printer_name)));
+        gint64 connected = g_get_monotonic_time();
+        job->connect_time = connected - start;
 
         if (printer) {
-            DEVMODE * dm = job_options_to_DevMode(printer, job->name, job->options);
+            DEVMODE * dm = job_options_to_DevMode(printer, job->name, job->option_table);
+            job->map_time = g_get_monotonic_time() - connected;
             if (dm) {
-                g_autofree wchar_t * title = as_utf16(get_job_options(job->options, "title"));
+                const char * title_utf8 = job_options_get(job->option_table, "title");
+                g_autofree wchar_t * title = as_utf16(g_strdup(title_utf8 ? title_utf8 : ""));
                 print_file(printer, job->name, title ? title : L"", dm);
             }
 
@@ -495,3 +498,23 @@ int print_job(PrintJob * job) {
 
     return FALSE;
 }
+
+
+// Jobs are rendered with poppler, which needs the whole document
+int print_job_stream_open(PrintJob * job) {
+    return FALSE;
+}
+
+
+int print_job_stream_write(PrintJob * job, const char * data, size_t size) {
+    return FALSE;
+}
+
+
+int print_job_stream_close(PrintJob * job) {
+    return FALSE;
+}
+
+
+void print_job_stream_cancel(PrintJob * job) {
+}
@@ -17,6 +17,9 @@
     along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,13 +27,67 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include "printclient.h"
 #include "printclient-priv.h"
 #include "flexvdi-port.h"
 
+/*
+ * Maximum amount of job data waiting for the print workers. Beyond this point,
+ * the main loop waits for the workers to catch up instead of growing the queue
+ * without bounds. Print workers only do local I/O, the printing system is
+ * left to the submit workers.
+ */
+#define SPOOL_QUEUE_LIMIT (16 * 1024 * 1024)
+
+/*
+ * Number of jobs that are spooled and submitted concurrently.
+ */
+#define PRINT_WORKERS 4
+
+/*
+ * Memory held by a streamed job, both waiting for the printer and already
+ * sent but kept to replay the job into a spool file if the stream fails.
+ * Beyond this point a job that is still connecting falls back to a spool file,
+ * and an open stream drops its replay data.
+ */
+#define STREAM_BUFFER_LIMIT (8 * 1024 * 1024)
+
+/*
+ * Time that unprinted job files are kept for the default PDF viewer.
+ */
+#define OWNED_FILE_TTL (300 * G_TIME_SPAN_SECOND)
+
+/*
+ * PPDs cached by get_ppd() are removed when they have not been used for this
+ * long, in seconds, and only the most recently used ones are kept. A cache hit
+ * refreshes the modification time of the file.
+ */
+#define PPD_CACHE_TTL (30 * 24 * 60 * 60)
+#define PPD_CACHE_MAX 64
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+#define HAVE_MEMFD
+#endif
+
 struct _PrintJobManager {
     GObject parent;
     GHashTable * print_jobs;
+    GThreadPool * workers;
+    // Submits jobs to the printing system, so that the print workers never wait for it
+    GThreadPool * submitters;
+    GMutex spool_lock;
+    GCond spool_cond;
+    gsize spool_queued;
+    gsize memory_spool_limit;
+    // Job files left for the user, in expiry order
+    GQueue owned_files;
+    guint owned_files_timer;
+    // Only updated from the main loop
+    PrintJobStats stats;
 };
 
 enum {
@@ -63,17 +120,37 @@ static void print_job_manager_class_init(PrintJobManagerClass * class) {
 }
 
 
-static gboolean remove_temp_files(gpointer user_data);
+static gpointer remove_stale_files(gpointer user_data);
+static void owned_file_free(gpointer data);
+static void print_worker_run(gpointer data, gpointer user_data);
+static void submit_worker_run(gpointer data, gpointer user_data);
+static void print_job_abort(PrintJob * job);
 
 static void print_job_manager_init(PrintJobManager * pjb) {
-    pjb->print_jobs = g_hash_table_new_full(g_direct_hash, NULL, NULL, g_free);
-    g_timeout_add_seconds(300, remove_temp_files, NULL);
+    pjb->print_jobs = g_hash_table_new_full(g_direct_hash, NULL, NULL,
+                                            (GDestroyNotify)print_job_abort);
+    pjb->workers = g_thread_pool_new(print_worker_run, pjb, PRINT_WORKERS, FALSE, NULL);
+    pjb->submitters = g_thread_pool_new(submit_worker_run, pjb, PRINT_WORKERS, FALSE, NULL);
+    g_mutex_init(&pjb->spool_lock);
+    g_cond_init(&pjb->spool_cond);
+    g_queue_init(&pjb->owned_files);
+    // Files left by previous instances are only looked for once
+    g_thread_unref(g_thread_new("print-cleanup", remove_stale_files, NULL));
 }
 
 
 static void print_job_manager_finalize(GObject * obj) {
     PrintJobManager * pjb = PRINT_JOB_MANAGER(obj);
+    g_thread_pool_free(pjb->workers, FALSE, TRUE);
+    // Unfinished jobs stop their streams, so that the submit workers can exit
     g_hash_table_unref(pjb->print_jobs);
+    g_thread_pool_free(pjb->submitters, FALSE, TRUE);
+    g_mutex_clear(&pjb->spool_lock);
+    g_cond_clear(&pjb->spool_cond);
+    if (pjb->owned_files_timer)
+        g_source_remove(pjb->owned_files_timer);
+    while (!g_queue_is_empty(&pjb->owned_files))
+        owned_file_free(g_queue_pop_head(&pjb->owned_files));
     G_OBJECT_CLASS(print_job_manager_parent_class)->finalize(obj);
 }
 
@@ -83,54 +160,810 @@ PrintJobManager * print_job_manager_new() {
 }
 
 
-static gboolean remove_temp_files(gpointer user_data) {
+void print_job_manager_set_memory_spool_limit(PrintJobManager * pjb, gsize limit) {
+#ifndef HAVE_MEMFD
+    if (limit) g_info("Memory spooling is not supported on this platform");
+#endif
+    pjb->memory_spool_limit = limit;
+}
+
+
+static gchar * get_ppd_cache_dir() {
+    return g_build_filename(g_get_user_cache_dir(), "flexvdi-client", "ppd", NULL);
+}
+
+
+typedef struct CachedPPD {
+    gchar * file;
+    time_t mtime;
+} CachedPPD;
+
+
+static void cached_ppd_free(gpointer data) {
+    g_free(((CachedPPD *)data)->file);
+    g_free(data);
+}
+
+
+static gint cmp_cached_ppd_newest_first(gconstpointer a, gconstpointer b) {
+    time_t ta = (*(CachedPPD **)a)->mtime, tb = (*(CachedPPD **)b)->mtime;
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+
+/*
+ * Removes the cached PPDs that expired or exceed PPD_CACHE_MAX.
+ */
+static void remove_stale_ppds() {
+    g_autofree gchar * cache_dir_name = get_ppd_cache_dir();
+    GDir * cache_dir = g_dir_open(cache_dir_name, 0, NULL);
+    if (!cache_dir) return;
+    g_autoptr(GPtrArray) ppds = g_ptr_array_new_with_free_func(cached_ppd_free);
+    const gchar * basename;
+    GStatBuf file_stat;
+    time_t now = time(NULL);
+    guint i;
+    while ((basename = g_dir_read_name(cache_dir))) {
+        if (!g_str_has_suffix(basename, ".ppd")) continue;
+        CachedPPD * ppd = g_new(CachedPPD, 1);
+        ppd->file = g_build_filename(cache_dir_name, basename, NULL);
+        ppd->mtime = g_stat(ppd->file, &file_stat) ? 0 : file_stat.st_mtime;
+        g_ptr_array_add(ppds, ppd);
+    }
+    g_dir_close(cache_dir);
+    g_ptr_array_sort(ppds, cmp_cached_ppd_newest_first);
+    for (i = 0; i < ppds->len; ++i) {
+        CachedPPD * ppd = g_ptr_array_index(ppds, i);
+        if (i >= PPD_CACHE_MAX || now - ppd->mtime > PPD_CACHE_TTL) {
+            g_debug("Removing cached PPD %s", ppd->file);
+            g_unlink(ppd->file);
+        }
+    }
+}
+
+
+/*
+ * Removes job files left by previous runs, e.g. after a crash, and prunes the
+ * PPD cache.
+ */
+static gpointer remove_stale_files(gpointer user_data) {
     const gchar * tmp_dir_name = g_get_tmp_dir();
     GDir * tmp_dir = g_dir_open(tmp_dir_name, 0, NULL);
     if (tmp_dir) {
-        gchar file[1024];
         const gchar * basename;
         GStatBuf file_stat;
         time_t now = time(NULL);
-        GRegex * regex = g_regex_new("fpj......\\.pdf$", 0, 0, NULL);
         while ((basename = g_dir_read_name(tmp_dir))) {
-            snprintf(file, 1024, "%s/%s", tmp_dir_name, basename);
-            g_stat(file, &file_stat);
-            time_t elapsed = now - file_stat.st_mtime;
+            if (strlen(basename) != 13 || !g_str_has_prefix(basename, "fpj") ||
+                !g_str_has_suffix(basename, ".pdf"))
+                continue;
+            g_autofree gchar * file = g_build_filename(tmp_dir_name, basename, NULL);
             // Remove job files that were last modified at least 5 minutes ago
-            if (g_regex_match(regex, file, 0, NULL) && elapsed > 300) {
+            if (!g_stat(file, &file_stat) &&
+                now - file_stat.st_mtime > OWNED_FILE_TTL / G_TIME_SPAN_SECOND) {
+                g_debug("Removing stale job file %s", file);
                 g_unlink(file);
             }
         }
         g_dir_close(tmp_dir);
-        g_regex_unref(regex);
     }
+    remove_stale_ppds();
+    return NULL;
+}
+
+
+typedef struct OwnedFile {
+    gchar * name;
+    // Memory files only live while this descriptor is open, -1 for disk files
+    int fd;
+    gint64 expiry;
+} OwnedFile;
+
+
+static void owned_file_free(gpointer data) {
+    OwnedFile * file = (OwnedFile *)data;
+    if (file->fd >= 0) close(file->fd);
+    g_free(file->name);
+    g_free(file);
+}
+
+
+static void schedule_owned_files_timer(PrintJobManager * pjb);
+
+static gboolean remove_owned_files(gpointer user_data) {
+    PrintJobManager * pjb = PRINT_JOB_MANAGER(user_data);
+    gint64 now = g_get_monotonic_time();
+    OwnedFile * file;
+    while ((file = g_queue_peek_head(&pjb->owned_files)) && file->expiry <= now) {
+        g_debug("Removing job file %s", file->name);
+        if (file->fd < 0) g_unlink(file->name);
+        owned_file_free(g_queue_pop_head(&pjb->owned_files));
+    }
+    pjb->owned_files_timer = 0;
+    schedule_owned_files_timer(pjb);
+    return FALSE;
+}
+
+
+static void schedule_owned_files_timer(PrintJobManager * pjb) {
+    OwnedFile * file = g_queue_peek_head(&pjb->owned_files);
+    if (file && !pjb->owned_files_timer) {
+        gint64 delay = file->expiry - g_get_monotonic_time();
+        pjb->owned_files_timer =
+            g_timeout_add(delay > 0 ? delay / 1000 + 1 : 0, remove_owned_files, pjb);
+    }
+}
+
+
+/*
+ * Keeps track of a job file until it expires. All files have the same TTL,
+ * so the queue stays sorted and the timer only needs to wait for the head.
+ */
+static void add_owned_file(PrintJobManager * pjb, const gchar * name, int fd) {
+    OwnedFile * file = g_new(OwnedFile, 1);
+    file->name = g_strdup(name);
+    file->fd = fd;
+    file->expiry = g_get_monotonic_time() + OWNED_FILE_TTL;
+    g_queue_push_tail(&pjb->owned_files, file);
+    schedule_owned_files_timer(pjb);
+}
+
+
+static void drop_chunks(GQueue * chunks) {
+    GBytes * chunk;
+    while ((chunk = g_queue_pop_head(chunks)))
+        g_bytes_unref(chunk);
+}
+
+
+static void print_job_free(PrintJob * job) {
+    if (job->stream) print_job_stream_cancel(job);
+    if (job->in_memory && job->file_handle >= 0) close(job->file_handle);
+    drop_chunks(&job->unsent);
+    drop_chunks(&job->sent);
+    g_mutex_clear(&job->lock);
+    g_cond_clear(&job->cond);
+    g_free(job->name);
+    g_free(job->options);
+    g_hash_table_unref(job->option_table);
+    g_clear_object(&job->decompressor);
+    g_free(job);
+}
+
+
+/*
+ * Drops a job that never received all its data. A submit worker may still be
+ * streaming it, and then frees it when it notices.
+ */
+static void print_job_abort(PrintJob * job) {
+    g_mutex_lock(&job->lock);
+    job->aborted = job->spool_done = TRUE;
+    gboolean unused = job->submit_done;
+    g_cond_broadcast(&job->cond);
+    g_mutex_unlock(&job->lock);
+    if (unused) print_job_free(job);
+}
+
+
+/*
+ * Spool operations. Each job keeps a queue of pending operations, which is
+ * run in order by one print worker at a time, so that different jobs progress
+ * concurrently but the operations of a job never overlap.
+ */
+typedef enum SpoolOpType {
+    SPOOL_OPEN,
+    SPOOL_DATA,
+    SPOOL_CLOSE,
+} SpoolOpType;
+
+typedef struct SpoolOp {
+    SpoolOpType type;
+    PrintJobManager * pjb;
+    PrintJob * job;
+    FlexVDIPrintJobDataMsg * msg;
+    gint64 queued;
+} SpoolOp;
+
+
+static void spool_push(PrintJobManager * pjb, SpoolOpType type,
+                       PrintJob * job, FlexVDIPrintJobDataMsg * msg) {
+    SpoolOp * op = g_new(SpoolOp, 1);
+    op->type = type;
+    op->pjb = pjb;
+    op->job = job;
+    op->msg = msg;
+    op->queued = g_get_monotonic_time();
+    g_mutex_lock(&pjb->spool_lock);
+    g_queue_push_tail(&job->pending, op);
+    gboolean schedule = !job->scheduled;
+    job->scheduled = TRUE;
+    g_mutex_unlock(&pjb->spool_lock);
+    if (schedule)
+        g_thread_pool_push(pjb->workers, job, NULL);
+}
+
+
+static SpoolOp * spool_pop(PrintJobManager * pjb, PrintJob * job) {
+    g_mutex_lock(&pjb->spool_lock);
+    SpoolOp * op = g_queue_pop_head(&job->pending);
+    if (!op) job->scheduled = FALSE;
+    g_mutex_unlock(&pjb->spool_lock);
+    return op;
+}
+
+
+#ifdef HAVE_MEMFD
+/*
+ * Anonymous memory files have no name, but other processes, like the default
+ * PDF viewer, can still open them through our descriptor table.
+ */
+static gboolean spool_open_memory(PrintJob * job) {
+    job->file_handle = memfd_create("fpj", MFD_CLOEXEC);
+    if (job->file_handle < 0) {
+        g_debug("Cannot spool job %u in memory: %s", job->id, g_strerror(errno));
+        return FALSE;
+    }
+    job->name = g_strdup_printf("/proc/%d/fd/%d", getpid(), job->file_handle);
+    job->in_memory = TRUE;
     return TRUE;
 }
+#endif
+
+
+static gboolean spool_open_file(PrintJob * job) {
+    g_autoptr(GError) error = NULL;
+#ifdef HAVE_MEMFD
+    if (job->memory_limit && spool_open_memory(job)) return TRUE;
+#endif
+    job->file_handle = g_file_open_tmp("fpjXXXXXX.pdf", &job->name, &error);
+    if (job->file_handle < 0) {
+        g_warning("Failed to create spool file for job %u: %s", job->id, error->message);
+        job->spool_error = TRUE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/*
+ * Jobs for a printer are streamed to it while their data arrives. The stream
+ * is connected by a submit worker, and spooling goes on meanwhile into its
+ * buffer. Other jobs are spooled to a memory or temporary file.
+ */
+static void spool_open(PrintJobManager * pjb, PrintJob * job) {
+    // The protocol has no capability for compressed jobs, agents only send
+    // them when explicitly configured to
+    const char * compression = job_options_get(job->option_table, "compression");
+    if (compression) {
+        if (!strcmp(compression, "deflate")) {
+            job->decompressor =
+                G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+        } else {
+            g_warning("Job %u uses unknown compression %s", job->id, compression);
+            job->spool_error = TRUE;
+            return;
+        }
+    }
+    if (job_options_get(job->option_table, "printer")) {
+        job->stream_state = STREAM_CONNECTING;
+        job->replayable = TRUE;
+        job->submit_done = FALSE;
+        g_thread_pool_push(pjb->submitters, job, NULL);
+    } else {
+        spool_open_file(job);
+    }
+}
+
+
+static gboolean write_all(int fd, const char * data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+        data += written;
+        size -= written;
+    }
+    return TRUE;
+}
+
+
+/*
+ * Moves a memory spooled job that grew beyond the limit to a temporary file.
+ */
+static gboolean spool_migrate(PrintJob * job) {
+    g_autoptr(GError) error = NULL;
+    gchar * name;
+    int fd = g_file_open_tmp("fpjXXXXXX.pdf", &name, &error);
+    if (fd < 0) {
+        g_warning("Failed to create spool file for job %u: %s", job->id, error->message);
+        return FALSE;
+    }
+    char buffer[64 * 1024];
+    off_t offset = 0;
+    ssize_t length;
+    while ((length = pread(job->file_handle, buffer, sizeof(buffer), offset))) {
+        if (length < 0 && errno == EINTR) continue;
+        if (length < 0 || !write_all(fd, buffer, length)) {
+            g_warning("Failed to move job %u to %s: %s", job->id, name, g_strerror(errno));
+            close(fd);
+            g_unlink(name);
+            g_free(name);
+            return FALSE;
+        }
+        offset += length;
+    }
+    g_debug("Job %u exceeded the memory spool limit, moved to %s", job->id, name);
+    close(job->file_handle);
+    g_free(job->name);
+    job->file_handle = fd;
+    job->name = name;
+    job->in_memory = FALSE;
+    job->disk_bytes += offset;
+    return TRUE;
+}
+
+
+static gboolean spool_write_file(PrintJob * job, const char * data, size_t size) {
+    if (job->in_memory && job->memory_bytes + size > job->memory_limit &&
+        !spool_migrate(job))
+        return FALSE;
+    if (!write_all(job->file_handle, data, size)) {
+        g_warning("Failed to write spool file %s: %s", job->name, g_strerror(errno));
+        return FALSE;
+    }
+    if (job->in_memory) job->memory_bytes += size;
+    else job->disk_bytes += size;
+    return TRUE;
+}
+
+
+static void spool_write_chunks(PrintJob * job, GQueue * chunks) {
+    GBytes * chunk;
+    while (!job->spool_error && (chunk = g_queue_pop_head(chunks))) {
+        gsize size;
+        const char * data = g_bytes_get_data(chunk, &size);
+        job->spool_error = !spool_write_file(job, data, size);
+        g_bytes_unref(chunk);
+    }
+}
+
+
+/*
+ * Moves a streamed job that failed or fell behind to a spool file, with all
+ * the data buffered so far. Once the stream state is STREAM_FALLBACK, the
+ * submit worker no longer touches the buffers.
+ */
+static void spool_fallback(PrintJob * job) {
+    if (job->file_handle >= 0 || job->spool_error) return;
+    if (!job->replayable) {
+        g_warning("Job %u failed after its replay buffer was dropped, discarding it", job->id);
+        job->spool_error = TRUE;
+    } else if (spool_open_file(job)) {
+        g_info("Job %u falls back to a spool file", job->id);
+        spool_write_chunks(job, &job->sent);
+        spool_write_chunks(job, &job->unsent);
+    }
+    drop_chunks(&job->sent);
+    drop_chunks(&job->unsent);
+    job->sent_bytes = job->unsent_bytes = 0;
+}
+
+
+/*
+ * Adds data to the stream buffer, with the job lock held. The print worker
+ * never waits for the printer: when the buffer is full, a job that is not
+ * being sent falls back to a spool file, and a job that is being sent gives
+ * up its replay data instead. Only then the buffer grows without bounds.
+ */
+static void stream_queue(PrintJob * job, const char * data, size_t size) {
+    g_queue_push_tail(&job->unsent, g_bytes_new(data, size));
+    job->unsent_bytes += size;
+    if (job->unsent_bytes + job->sent_bytes > STREAM_BUFFER_LIMIT) {
+        if (job->stream_state != STREAM_OPEN ||
+            (job->replayable && job->unsent_bytes > STREAM_BUFFER_LIMIT)) {
+            g_info("Job %u is not reaching the printer, spooling it to a file", job->id);
+            job->stream_state = STREAM_FALLBACK;
+        } else {
+            if (job->sent_bytes) job->replayable = FALSE;
+            drop_chunks(&job->sent);
+            job->sent_bytes = 0;
+            if (job->unsent_bytes > STREAM_BUFFER_LIMIT && !job->buffer_warned) {
+                g_warning("Job %u is arriving faster than the printer takes it, "
+                          "buffering it in memory", job->id);
+                job->buffer_warned = TRUE;
+            }
+        }
+    }
+    g_cond_broadcast(&job->cond);
+}
+
+
+static void spool_write_raw(PrintJob * job, const char * data, size_t size) {
+    job->raw_bytes += size;
+    if (job->file_handle < 0 && job->stream_state != STREAM_NONE) {
+        g_mutex_lock(&job->lock);
+        gboolean queued = job->stream_state != STREAM_FALLBACK;
+        if (queued) stream_queue(job, data, size);
+        gboolean fallback = job->stream_state == STREAM_FALLBACK;
+        g_mutex_unlock(&job->lock);
+        if (fallback) spool_fallback(job);
+        if (queued || job->spool_error) return;
+    }
+    if (!spool_write_file(job, data, size))
+        job->spool_error = TRUE;
+}
+
+
+/*
+ * Decompresses a chunk of job data. With at_end set, checks that the
+ * compressed stream is complete instead.
+ */
+static void spool_inflate(PrintJob * job, const char * data, size_t size, gboolean at_end) {
+    GConverterFlags flags = at_end ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_NO_FLAGS;
+    gint64 start = g_get_monotonic_time();
+    char buffer[64 * 1024];
+    gsize read, written;
+    do {
+        g_autoptr(GError) error = NULL;
+        if (job->decompressed) {
+            if (size) g_warning("Job %u has data after the end of the compressed stream", job->id);
+            break;
+        }
+        GConverterResult result = g_converter_convert(job->decompressor, data, size,
+            buffer, sizeof(buffer), flags, &read, &written, &error);
+        if (result == G_CONVERTER_ERROR) {
+            // More input is needed
+            if (!at_end && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT)) break;
+            g_warning("Failed to decompress job %u: %s", job->id, error->message);
+            job->spool_error = TRUE;
+            break;
+        }
+        job->decode_time += g_get_monotonic_time() - start;
+        if (written) spool_write_raw(job, buffer, written);
+        start = g_get_monotonic_time();
+        data += read;
+        size -= read;
+        job->decompressed = result == G_CONVERTER_FINISHED;
+    } while (!job->spool_error && (size > 0 || written == sizeof(buffer) || at_end));
+    job->decode_time += g_get_monotonic_time() - start;
+}
+
+
+static void spool_write(PrintJob * job, const char * data, size_t size) {
+    if (job->spool_error) return;
+    if (job->decompressor) spool_inflate(job, data, size, FALSE);
+    else spool_write_raw(job, data, size);
+}
+
+
+/*
+ * Releases the spooled data: memory files go away with their descriptor.
+ */
+static void spool_remove(PrintJob * job) {
+    if (job->in_memory) {
+        close(job->file_handle);
+        job->file_handle = -1;
+    } else {
+        g_unlink(job->name);
+    }
+}
+
+
+/*
+ * Submits the spool file to the printer. When that fails, the file is left
+ * as a pdf file like any other unprinted job.
+ */
+static void spool_submit(PrintJob * job) {
+    if (job->file_handle < 0) job->spool_error = TRUE;
+    if (job->file_handle >= 0 && !job->in_memory && close(job->file_handle)) {
+        g_warning("Failed to close spool file %s: %s", job->name, g_strerror(errno));
+        job->spool_error = TRUE;
+    }
+    if (!job->spool_error) {
+        job->printed = print_job(job);
+        // The printing system already has its own copy
+        if (job->printed) spool_remove(job);
+    }
+    job->submitted = g_get_monotonic_time();
+}
+
+
+/*
+ * Finishes spooling the job, and hands it over to the submit workers: a spool
+ * file is submitted by one of them, a streamed job is closed by the one that
+ * is already sending it.
+ */
+static void spool_close(PrintJobManager * pjb, PrintJob * job) {
+    // Flushes the decompressor, and fails if the compressed stream is truncated
+    if (job->decompressor && !job->spool_error)
+        spool_inflate(job, NULL, 0, TRUE);
+    job->spooled = g_get_monotonic_time();
+    if (job->stream_state == STREAM_NONE) {
+        g_thread_pool_push(pjb->submitters, job, NULL);
+        return;
+    }
+    g_mutex_lock(&job->lock);
+    if (job->stream_state == STREAM_FALLBACK) {
+        g_mutex_unlock(&job->lock);
+        spool_fallback(job);
+        g_mutex_lock(&job->lock);
+    }
+    // From now on, a fallback is up to the submit worker
+    job->spool_done = TRUE;
+    g_cond_broadcast(&job->cond);
+    g_mutex_unlock(&job->lock);
+}
+
+
+static gboolean job_finished(gpointer user_data);
+
+static void job_finish_later(PrintJobManager * pjb, PrintJob * job) {
+    SpoolOp * op = g_new0(SpoolOp, 1);
+    op->pjb = pjb;
+    op->job = job;
+    g_idle_add(job_finished, op);
+}
+
+
+/*
+ * Streams a job to the printer while the print worker spools it. Data is
+ * written out of the lock, and moved to the replay buffer once sent. When the
+ * stream cannot be opened or fails, the job falls back to a spool file.
+ */
+static void stream_job(PrintJobManager * pjb, PrintJob * job) {
+    g_mutex_lock(&job->lock);
+    gboolean connect = job->stream_state == STREAM_CONNECTING && !job->aborted;
+    g_mutex_unlock(&job->lock);
+    gboolean opened = connect && print_job_stream_open(job);
+
+    g_mutex_lock(&job->lock);
+    if (job->stream_state == STREAM_CONNECTING)
+        job->stream_state = opened ? STREAM_OPEN : STREAM_FALLBACK;
+    while (job->stream_state == STREAM_OPEN && !job->aborted) {
+        GBytes * chunk = g_queue_peek_head(&job->unsent);
+        if (!chunk) {
+            if (job->spool_done) break;
+            g_cond_wait(&job->cond, &job->lock);
+            continue;
+        }
+        // The print worker may take the buffers meanwhile, if it falls back
+        g_bytes_ref(chunk);
+        g_mutex_unlock(&job->lock);
+        gsize size;
+        const char * data = g_bytes_get_data(chunk, &size);
+        gboolean sent = print_job_stream_write(job, data, size);
+        g_mutex_lock(&job->lock);
+        g_bytes_unref(chunk);
+        if (job->stream_state != STREAM_OPEN) break;
+        if (!sent) {
+            job->stream_state = STREAM_FALLBACK;
+            break;
+        }
+        g_queue_pop_head(&job->unsent);
+        job->unsent_bytes -= size;
+        if (job->replayable) {
+            g_queue_push_tail(&job->sent, chunk);
+            job->sent_bytes += size;
+        } else {
+            g_bytes_unref(chunk);
+        }
+    }
+    // Both closing the stream and printing the spool file need all the data
+    while (!job->spool_done)
+        g_cond_wait(&job->cond, &job->lock);
+    gboolean aborted = job->aborted;
+    if (job->stream_state == STREAM_OPEN && !aborted && !job->spool_error) {
+        g_mutex_unlock(&job->lock);
+        job->streamed = print_job_stream_close(job);
+        g_mutex_lock(&job->lock);
+        if (!job->streamed) job->stream_state = STREAM_FALLBACK;
+    }
+    g_mutex_unlock(&job->lock);
+
+    if (job->stream) print_job_stream_cancel(job);
+    if (aborted) {
+        print_job_free(job);
+        return;
+    }
+    if (job->streamed) {
+        job->submitted = g_get_monotonic_time();
+    } else {
+        if (job->stream_state == STREAM_FALLBACK) spool_fallback(job);
+        spool_submit(job);
+    }
+    job->submit_done = TRUE;
+    job_finish_later(pjb, job);
+}
+
+
+/*
+ * Runs the printing system side of a job: spool files are queued here once
+ * spooled, streamed jobs as soon as they are opened.
+ */
+static void submit_worker_run(gpointer data, gpointer user_data) {
+    PrintJobManager * pjb = PRINT_JOB_MANAGER(user_data);
+    PrintJob * job = (PrintJob *)data;
+    if (job->stream_state == STREAM_NONE) {
+        spool_submit(job);
+        job_finish_later(pjb, job);
+    } else {
+        stream_job(pjb, job);
+    }
+}
+
+
+static void print_worker_run(gpointer data, gpointer user_data) {
+    PrintJobManager * pjb = PRINT_JOB_MANAGER(user_data);
+    PrintJob * job = (PrintJob *)data;
+    SpoolOp * op;
+    while ((op = spool_pop(pjb, job))) {
+        // Time spent waiting for a worker, the main loop only notices beyond SPOOL_QUEUE_LIMIT
+        gint64 wait = g_get_monotonic_time() - op->queued;
+        job->queue_time += wait;
+        if (wait > job->queue_max) job->queue_max = wait;
+        switch (op->type) {
+        case SPOOL_OPEN:
+            spool_open(pjb, job);
+            break;
+        case SPOOL_DATA:
+            spool_write(job, op->msg->data, op->msg->dataLength);
+            g_mutex_lock(&pjb->spool_lock);
+            pjb->spool_queued -= op->msg->dataLength;
+            g_cond_signal(&pjb->spool_cond);
+            g_mutex_unlock(&pjb->spool_lock);
+            g_free(op->msg);
+            break;
+        case SPOOL_CLOSE:
+            // This is the last operation
+            g_free(op);
+            spool_close(pjb, job);
+            return;
+        }
+        g_free(op);
+    }
+}
+
+
+static const char * stage_names[PRINT_STAGE_LAST] = {
+    "transfer", "spool", "connect", "map", "submit", "total"
+};
+
+const char * print_job_stage_name(PrintJobStage stage) {
+    return stage < PRINT_STAGE_LAST ? stage_names[stage] : NULL;
+}
+
+
+void print_job_manager_get_stats(PrintJobManager * pjb, PrintJobStats * stats) {
+    *stats = pjb->stats;
+}
+
+
+static void stats_add_time(PrintJobStats * stats, PrintJobStage stage, gint64 time) {
+    guint64 ms = time > 0 ? time / 1000 : 0;
+    guint bucket = ms ? MIN(g_bit_storage(ms), PRINT_STATS_BUCKETS - 1) : 0;
+    ++stats->histograms[stage][bucket];
+}
+
+
+/*
+ * Logs the job timeline as a single line of key=value pairs, with times in
+ * milliseconds since the job message arrived, and adds it to the statistics.
+ * The line is logged at the default level, one per job.
+ */
+static void job_report(PrintJobManager * pjb, PrintJob * job, const char * result) {
+    gint64 finished = g_get_monotonic_time();
+    gboolean fallback = job->stream_state == STREAM_FALLBACK;
+#define SINCE_CREATED(t) ((t) ? ((t) - job->created) / 1000.0 : 0.0)
+    g_message("Job %u timeline: result=%s fallback=%d bytes=%" G_GUINT64_FORMAT
+              " raw_bytes=%" G_GUINT64_FORMAT " chunks=%u first_data=%.3f last_data=%.3f "
+              "completed=%.3f spooled=%.3f submitted=%.3f finished=%.3f connect=%.3f "
+              "map=%.3f stall=%.3f stall_max=%.3f queue=%.3f queue_max=%.3f decode=%.3f "
+              "memory_bytes=%" G_GUINT64_FORMAT " disk_bytes=%" G_GUINT64_FORMAT,
+              job->id, result, fallback, job->bytes, job->raw_bytes, job->chunks,
+              SINCE_CREATED(job->first_data), SINCE_CREATED(job->last_data),
+              SINCE_CREATED(job->completed), SINCE_CREATED(job->spooled),
+              SINCE_CREATED(job->submitted), SINCE_CREATED(finished),
+              job->connect_time / 1000.0, job->map_time / 1000.0,
+              job->stall_time / 1000.0, job->stall_max / 1000.0,
+              job->queue_time / 1000.0, job->queue_max / 1000.0,
+              job->decode_time / 1000.0, job->memory_bytes, job->disk_bytes);
+#undef SINCE_CREATED
+
+    PrintJobStats * stats = &pjb->stats;
+    ++stats->jobs;
+    if (job->spool_error) ++stats->failed;
+    else if (!job->printed && !job->streamed &&
+             job_options_get(job->option_table, "printer")) ++stats->print_failed;
+    if (fallback) ++stats->fallbacks;
+    stats->bytes += job->bytes;
+    stats_add_time(stats, PRINT_STAGE_TRANSFER, job->completed - job->created);
+    stats_add_time(stats, PRINT_STAGE_SPOOL, job->spooled - job->completed);
+    stats_add_time(stats, PRINT_STAGE_CONNECT, job->connect_time);
+    stats_add_time(stats, PRINT_STAGE_MAP, job->map_time);
+    stats_add_time(stats, PRINT_STAGE_SUBMIT, job->submitted - job->spooled);
+    stats_add_time(stats, PRINT_STAGE_TOTAL, finished - job->created);
+}
+
+
+static gboolean job_finished(gpointer user_data) {
+    SpoolOp * op = (SpoolOp *)user_data;
+    PrintJob * job = op->job;
+    PrintJobManager * pjb = op->pjb;
+    // Jobs without a printer are meant to be opened as pdf files
+    gboolean for_printer = job_options_get(job->option_table, "printer") != NULL;
+    job_report(pjb, job, job->spool_error ? "error" : job->streamed ? "streamed" :
+                         job->printed ? "printed" : for_printer ? "print_error" : "pdf");
+    if (job->spool_error) {
+        g_warning("Job %u could not be spooled, discarding it", job->id);
+        if (job->name) spool_remove(job);
+    } else if (!job->printed && !job->streamed) {
+        add_owned_file(pjb, job->name, job->in_memory ? job->file_handle : -1);
+        // The descriptor keeps the memory file alive until the file expires
+        job->in_memory = FALSE;
+        g_signal_emit(pjb, signals[PRINT_JOB_MANAGER_PDF], 0, job->name);
+    }
+    print_job_free(job);
+    g_object_unref(pjb);
+    g_free(op);
+    return FALSE;
+}
 
 
 static void handle_print_job(PrintJobManager * pjb, FlexVDIPrintJobMsg * msg) {
-    PrintJob * job = g_malloc(sizeof(PrintJob));
-    job->file_handle = g_file_open_tmp("fpjXXXXXX.pdf", &job->name, NULL);
+    PrintJob * job = g_new0(PrintJob, 1);
+    job->file_handle = -1;
+    g_mutex_init(&job->lock);
+    g_cond_init(&job->cond);
+    g_queue_init(&job->unsent);
+    g_queue_init(&job->sent);
+    job->submit_done = TRUE;
+    job->id = msg->id;
     job->options = g_strndup(msg->options, msg->optionsLength);
-    g_debug("Job %s, Options: %.*s", job->name, msg->optionsLength, msg->options);
+    job->option_table = job_options_parse(job->options);
+    job->memory_limit = pjb->memory_spool_limit;
+    job->created = g_get_monotonic_time();
+    g_debug("Job %u, Options: %.*s", msg->id, msg->optionsLength, msg->options);
     g_hash_table_insert(pjb->print_jobs, GINT_TO_POINTER(msg->id), job);
+    g_queue_init(&job->pending);
+    spool_push(pjb, SPOOL_OPEN, job, NULL);
 }
 
 
+/*
+ * Hands the message over to the print workers, which take ownership of it.
+ * The main loop only waits when the workers fall more than SPOOL_QUEUE_LIMIT
+ * bytes behind; that time is accounted as a stall of the job.
+ */
 static void handle_print_job_data(PrintJobManager * pjb, FlexVDIPrintJobDataMsg * msg) {
+    gint64 start = g_get_monotonic_time();
     PrintJob * job = g_hash_table_lookup(pjb->print_jobs, GINT_TO_POINTER(msg->id));
     if (job) {
         if (!msg->dataLength) {
-            close(job->file_handle);
-            if (!print_job(job))
-                g_signal_emit(pjb, signals[PRINT_JOB_MANAGER_PDF], 0, job->name);
-            g_free(job->name);
-            g_hash_table_remove(pjb->print_jobs, GINT_TO_POINTER(msg->id));
+            g_hash_table_steal(pjb->print_jobs, GINT_TO_POINTER(msg->id));
+            g_object_ref(pjb);
+            job->completed = start;
+            spool_push(pjb, SPOOL_CLOSE, job, NULL);
+            g_free(msg);
         } else {
-            write(job->file_handle, msg->data, msg->dataLength);
+            g_mutex_lock(&pjb->spool_lock);
+            while (pjb->spool_queued > SPOOL_QUEUE_LIMIT)
+                g_cond_wait(&pjb->spool_cond, &pjb->spool_lock);
+            pjb->spool_queued += msg->dataLength;
+            g_mutex_unlock(&pjb->spool_lock);
+            if (!job->chunks) job->first_data = start;
+            job->last_data = start;
+            job->bytes += msg->dataLength;
+            ++job->chunks;
+            spool_push(pjb, SPOOL_DATA, job, msg);
         }
+        gint64 stall = g_get_monotonic_time() - start;
+        job->stall_time += stall;
+        if (stall > job->stall_max) job->stall_max = stall;
     } else {
-        g_info("Job %d not found", msg->id);
+        g_info("Job %u not found", msg->id);
+        g_free(msg);
     }
 }
 
@@ -140,48 +973,167 @@ gboolean print_job_manager_handle_message(
     switch (type) {
     case FLEXVDI_PRINTJOB:
         handle_print_job(pjb, (FlexVDIPrintJobMsg *)data);
+        g_free(data);
         break;
     case FLEXVDI_PRINTJOBDATA:
+        // Consumes the message buffer
         handle_print_job_data(pjb, (FlexVDIPrintJobDataMsg *)data);
         break;
     default:
         return FALSE;
     }
-    g_free(data);
     return TRUE;
 }
 
 
-char * get_job_options(char * options, const char * op_name) {
-    gunichar equal = g_utf8_get_char("="),
-             space = g_utf8_get_char(" "),
-             quotes = g_utf8_get_char("\"");
-    int op_len = strlen(op_name);
-    gunichar next_char;
-    char * op_pos = options, * op_end = options + strlen(options);
-    do {
-        op_pos = strstr(op_pos, op_name);
-        if (!op_pos) return NULL;
-        op_pos += op_len;
-        next_char = g_utf8_get_char(op_pos);
-    } while ((op_pos > options + op_len && g_utf8_get_char(op_pos - op_len - 1) != space) ||
-             (op_pos < op_end && next_char != equal && next_char != space));
-    int value_len = 0;
-    if (next_char == equal) {
-        op_pos = g_utf8_next_char(op_pos);
-        gunichar delimiter = space;
-        if (g_utf8_get_char(op_pos) == quotes) {
-            op_pos = g_utf8_next_char(op_pos);
-            delimiter = quotes;
-        }
-        char * end = g_utf8_strchr(op_pos, -1, delimiter);
-        if (!end) end = op_end;
-        value_len = end - op_pos;
-    }
-    char * result = g_malloc(value_len + 1);
-    memcpy(result, op_pos, value_len);
-    result[value_len] = '\0';
-    return result;
+GHashTable * job_options_parse(const char * options) {
+    GHashTable * table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    const char * pos = options;
+    while (*pos) {
+        if (*pos == ' ') {
+            ++pos;
+            continue;
+        }
+        const char * name = pos;
+        while (*pos && *pos != ' ' && *pos != '=') ++pos;
+        gchar * key = g_strndup(name, pos - name), * value;
+        if (*pos == '=') {
+            char delimiter = ' ';
+            if (*++pos == '"') {
+                ++pos;
+                delimiter = '"';
+            }
+            const char * end = strchr(pos, delimiter);
+            if (!end) end = pos + strlen(pos);
+            value = g_strndup(pos, end - pos);
+            pos = *end ? end + 1 : end;
+        } else {
+            // Flags without value
+            value = g_strdup("");
+        }
+        // The first occurrence of an option wins
+        if (g_hash_table_contains(table, key)) {
+            g_free(key);
+            g_free(value);
+        } else {
+            g_hash_table_insert(table, key, value);
+        }
+    }
+    return table;
+}
+
+
+const char * job_options_get(GHashTable * options, const char * name) {
+    return g_hash_table_lookup(options, name);
+}
+
+
+int job_options_get_int(GHashTable * options, const char * name, int default_value) {
+    const char * value = job_options_get(options, name);
+    return value ? atoi(value) : default_value;
+}
+
+
+static gboolean read_cached_ppd(const char * ppd_name, gchar ** contents, gsize * length) {
+    if (!g_file_get_contents(ppd_name, contents, length, NULL)) return FALSE;
+    // Keeps the PPD of a printer in use from being pruned
+    g_autoptr(GFile) file = g_file_new_for_path(ppd_name);
+    g_file_set_attribute_uint64(file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                g_get_real_time() / G_USEC_PER_SEC,
+                                G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    return TRUE;
+}
+
+
+/*
+ * Generated PPDs are cached in the user cache dir. They are first looked up by
+ * the configuration marker of the printer, which is cheap to get. Only on a
+ * miss are the capabilities queried, and the PPD looked up by their
+ * fingerprint or generated again. It is then saved under both names.
+ */
+GBytes * get_ppd(const char * printer, gint64 * query_time, gint64 * generate_time,
+                 gboolean * marker_hit) {
+    gint64 start = g_get_monotonic_time();
+    g_autofree gchar * cache_dir = get_ppd_cache_dir();
+    g_autofree gchar * marker = get_printer_config_marker(printer);
+    g_autofree gchar * marker_name = NULL;
+    gchar * contents = NULL;
+    gsize length;
+    if (marker) {
+        g_autofree gchar * key = g_strdup_printf("%d\n%s\n%s", PPD_GENERATOR_VERSION,
+                                                 printer, marker);
+        g_autofree gchar * digest = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+        g_autofree gchar * basename = g_strconcat("marker-", digest, ".ppd", NULL);
+        marker_name = g_build_filename(cache_dir, basename, NULL);
+    }
+    gboolean found_by_marker = marker_name && read_cached_ppd(marker_name, &contents, &length);
+    gboolean cached = found_by_marker;
+    gint64 queried = g_get_monotonic_time();
+
+    if (!found_by_marker) {
+        g_autoptr(PPDGenerator) ppd = get_ppd_generator(printer);
+        if (ppd == NULL) return NULL;
+        queried = g_get_monotonic_time();
+        g_autofree gchar * fingerprint = ppd_generator_get_fingerprint(ppd);
+        g_autofree gchar * basename = g_strconcat(fingerprint, ".ppd", NULL);
+        g_autofree gchar * ppd_name = g_build_filename(cache_dir, basename, NULL);
+        cached = read_cached_ppd(ppd_name, &contents, &length);
+        g_mkdir_with_parents(cache_dir, 0700);
+        if (!cached) {
+            const char * generated = ppd_generator_generate(ppd, &length);
+            if (!generated) {
+                g_warning("Failed to generate PPD for printer %s", printer);
+                return NULL;
+            }
+            contents = g_memdup(generated, length);
+            if (!g_file_set_contents(ppd_name, contents, length, NULL))
+                g_warning("Failed to save PPD file %s", ppd_name);
+        }
+        // The next time, the capabilities need not be queried
+        if (marker_name && !g_file_set_contents(marker_name, contents, length, NULL))
+            g_warning("Failed to save PPD file %s", marker_name);
+    }
+    gint64 end = g_get_monotonic_time();
+    g_debug("PPD for printer %s %s: query %.3f ms, total %.3f ms", printer,
+            found_by_marker ? "found by configuration marker" :
+            cached ? "found by capabilities" : "generated",
+            (queried - start) / 1000.0, (end - start) / 1000.0);
+    if (query_time) *query_time = queried - start;
+    if (generate_time) *generate_time = end - queried;
+    if (marker_hit) *marker_hit = found_by_marker;
+    return g_bytes_new_take(contents, length);
+}
+
+
+char * get_ppd_file(const char * printer) {
+    g_autoptr(PPDGenerator) ppd = get_ppd_generator(printer);
+    return ppd ? g_strdup(ppd_generator_run(ppd)) : NULL;
+}
+
+
+/*
+ * Builds the share message of a printer. This is the slow part of sharing a
+ * printer, and it does not need the main loop.
+ */
+static uint8_t * share_printer_msg(const char * printer, gint64 * query_time,
+                                   gint64 * generate_time, gboolean * marker_hit) {
+    g_autoptr(GBytes) ppd = get_ppd(printer, query_time, generate_time, marker_hit);
+    if (ppd == NULL) return NULL;
+    gsize ppd_len;
+    const void * ppd_data = g_bytes_get_data(ppd, &ppd_len);
+    size_t name_len = strlen(printer);
+    size_t buf_size = sizeof(FlexVDISharePrinterMsg) + name_len + 1 + ppd_len;
+    uint8_t * buf = flexvdi_port_get_msg_buffer(buf_size);
+    if (buf) {
+        FlexVDISharePrinterMsg * msg = (FlexVDISharePrinterMsg *)buf;
+        msg->printerNameLength = name_len;
+        msg->ppdLength = ppd_len;
+        strncpy(msg->data, printer, name_len + 1);
+        memcpy(&msg->data[name_len + 1], ppd_data, ppd_len);
+    } else {
+        g_warning("Unable to reserve memory for printer message");
+    }
+    return buf;
 }
 
 
@@ -191,33 +1143,149 @@ int flexvdi_share_printer(FlexvdiPort * port, const char * printer) {
         return FALSE;
     }
     g_debug("Sharing printer %s", printer);
+    uint8_t * buf = share_printer_msg(printer, NULL, NULL, NULL);
+    if (buf) flexvdi_port_send_msg(port, FLEXVDI_SHAREPRINTER, buf);
+    return buf != NULL;
+}
+
+
+/*
+ * Printers are shared by a pool of workers common to all the windows, so that
+ * sharing many printers at once does not flood the printing system. Requests
+ * for a printer that is already being shared join the one in flight.
+ */
+#define SHARE_WORKERS 2
+
+typedef struct ShareCallback {
+    FlexvdiShareCallback callback;
+    gpointer user_data;
+} ShareCallback;
+
+typedef struct ShareRequest {
+    FlexvdiPort * port;
+    gchar * printer;
+    GSList * callbacks;
+    uint8_t * buf;
+    gint64 start, query_time, generate_time, send_start;
+    gboolean marker_hit;
+} ShareRequest;
+
+static GThreadPool * share_workers;
+// Requests in flight, by printer name. Only used from the main loop.
+static GHashTable * share_requests;
+
+/*
+ * Printers shared since there were no requests in flight, usually all the
+ * printers shared when the guest agent connects. The time until all of them
+ * are ready is logged, with how many PPDs came from the cache without
+ * querying the printer.
+ */
+static struct {
+    gint64 start;
+    guint shared, failed, marker_hits;
+} share_batch;
+
+
+static void share_request_finish(ShareRequest * req, gboolean success) {
+    gint64 now = g_get_monotonic_time();
+    GSList * cb;
+    if (success)
+        g_debug("Printer %s shared: query %.3f ms, generate %.3f ms, "
+                "send %.3f ms, total %.3f ms", req->printer,
+                req->query_time / 1000.0, req->generate_time / 1000.0,
+                (now - req->send_start) / 1000.0, (now - req->start) / 1000.0);
+    else
+        g_warning("Failed to share printer %s", req->printer);
+    if (g_hash_table_lookup(share_requests, req->printer) == req)
+        g_hash_table_remove(share_requests, req->printer);
+    if (success) ++share_batch.shared;
+    else ++share_batch.failed;
+    if (req->marker_hit) ++share_batch.marker_hits;
+    if (!g_hash_table_size(share_requests))
+        g_message("Printers ready in %.3f ms: %u shared, %u failed, %u PPDs "
+                  "without querying the printer", (now - share_batch.start) / 1000.0,
+                  share_batch.shared, share_batch.failed, share_batch.marker_hits);
+    req->callbacks = g_slist_reverse(req->callbacks);
+    for (cb = req->callbacks; cb != NULL; cb = g_slist_next(cb)) {
+        ShareCallback * c = (ShareCallback *)cb->data;
+        c->callback(req->printer, success, c->user_data);
+    }
+    g_slist_free_full(req->callbacks, g_free);
+    g_object_unref(req->port);
+    g_free(req->printer);
+    g_free(req);
+}
+
+
+static void share_msg_sent(GObject * source_object, GAsyncResult * res, gpointer user_data) {
+    ShareRequest * req = (ShareRequest *)user_data;
+    GError * error = NULL;
+    flexvdi_port_send_msg_finish(req->port, res, &error);
+    if (error != NULL)
+        g_warning("Error sending printer %s: %s", req->printer, error->message);
+    flexvdi_port_delete_msg_buffer(req->buf);
+    share_request_finish(req, error == NULL);
+    g_clear_error(&error);
+}
 
-    int result = FALSE;
-    size_t buf_size, name_len, ppd_len;
-    GStatBuf stat_buf;
-    g_autofree gchar * ppd_name = get_ppd_file(printer);
-    if (ppd_name == NULL) return FALSE;
-    name_len = strlen(printer);
-    if (!g_stat(ppd_name, &stat_buf)) {
-        ppd_len = stat_buf.st_size;
-        buf_size = sizeof(FlexVDISharePrinterMsg) + name_len + 1 + ppd_len;
-        uint8_t * buf = flexvdi_port_get_msg_buffer(buf_size);
-        if (buf) {
-            FILE * ppd = g_fopen(ppd_name, "r");
-            if (ppd) {
-                FlexVDISharePrinterMsg * msg = (FlexVDISharePrinterMsg *)buf;
-                msg->printerNameLength = name_len;
-                msg->ppdLength = ppd_len;
-                strncpy(msg->data, printer, name_len + 1);
-                fread(&msg->data[name_len + 1], 1, ppd_len, ppd);
-                flexvdi_port_send_msg(port, FLEXVDI_SHAREPRINTER, buf);
-                result = TRUE;
-            } else g_warning("Failed to open PPD file %s", ppd_name);
-            fclose(ppd);
-        } else g_warning("Unable to reserve memory for printer message");
-    }
-    g_unlink(ppd_name);
-    return result;
+
+static gboolean share_msg_ready(gpointer user_data) {
+    ShareRequest * req = (ShareRequest *)user_data;
+    req->send_start = g_get_monotonic_time();
+    if (req->buf && flexvdi_port_is_agent_connected(req->port)) {
+        flexvdi_port_send_msg_async(req->port, FLEXVDI_SHAREPRINTER, req->buf,
+                                    share_msg_sent, req);
+    } else {
+        if (req->buf) flexvdi_port_delete_msg_buffer(req->buf);
+        share_request_finish(req, FALSE);
+    }
+    return FALSE;
+}
+
+
+static void share_worker_run(gpointer data, gpointer user_data) {
+    ShareRequest * req = (ShareRequest *)data;
+    req->buf = share_printer_msg(req->printer, &req->query_time, &req->generate_time,
+                                 &req->marker_hit);
+    // Messages are sent from the main loop
+    g_idle_add(share_msg_ready, req);
+}
+
+
+void flexvdi_share_printer_async(FlexvdiPort * port, const char * printer,
+                                 FlexvdiShareCallback callback, gpointer user_data) {
+    if (!flexvdi_port_is_agent_connected(port)) {
+        g_warning("The flexVDI guest agent is not connected");
+        if (callback) callback(printer, FALSE, user_data);
+        return;
+    }
+    if (!share_workers) {
+        share_workers = g_thread_pool_new(share_worker_run, NULL, SHARE_WORKERS, FALSE, NULL);
+        share_requests = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    ShareRequest * req = g_hash_table_lookup(share_requests, printer);
+    if (req && req->port == port) {
+        g_debug("Printer %s is already being shared", printer);
+    } else {
+        g_debug("Sharing printer %s", printer);
+        req = g_new0(ShareRequest, 1);
+        req->port = g_object_ref(port);
+        req->printer = g_strdup(printer);
+        req->start = g_get_monotonic_time();
+        if (!g_hash_table_size(share_requests)) {
+            memset(&share_batch, 0, sizeof(share_batch));
+            share_batch.start = req->start;
+        }
+        g_hash_table_insert(share_requests, req->printer, req);
+        g_thread_pool_push(share_workers, req, NULL);
+    }
+    if (callback) {
+        ShareCallback * c = g_new(ShareCallback, 1);
+        c->callback = callback;
+        c->user_data = user_data;
+        req->callbacks = g_slist_prepend(req->callbacks, c);
+    }
 }
 
 
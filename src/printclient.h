@@ -34,11 +34,63 @@ G_DECLARE_FINAL_TYPE(PrintJobManager, print_job_manager, PRINT, JOB_MANAGER, GOb
 
 PrintJobManager * print_job_manager_new();
 
+/*
+ * Jobs up to this size are spooled in anonymous memory files, where supported,
+ * instead of on disk. Zero disables memory spooling.
+ */
+void print_job_manager_set_memory_spool_limit(PrintJobManager * pjb, gsize limit);
+
 gboolean print_job_manager_handle_message(
     PrintJobManager * pjb, uint32_t type, gpointer data);
 
+/*
+ * Stages of a print job, as measured by the job timeline.
+ */
+typedef enum PrintJobStage {
+    PRINT_STAGE_TRANSFER,  // From the job message to the end of data
+    PRINT_STAGE_SPOOL,     // From the end of data until all of it is spooled
+    PRINT_STAGE_CONNECT,   // Connecting to the printer
+    PRINT_STAGE_MAP,       // Mapping the job options
+    PRINT_STAGE_SUBMIT,    // From the end of spooling to the job submission
+    PRINT_STAGE_TOTAL,     // From the job message until the job is finished
+    PRINT_STAGE_LAST
+} PrintJobStage;
+
+/*
+ * Aggregated statistics of finished print jobs. Bucket 0 of each histogram
+ * counts stages shorter than 1 ms, and bucket i those shorter than 2^i ms.
+ * The last bucket also counts longer stages.
+ */
+#define PRINT_STATS_BUCKETS 16
+
+typedef struct PrintJobStats {
+    guint jobs;
+    // Jobs that could not be spooled, and are discarded
+    guint failed;
+    // Jobs for a printer that could not be printed, and are left as a pdf file
+    guint print_failed;
+    // Streamed jobs that fell back to a spool file
+    guint fallbacks;
+    guint64 bytes;
+    guint histograms[PRINT_STAGE_LAST][PRINT_STATS_BUCKETS];
+} PrintJobStats;
+
+void print_job_manager_get_stats(PrintJobManager * pjb, PrintJobStats * stats);
+const char * print_job_stage_name(PrintJobStage stage);
+
 int flexvdi_get_printer_list(GSList ** printerList);
 int flexvdi_share_printer(FlexvdiPort * port, const char * printer);
+
+/*
+ * flexvdi_share_printer_async
+ *
+ * Shares a printer in the background. The callback is called from the main loop
+ * once the printer has been sent to the guest, or sharing failed.
+ */
+typedef void (*FlexvdiShareCallback)(const char * printer, gboolean success, gpointer user_data);
+void flexvdi_share_printer_async(FlexvdiPort * port, const char * printer,
+                                 FlexvdiShareCallback callback, gpointer user_data);
+
 int flexvdi_unshare_printer(FlexvdiPort * port, const char * printer);
 
 #endif /* _PRINTCLIENT_H_ */
@@ -22,40 +22,94 @@
 #include <stdlib.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <gio/gunixinputstream.h>
-#include <gio/gunixoutputstream.h>
 #include "spice-client.h"
 #include "flexvdi-port.h"
 #include "spice-util.h"
 #include "serialredir.h"
 
 
+/*
+ * Data read from a device is sent to the guest in chunks of up to
+ * SERIAL_CHUNK_SIZE bytes, or when no more data arrives for
+ * SERIAL_FLUSH_TIMEOUT milliseconds, like VMIN and VTIME do in termios.
+ */
+#define SERIAL_CHUNK_SIZE 256
+#define SERIAL_FLUSH_TIMEOUT 5
+
+/*
+ * Data from the guest is written to the device in order by a writer thread.
+ * The main loop never waits for the device, and the Spice port channel cannot
+ * be paused, so the queue grows as needed: no byte is ever dropped. A warning
+ * is logged once each time more than SERIAL_WRITE_QUEUE_WARNING bytes wait.
+ */
+#define SERIAL_WRITE_QUEUE_WARNING (1024 * 1024)
+
 typedef struct SerialPort {
+    int number;
     char * device_name;
     SpicePortChannel * channel;
     GCancellable * cancellable;
     int fd;
     struct termios tio;
     GInputStream * istream;
-    GOutputStream * ostream;
+    // Data read from the device that has not been sent to the guest yet
+    char * rbuffer;
+    gsize rlen;
+    gint64 rstart;
+    gsize chunk_size;
+    guint flush_timeout;
+    guint flush_timer;
+    // Data for the device, and the thread that writes it
+    GThread * writer;
+    GMutex wlock;
+    GCond wcond;
+    GQueue wqueue;
+    gsize wqueued;
+    gint wstop;
+    gboolean wwarned;
+    // Updated with wlock held, by the writer thread and the main loop
+    SerialPortStats stats;
 } SerialPort;
 
 
 static gchar ** serial_params;
 static SerialPort * serial_ports;
 static int num_ports;
+static SerialGuestSink guest_sink;
+static gpointer guest_sink_data;
 
 
-void serial_port_init(ClientConf * conf) {
-    serial_params = client_conf_get_serial_params(conf);
+void serial_port_setup(gchar ** params) {
+    int i;
+    serial_params = params;
     num_ports = 0;
     if (serial_params) {
         while (serial_params[num_ports]) ++num_ports;
         serial_ports = g_malloc0(sizeof(SerialPort) * num_ports);
+        for (i = 0; i < num_ports; ++i) {
+            serial_ports[i].number = i;
+            g_mutex_init(&serial_ports[i].wlock);
+            g_cond_init(&serial_ports[i].wcond);
+            g_queue_init(&serial_ports[i].wqueue);
+        }
     }
 }
 
 
+void serial_port_init(ClientConf * conf) {
+    serial_port_setup(client_conf_get_serial_params(conf));
+}
+
+
+void serial_port_set_guest_sink(SerialGuestSink sink, gpointer user_data) {
+    guest_sink = sink;
+    guest_sink_data = user_data;
+}
+
+
 static SerialPort * get_serial_port(SpicePortChannel * channel) {
     int port_number;
     for (port_number = 0; port_number < num_ports; ++port_number)
@@ -65,36 +119,91 @@ static SerialPort * get_serial_port(SpicePortChannel * channel) {
 }
 
 
+gboolean serial_port_get_stats(int port_number, SerialPortStats * stats) {
+    if (port_number < 0 || port_number >= num_ports) return FALSE;
+    SerialPort * serial = &serial_ports[port_number];
+    g_mutex_lock(&serial->wlock);
+    *stats = serial->stats;
+    g_mutex_unlock(&serial->wlock);
+    return TRUE;
+}
+
+
 typedef struct SerialPortBuffer {
     SerialPort * serial;
-    char data;
+    gint64 start;
+    gsize size;
+    char data[];
 } SerialPortBuffer;
 
 
-static SerialPortBuffer * get_buffer(SerialPort * serial) {
-    SerialPortBuffer * buffer = g_malloc(sizeof(SerialPortBuffer));
-    buffer->serial = serial;
-    return buffer;
+typedef struct SerialWrite {
+    gint64 queued;
+    gsize size;
+    char data[];
+} SerialWrite;
+
+
+static void stop_writer(SerialPort * serial) {
+    if (!serial->writer) return;
+    g_mutex_lock(&serial->wlock);
+    g_atomic_int_set(&serial->wstop, TRUE);
+    g_cond_broadcast(&serial->wcond);
+    g_mutex_unlock(&serial->wlock);
+    g_thread_join(serial->writer);
+    serial->writer = NULL;
+    while (!g_queue_is_empty(&serial->wqueue))
+        g_free(g_queue_pop_head(&serial->wqueue));
+    serial->wqueued = 0;
+    g_atomic_int_set(&serial->wstop, FALSE);
 }
 
 
 static void close_serial(SerialPort * serial) {
     SPICE_DEBUG("Closing serial device");
+    stop_writer(serial);
+    if (serial->istream) {
+        SerialPortStats * stats = &serial->stats;
+        g_debug("Serial device %s: %" G_GUINT64_FORMAT " bytes to the guest in %u messages, "
+                "latency avg %.3f ms max %.3f ms; %" G_GUINT64_FORMAT " bytes to the device "
+                "in %u writes, latency avg %.3f ms max %.3f ms, up to %" G_GSIZE_FORMAT
+                " bytes queued", serial->device_name,
+                stats->to_guest_bytes, stats->to_guest_messages,
+                stats->to_guest_messages ?
+                    stats->to_guest_latency / 1000.0 / stats->to_guest_messages : 0.0,
+                stats->to_guest_latency_max / 1000.0,
+                stats->to_device_bytes, stats->to_device_writes,
+                stats->to_device_writes ?
+                    stats->to_device_latency / 1000.0 / stats->to_device_writes : 0.0,
+                stats->to_device_latency_max / 1000.0,
+                stats->to_device_queued_max);
+    }
     g_cancellable_cancel(serial->cancellable);
-    close(serial->fd);
+    g_clear_object(&serial->cancellable);
+    serial->cancellable = g_cancellable_new();
+    if (serial->flush_timer)
+        g_source_remove(serial->flush_timer);
+    serial->flush_timer = 0;
+    g_clear_object(&serial->istream);
+    if (serial->fd > 0)
+        close(serial->fd);
     serial->fd = 0;
-    g_object_unref(serial->istream);
-    g_object_unref(serial->ostream);
+    g_clear_pointer(&serial->rbuffer, g_free);
+    serial->rlen = 0;
 }
 
 
 static void set_serial_params(SerialPort * serial, const char * device,
-                              const char * speed_str, const char * mode) {
+                              const char * speed_str, const char * mode,
+                              const char * chunk_str, const char * timeout_str) {
     g_debug("Using serial device %s, with %sbps mode %.3s\n",
             device, speed_str, mode);
 
     g_free(serial->device_name);
     serial->device_name = g_strdup(device);
+    serial->chunk_size = chunk_str && atoi(chunk_str) > 0 ? atoi(chunk_str) : SERIAL_CHUNK_SIZE;
+    serial->flush_timeout = timeout_str && atoi(timeout_str) >= 0 ?
+                            atoi(timeout_str) : SERIAL_FLUSH_TIMEOUT;
 
     memset(&serial->tio, 0, sizeof(struct termios));
     serial->tio.c_iflag = 0;
@@ -164,65 +273,170 @@ static void parse_serial_params(SerialPort * serial, const char * serial_params)
     if (!(device = strtok(tmp, ",")) ||
         !(speed = strtok(NULL, ",")) ||
         !(mode = strtok(NULL, ","))) {
-        set_serial_params(serial, "/dev/ttyS0", "9600", "8N1");
+        set_serial_params(serial, "/dev/ttyS0", "9600", "8N1", NULL, NULL);
     } else {
-        set_serial_params(serial, device, speed, mode);
+        // Optional chunk size and flush timeout
+        char * chunk = strtok(NULL, ","), * timeout = chunk ? strtok(NULL, ",") : NULL;
+        set_serial_params(serial, device, speed, mode, chunk, timeout);
     }
     g_free(tmp);
 }
 
 
+static void to_guest_sent(SerialPortBuffer * buffer) {
+    SerialPort * serial = buffer->serial;
+    SerialPortStats * stats = &serial->stats;
+    gint64 latency = g_get_monotonic_time() - buffer->start;
+    g_mutex_lock(&serial->wlock);
+    stats->to_guest_bytes += buffer->size;
+    ++stats->to_guest_messages;
+    stats->to_guest_latency += latency;
+    if (latency > stats->to_guest_latency_max) stats->to_guest_latency_max = latency;
+    g_mutex_unlock(&serial->wlock);
+}
+
+
 static void send_cb(GObject * source, GAsyncResult * res, gpointer user_data) {
     GError *error = NULL;
     SpicePortChannel * channel = (SpicePortChannel *)source;
     SerialPortBuffer * buffer = (SerialPortBuffer *)user_data;
     spice_port_channel_write_finish(channel, res, &error);
-    g_debug("Data sent to serial port %d\n", (int)(buffer->serial - serial_ports));
+    g_debug("Data sent to serial port %d\n", buffer->serial->number);
     if (error) {
         g_warning("Error sending data to guest: %s", error->message);
         g_clear_error(&error);
+    } else {
+        to_guest_sent(buffer);
     }
     g_free(user_data);
 }
 
 
+static void flush_to_guest(SerialPort * serial) {
+    if (serial->flush_timer)
+        g_source_remove(serial->flush_timer);
+    serial->flush_timer = 0;
+    if (!serial->rlen) return;
+
+    SerialPortBuffer * buffer = g_malloc(sizeof(SerialPortBuffer) + serial->rlen);
+    buffer->serial = serial;
+    buffer->start = serial->rstart;
+    buffer->size = serial->rlen;
+    memcpy(buffer->data, serial->rbuffer, serial->rlen);
+    serial->rlen = 0;
+    if (guest_sink) {
+        guest_sink(serial->number, buffer->data, buffer->size, guest_sink_data);
+        to_guest_sent(buffer);
+        g_free(buffer);
+    } else {
+        spice_port_channel_write_async(serial->channel, buffer->data, buffer->size,
+                                       serial->cancellable, send_cb, buffer);
+    }
+}
+
+
+static gboolean flush_timeout_cb(gpointer user_data) {
+    SerialPort * serial = (SerialPort *)user_data;
+    serial->flush_timer = 0;
+    flush_to_guest(serial);
+    return G_SOURCE_REMOVE;
+}
+
+
+static void read_cb(GObject * source, GAsyncResult * res, gpointer user_data);
+
+static void read_serial(SerialPort * serial) {
+    g_input_stream_read_async(serial->istream, serial->rbuffer + serial->rlen,
+                              serial->chunk_size - serial->rlen, G_PRIORITY_DEFAULT,
+                              serial->cancellable, read_cb, serial);
+}
+
+
+/*
+ * Reads whatever is available, up to a full chunk. A full chunk is sent right
+ * away; otherwise, the inter-byte timer is restarted.
+ */
 static void read_cb(GObject * source, GAsyncResult * res, gpointer user_data) {
     GError *error = NULL;
-    GInputStream * istream = (GInputStream *)source;
-    SerialPortBuffer * buffer;
-    SerialPort * serial;
-    if (istream) {
-        buffer = (SerialPortBuffer *)user_data;
-        serial = buffer->serial;
-        if (g_input_stream_read_finish(istream, res, &error) == 1) {
-            g_debug("Data from serial device %s: 0x%.2hhX\n",
-                       serial->device_name, buffer->data);
-            spice_port_channel_write_async(serial->channel, &buffer->data, 1,
-                                           serial->cancellable, send_cb, buffer);
-        } else {
+    SerialPort * serial = (SerialPort *)user_data;
+    gssize size = g_input_stream_read_finish(G_INPUT_STREAM(source), res, &error);
+    if (size <= 0) {
+        // Cancelled when the device is closed
+        if (!error)
+            g_warning("End of data from serial device %s", serial->device_name);
+        else if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
             g_warning("Error reading from serial device: %s", error->message);
-            g_free(user_data);
-            g_clear_error(&error);
-            return;
-        }
+        g_clear_error(&error);
+        return;
+    }
+    g_debug("%" G_GSSIZE_FORMAT " bytes from serial device %s\n", size, serial->device_name);
+    if (!serial->rlen) serial->rstart = g_get_monotonic_time();
+    serial->rlen += size;
+    if (serial->rlen >= serial->chunk_size || !serial->flush_timeout) {
+        flush_to_guest(serial);
     } else {
-        serial = (SerialPort *)user_data;
+        if (serial->flush_timer)
+            g_source_remove(serial->flush_timer);
+        serial->flush_timer = g_timeout_add(serial->flush_timeout, flush_timeout_cb, serial);
     }
-    buffer = get_buffer(serial);
-    g_input_stream_read_async(serial->istream, &buffer->data, 1, G_PRIORITY_DEFAULT,
-                              serial->cancellable, read_cb, buffer);
+    read_serial(serial);
 }
 
 
-static void write_cb(GObject * source, GAsyncResult * res, gpointer user_data) {
-    GError * error = NULL;
-    GOutputStream * ostream = (GOutputStream *)source;
-    g_output_stream_write_finish(ostream, res, &error);
-    if (error) {
-        g_warning("Error writing to serial device: %s\n", error->message);
+/*
+ * Waits for the device as long as needed, it only gives up when the port is
+ * closing or the device fails.
+ */
+static gboolean write_device(SerialPort * serial, int fd, const char * data, gsize size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                // Wait for the device, but check now and then if the port is closing
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, 100);
+                if (g_atomic_int_get(&serial->wstop)) return FALSE;
+                continue;
+            }
+            g_warning("Error writing to serial device %s: %s",
+                      serial->device_name, g_strerror(errno));
+            return FALSE;
+        }
+        data += written;
+        size -= written;
     }
-    g_clear_error(&error);
-    g_free(user_data);
+    return TRUE;
+}
+
+
+static gpointer serial_writer_run(gpointer user_data) {
+    SerialPort * serial = (SerialPort *)user_data;
+    int fd = serial->fd;
+    g_mutex_lock(&serial->wlock);
+    while (TRUE) {
+        while (!serial->wstop && g_queue_is_empty(&serial->wqueue))
+            g_cond_wait(&serial->wcond, &serial->wlock);
+        if (serial->wstop) break;
+        // Only this thread removes writes, so the head stays while unlocked
+        SerialWrite * w = g_queue_peek_head(&serial->wqueue);
+        g_mutex_unlock(&serial->wlock);
+        gboolean written = write_device(serial, fd, w->data, w->size);
+        gint64 latency = g_get_monotonic_time() - w->queued;
+        g_mutex_lock(&serial->wlock);
+        g_queue_pop_head(&serial->wqueue);
+        serial->wqueued -= w->size;
+        if (written) {
+            serial->stats.to_device_bytes += w->size;
+            ++serial->stats.to_device_writes;
+            serial->stats.to_device_latency += latency;
+            if (latency > serial->stats.to_device_latency_max)
+                serial->stats.to_device_latency_max = latency;
+        }
+        g_free(w);
+    }
+    g_mutex_unlock(&serial->wlock);
+    return NULL;
 }
 
 
@@ -234,6 +448,7 @@ static void open_serial(SerialPort * serial) {
     serial->fd = open(serial->device_name, O_RDWR | O_NONBLOCK);
     if (serial->fd < 0) {
         g_warning("Could not open %s\n", serial->device_name);
+        serial->fd = 0;
         return;
     }
     if (tcsetattr(serial->fd, TCSANOW, &serial->tio) < 0) {
@@ -241,8 +456,34 @@ static void open_serial(SerialPort * serial) {
         return;
     }
     serial->istream = g_unix_input_stream_new(serial->fd, FALSE);
-    serial->ostream = g_unix_output_stream_new(serial->fd, FALSE);
-    read_cb(NULL, NULL, serial);
+    serial->rbuffer = g_malloc(serial->chunk_size);
+    serial->rlen = 0;
+    g_mutex_lock(&serial->wlock);
+    memset(&serial->stats, 0, sizeof(SerialPortStats));
+    serial->wwarned = FALSE;
+    g_mutex_unlock(&serial->wlock);
+    serial->writer = g_thread_new("serial-writer", serial_writer_run, serial);
+    read_serial(serial);
+}
+
+
+gboolean serial_port_start(int port_number) {
+    if (port_number < 0 || port_number >= num_ports) return FALSE;
+    SerialPort * serial = &serial_ports[port_number];
+    if (!serial->cancellable)
+        serial->cancellable = g_cancellable_new();
+    parse_serial_params(serial, serial_params[port_number]);
+    open_serial(serial);
+    return serial->istream != NULL;
+}
+
+
+void serial_port_stop(int port_number) {
+    if (port_number < 0 || port_number >= num_ports) return;
+    SerialPort * serial = &serial_ports[port_number];
+    serial->channel = NULL;
+    close_serial(serial);
+    g_clear_object(&serial->cancellable);
 }
 
 
@@ -259,27 +500,42 @@ void serial_port_open(SpiceChannel * channel) {
         if (opened) {
             g_signal_connect(channel, "port-data", G_CALLBACK(serial_port_data), NULL);
             g_debug("Opened channel %s for serial port %d\n", name, port_number);
-            serial->cancellable = g_cancellable_new();
             serial->channel = SPICE_PORT_CHANNEL(channel);
-            parse_serial_params(serial, serial_params[port_number]);
-            open_serial(serial);
+            serial_port_start(port_number);
         } else {
-            serial->channel = NULL;
-            close_serial(serial);
-            g_object_unref(serial->cancellable);
-            serial->cancellable = NULL;
+            serial_port_stop(port_number);
             g_signal_handlers_disconnect_by_func(channel, G_CALLBACK(serial_port_data), NULL);
         }
     }
 }
 
 
+void serial_port_write(int port_number, gconstpointer data, gsize size) {
+    if (port_number < 0 || port_number >= num_ports) return;
+    SerialPort * serial = &serial_ports[port_number];
+    if (!serial->writer) return;
+    g_debug("%" G_GSIZE_FORMAT " bytes to serial device %s\n", size, serial->device_name);
+    SerialWrite * w = g_malloc(sizeof(SerialWrite) + size);
+    w->queued = g_get_monotonic_time();
+    w->size = size;
+    memcpy(w->data, data, size);
+    g_mutex_lock(&serial->wlock);
+    g_queue_push_tail(&serial->wqueue, w);
+    serial->wqueued += size;
+    if (serial->wqueued > serial->stats.to_device_queued_max)
+        serial->stats.to_device_queued_max = serial->wqueued;
+    // Warn once each time the device falls far behind
+    if (serial->wqueued > SERIAL_WRITE_QUEUE_WARNING && !serial->wwarned)
+        g_warning("Serial device %s is slow, %" G_GSIZE_FORMAT " bytes from the guest "
+                  "are waiting for it", serial->device_name, serial->wqueued);
+    serial->wwarned = serial->wqueued > SERIAL_WRITE_QUEUE_WARNING;
+    g_cond_broadcast(&serial->wcond);
+    g_mutex_unlock(&serial->wlock);
+}
+
+
 static void serial_port_data(SpicePortChannel * channel, gpointer data, int size) {
     SerialPort * serial = get_serial_port(channel);
-    if (serial) {
-        g_debug("Data to serial device: 0x%.2hhX\n", *((char *)data));
-        gpointer wbuffer = g_memdup(data, size);
-        g_output_stream_write_async(serial->ostream, wbuffer, size, G_PRIORITY_DEFAULT,
-                                    serial->cancellable, write_cb, wbuffer);
-    }
+    if (serial)
+        serial_port_write(serial->number, data, size);
 }
@@ -26,4 +26,35 @@
 void serial_port_init(ClientConf * conf);
 void serial_port_open(SpiceChannel * channel);
 
+/*
+ * Lower level interface, used by serial_port_init and serial_port_open, and by
+ * tests that drive serial ports without a Spice session. With a guest sink,
+ * data read from the devices is passed to it instead of the port channels.
+ */
+typedef void (*SerialGuestSink)(int port_number, const char * data, gsize size,
+                                gpointer user_data);
+void serial_port_setup(gchar ** params);
+void serial_port_set_guest_sink(SerialGuestSink sink, gpointer user_data);
+gboolean serial_port_start(int port_number);
+void serial_port_stop(int port_number);
+void serial_port_write(int port_number, gconstpointer data, gsize size);
+
+/*
+ * Traffic of a serial port since it was opened. Latencies are in microseconds:
+ * to the guest, from the first byte read until the message is sent; to the
+ * device, from the message arrival until it is written. Data for the device is
+ * never dropped, it waits in a queue of up to to_device_queued_max bytes.
+ */
+typedef struct SerialPortStats {
+    guint64 to_guest_bytes;
+    guint to_guest_messages;
+    gint64 to_guest_latency, to_guest_latency_max;
+    guint64 to_device_bytes;
+    guint to_device_writes;
+    gint64 to_device_latency, to_device_latency_max;
+    gsize to_device_queued_max;
+} SerialPortStats;
+
+gboolean serial_port_get_stats(int port_number, SerialPortStats * stats);
+
 #endif // SERIALREDIR_H
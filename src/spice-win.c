@@ -21,6 +21,12 @@
 #include "flexvdi-port.h"
 #include "printclient.h"
 #include "about.h"
+#include "client-timeline.h"
+
+/*
+ * Interval between checks for changes in the list of client printers.
+ */
+#define PRINTERS_POLL_INTERVAL 30
 
 #ifdef __APPLE__
 #include <gdk/gdkquartz.h>
@@ -137,7 +143,8 @@ static void show_about(GtkToolButton * toolbutton, gpointer user_data);
 static gboolean leave_event(GtkWidget * widget, GdkEventCrossing * event, gpointer user_data);
 #endif
 
-static void spice_window_get_printers(SpiceWindow * win);
+static void printer_poll_add_window(SpiceWindow * win);
+static void printer_poll_remove_window(SpiceWindow * win);
 static void guest_agent_connected(FlexvdiPort * port, gboolean connected, SpiceWindow * win);
 
 static GActionEntry keystroke_entry[] = {
@@ -191,6 +198,7 @@ static void spice_window_init(SpiceWindow * win) {
 
 static void spice_window_dispose(GObject * obj) {
     SpiceWindow * win = SPICE_WIN(obj);
+    printer_poll_remove_window(win);
     g_clear_object(&win->conn);
     g_clear_object(&win->conf);
     if (win->display_channel)
@@ -282,7 +290,9 @@ SpiceWindow * spice_window_new(ClientConn * conn, SpiceChannel * channel,
         gtk_container_remove(GTK_CONTAINER(win->toolbar), GTK_WIDGET(win->copy_button));
         gtk_container_remove(GTK_CONTAINER(win->toolbar), GTK_WIDGET(win->paste_button));
     }
-    spice_window_get_printers(win);
+    // The printers menu is filled in when the printer list arrives
+    gtk_widget_hide(GTK_WIDGET(win->printers_button));
+    printer_poll_add_window(win);
     if (win->id == 0) {
         FlexvdiPort * guest_port = client_conn_get_guest_agent_port(conn);
         g_signal_connect(guest_port, "agent-connected", G_CALLBACK(guest_agent_connected), win);
@@ -734,13 +744,57 @@ void spice_win_set_cp_sensitive(SpiceWindow * win, gboolean copy, gboolean paste
 static void printer_toggled(GSimpleAction * action, GVariant * parameter, gpointer user_data);
 static void invert_model_button_checkbox(GtkWidget * widget, gpointer user_data);
 
-static void spice_window_get_printers(SpiceWindow * win) {
-    GSList * printers, * printer;
-    g_debug("Getting printer list:");
-    flexvdi_get_printer_list(&printers);
-    if (!printers) {
+static void share_printer_async(FlexvdiPort * guest_port, GSimpleAction * action, const gchar * printer);
+
+/*
+ * The printer list is shared by all the windows: a single timer polls it while
+ * there are windows, and each window updates its menu from the result.
+ */
+static struct {
+    GSList * windows;
+    GSList * list;
+    gboolean known, pending;
+    GCancellable * cancellable;
+    guint poll_id;
+} printer_poll;
+
+static void free_printer_list(gpointer printers) {
+    g_slist_free_full(printers, g_free);
+}
+
+static gboolean same_printer_list(GSList * a, GSList * b) {
+    if (g_slist_length(a) != g_slist_length(b)) return FALSE;
+    g_autoptr(GHashTable) names = g_hash_table_new(g_str_hash, g_str_equal);
+    for (; b; b = g_slist_next(b))
+        g_hash_table_add(names, b->data);
+    for (; a; a = g_slist_next(a))
+        if (!g_hash_table_contains(names, a->data)) return FALSE;
+    return TRUE;
+}
+
+/*
+ * Rebuilds the printers menu from the printer list. Printers that are still
+ * there keep their action, and thus their state. Printers that are gone are
+ * unshared.
+ */
+static void spice_window_update_printers_menu(SpiceWindow * win, GSList * printers) {
+    FlexvdiPort * guest_port = client_conn_get_guest_agent_port(win->conn);
+    gboolean can_share = win->id == 0 &&
+        flexvdi_port_agent_supports_capability(guest_port, FLEXVDI_CAP_PRINTING);
+    g_autoptr(GHashTable) old_actions = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTableIter iter;
+    gpointer key, value;
+    GSList * printer;
+
+    g_hash_table_iter_init(&iter, win->printer_name_for_actions);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        g_hash_table_insert(old_actions, value, key);
+
+    g_debug("Printer list:");
+    g_menu_remove_all(win->printers_menu);
+    if (!printers)
         g_menu_append(win->printers_menu, "No printers detected", NULL);
-    } else for (printer = printers; printer != NULL; printer = g_slist_next(printer)) {
+    for (printer = printers; printer != NULL; printer = g_slist_next(printer)) {
         const char * printer_name = (const char *)printer->data;
         g_autofree gchar * parsed_printer_name = g_strdup(printer_name);
         g_strcanon(parsed_printer_name,
@@ -749,24 +803,107 @@ static void spice_window_get_printers(SpiceWindow * win) {
         gboolean state = client_conf_is_printer_shared(win->conf, printer_name);
         g_debug("  %s, %s", printer_name, state ? "shared" : "not shared");
 
-        GSimpleAction * action = g_simple_action_new_stateful(parsed_printer_name, NULL,
-            g_variant_new_boolean(state));
-        g_action_map_add_action(G_ACTION_MAP(win->printer_actions), G_ACTION(action));
-        g_signal_connect(G_OBJECT(action), "activate", G_CALLBACK(printer_toggled), win);
-        g_hash_table_insert(win->printer_name_for_actions, action, g_strdup(printer_name));
+        if (!g_hash_table_remove(old_actions, printer_name)) {
+            GSimpleAction * action = g_simple_action_new_stateful(parsed_printer_name, NULL,
+                g_variant_new_boolean(state));
+            g_action_map_add_action(G_ACTION_MAP(win->printer_actions), G_ACTION(action));
+            g_signal_connect(G_OBJECT(action), "activate", G_CALLBACK(printer_toggled), win);
+            g_hash_table_insert(win->printer_name_for_actions, action, g_strdup(printer_name));
+            // Printers that appear after the agent connected are shared now
+            if (state && can_share)
+                share_printer_async(guest_port, action, printer_name);
+        }
 
         g_autofree gchar * full_action_name =
             g_strconcat("printer.", parsed_printer_name, NULL);
         GMenuItem * item = g_menu_item_new(printer_name, full_action_name);
         g_menu_append_item(win->printers_menu, item);
+        g_object_unref(item);
+    }
+
+    // Printers that are gone
+    g_hash_table_iter_init(&iter, old_actions);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_debug("  %s, removed", (const char *)key);
+        if (can_share && g_variant_get_boolean(g_action_get_state(G_ACTION(value))))
+            flexvdi_unshare_printer(guest_port, key);
+        g_action_map_remove_action(G_ACTION_MAP(win->printer_actions),
+                                   g_action_get_name(G_ACTION(value)));
+        g_hash_table_iter_remove(&iter);
+        g_hash_table_remove(win->printer_name_for_actions, value);
     }
-    g_slist_free_full(printers, g_free);
-    gtk_widget_hide(GTK_WIDGET(win->printers_button));
 
+    set_printers_menu_visibility(win);
     GtkPopover * printers_popover = gtk_menu_button_get_popover(win->printers_button);
     gtk_container_forall(GTK_CONTAINER(printers_popover), invert_model_button_checkbox, NULL);
 }
 
+static void get_printer_list_thread(GTask * task, gpointer source_object,
+                                    gpointer task_data, GCancellable * cancellable) {
+    GSList * printers;
+    // Shows in the startup trace whether enumeration delays the first frame
+    client_timeline_begin("printer-list");
+    flexvdi_get_printer_list(&printers);
+    client_timeline_end("printer-list");
+    g_task_return_pointer(task, printers, free_printer_list);
+}
+
+static void got_printer_list(GObject * source_object, GAsyncResult * res, gpointer user_data) {
+    g_autoptr(GError) error = NULL;
+    GSList * printers = g_task_propagate_pointer(G_TASK(res), &error), * window;
+    // Cancelled when the last window is destroyed
+    if (error) return;
+    printer_poll.pending = FALSE;
+    if (printer_poll.known && same_printer_list(printers, printer_poll.list)) {
+        free_printer_list(printers);
+        return;
+    }
+    free_printer_list(printer_poll.list);
+    printer_poll.list = printers;
+    printer_poll.known = TRUE;
+    for (window = printer_poll.windows; window != NULL; window = g_slist_next(window))
+        spice_window_update_printers_menu(SPICE_WIN(window->data), printers);
+}
+
+/*
+ * Enumerating printers may block for a while on a slow CUPS server, so it
+ * runs in a worker thread, both on the first window and on every poll.
+ */
+static gboolean poll_printers(gpointer user_data) {
+    if (!printer_poll.pending) {
+        printer_poll.pending = TRUE;
+        GTask * task = g_task_new(NULL, printer_poll.cancellable, got_printer_list, NULL);
+        g_task_run_in_thread(task, get_printer_list_thread);
+        g_object_unref(task);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void printer_poll_add_window(SpiceWindow * win) {
+    printer_poll.windows = g_slist_prepend(printer_poll.windows, win);
+    if (printer_poll.known)
+        spice_window_update_printers_menu(win, printer_poll.list);
+    if (!printer_poll.poll_id) {
+        printer_poll.cancellable = g_cancellable_new();
+        poll_printers(NULL);
+        printer_poll.poll_id =
+            g_timeout_add_seconds(PRINTERS_POLL_INTERVAL, poll_printers, NULL);
+    }
+}
+
+static void printer_poll_remove_window(SpiceWindow * win) {
+    if (!g_slist_find(printer_poll.windows, win)) return;
+    printer_poll.windows = g_slist_remove(printer_poll.windows, win);
+    if (printer_poll.windows) return;
+    g_cancellable_cancel(printer_poll.cancellable);
+    g_clear_object(&printer_poll.cancellable);
+    g_source_remove(printer_poll.poll_id);
+    printer_poll.poll_id = 0;
+    printer_poll.pending = printer_poll.known = FALSE;
+    free_printer_list(printer_poll.list);
+    printer_poll.list = NULL;
+}
+
 static void invert_model_button_checkbox(GtkWidget * widget, gpointer user_data) {
     if (GTK_IS_MODEL_BUTTON(widget))
         g_object_set(widget, "inverted", TRUE, NULL);
@@ -774,41 +911,16 @@ static void invert_model_button_checkbox(GtkWidget * widget, gpointer user_data)
         gtk_container_forall(GTK_CONTAINER(widget), invert_model_button_checkbox, NULL);
 }
 
-static gboolean set_printer_menu_item_sensitive(gpointer user_data) {
+static void printer_shared(const char * printer, gboolean success, gpointer user_data) {
     GSimpleAction * action = G_SIMPLE_ACTION(user_data);
     g_simple_action_set_enabled(action, TRUE);
-    return G_SOURCE_REMOVE;
-}
-
-typedef struct _ActionAndPrinter {
-    GSimpleAction * action;
-    gchar * printer;
-    FlexvdiPort * guest_port;
-} ActionAndPrinter;
-
-static gpointer share_printer_thread(gpointer user_data) {
-    ActionAndPrinter * data = (ActionAndPrinter *)user_data;
-    flexvdi_share_printer(data->guest_port, data->printer);
-    g_idle_add(set_printer_menu_item_sensitive, data->action);
-    g_free(data->printer);
-    g_free(data);
-    return NULL;
+    g_object_unref(action);
 }
 
 static void share_printer_async(FlexvdiPort * guest_port, GSimpleAction * action, const gchar * printer) {
-    // flexvdi_share_printer can be a bit slow and "hang" the GUI
+    // Sharing runs in the background, the item is disabled until it finishes
     g_simple_action_set_enabled(action, FALSE);
-    ActionAndPrinter * data = g_new(ActionAndPrinter, 1);
-    data->action = action;
-    data->printer = g_strdup(printer);
-    data->guest_port = guest_port;
-    GThread * thread = g_thread_try_new(NULL, share_printer_thread,
-                                        data, NULL);
-    if (!thread) {
-        share_printer_thread(data);
-    } else {
-        g_thread_unref(thread);
-    }
+    flexvdi_share_printer_async(guest_port, printer, printer_shared, g_object_ref(action));
 }
 
 static void printer_toggled(GSimpleAction * action, GVariant * parameter, gpointer user_data) {
@@ -28,6 +28,7 @@
 #include <gio/gio.h>
 
 #include "ws-tunnel.h"
+#include "client-log.h"
 
 #ifdef G_LOG_DOMAIN
 #undef G_LOG_DOMAIN
@@ -273,7 +274,7 @@ static void read_local_finished(GObject * source_object, GAsyncResult * res,
                     tunnel->channel_name);
                 g_signal_emit(tunnel, signals[WS_TUNNEL_EOF], 0);
             } else {
-                g_debug("WS tunnel %s read %d bytes from local",
+                client_debug("WS tunnel %s read %d bytes from local",
                     tunnel->channel_name, (int)g_bytes_get_size(bytes));
                 soup_websocket_connection_send_binary(tunnel->ws_conn,
                     g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes));
@@ -300,7 +301,7 @@ static void on_ws_msg(SoupWebsocketConnection * self, gint type,
                       GBytes * message, gpointer user_data) {
     WsTunnel * tunnel = WS_TUNNEL(user_data);
     if (!g_cancellable_is_cancelled(tunnel->cancel)) {
-        g_debug("WS tunnel %s read %d bytes from ws", tunnel->channel_name,
+        client_debug("WS tunnel %s read %d bytes from ws", tunnel->channel_name,
             (int)g_bytes_get_size(message));
         tunnel->in_buffer = g_list_append(tunnel->in_buffer, g_bytes_ref(message));
         if (g_list_length(tunnel->in_buffer) == 1)
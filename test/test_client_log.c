@@ -17,10 +17,38 @@
     along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
+#include <string.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include "src/client-log.h"
 
 
+static gchar * log_path = NULL;
+
+/*
+ * Send the log to a temporary file and install the client log writer.
+ * The writer can only be installed once per process.
+ */
+static void setup_log_file() {
+    if (log_path) return;
+    gint fd = g_file_open_tmp("test_client_log-XXXXXX", &log_path, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    g_close(fd, NULL);
+    g_setenv("FLEXVDI_LOG_STDERR", "1", TRUE);
+    g_assert_nonnull(freopen(log_path, "w", stderr));
+    client_log_setup();
+}
+
+
+static gsize count_lines(const gchar * text) {
+    gsize lines = 0;
+    for (; *text; ++text)
+        if (*text == '\n') ++lines;
+    return lines;
+}
+
+
 void test_client_log() {
     // Test that log configuration strings work
 
@@ -45,10 +73,207 @@ void test_client_log() {
     g_assert_cmpstr(g_getenv("SPICE_DEBUG"), ==, "1");
 }
 
+
+void test_client_log_enabled() {
+    // Test the fast enabled check against the configured levels
+    client_log_set_recorder_level(0);
+    client_log_set_log_levels("3");
+    g_assert_true(client_log_is_enabled("foo", G_LOG_LEVEL_WARNING));
+    g_assert_true(client_log_is_enabled("foo", G_LOG_LEVEL_MESSAGE));
+    g_assert_false(client_log_is_enabled("foo", G_LOG_LEVEL_DEBUG));
+    g_assert_false(client_log_is_enabled(NULL, G_LOG_LEVEL_INFO));
+
+    client_log_set_log_levels("foo:5,bar:1,2");
+    g_assert_true(client_log_is_enabled("foo", G_LOG_LEVEL_DEBUG));
+    g_assert_false(client_log_is_enabled("bar", G_LOG_LEVEL_WARNING));
+    g_assert_true(client_log_is_enabled("bar", G_LOG_LEVEL_CRITICAL));
+    g_assert_true(client_log_is_enabled("baz", G_LOG_LEVEL_WARNING));
+    g_assert_false(client_log_is_enabled("baz", G_LOG_LEVEL_MESSAGE));
+
+    int evaluated = 0;
+    client_log_set_log_levels("4");
+    client_debug("Not evaluated %d", ++evaluated);
+    g_assert_cmpint(evaluated, ==, 0);
+    g_assert_false(client_log_debug_enabled());
+
+    // The flight recorder does not enable hot path debug lines
+    client_log_set_recorder_level(G_LOG_LEVEL_DEBUG);
+    g_assert_false(client_log_debug_enabled());
+    client_debug("Not evaluated %d", ++evaluated);
+    g_assert_cmpint(evaluated, ==, 0);
+    client_log_set_recorder_level(0);
+}
+
+void test_client_log_batched() {
+    // Test that batched lines are all written, in order
+    setup_log_file();
+    client_log_set_log_levels("5");
+    g_assert_nonnull(freopen(log_path, "w", stderr));
+
+    const int num_lines = 2000;
+    int i;
+    for (i = 0; i < num_lines; ++i)
+        g_debug("line %d", i);
+    client_log_flush();
+
+    g_autofree gchar * contents = NULL;
+    g_assert_true(g_file_get_contents(log_path, &contents, NULL, NULL));
+    g_assert_cmpuint(count_lines(contents), ==, num_lines);
+    const gchar * pos = contents;
+    for (i = 0; i < num_lines; ++i) {
+        g_autofree gchar * line = g_strdup_printf("-DEBUG: line %d\n", i);
+        pos = strstr(pos, line);
+        g_assert_nonnull(pos);
+    }
+}
+
+
+void test_client_log_recorder() {
+    // Test that lines below the log level are only written when the recorder is dumped
+    setup_log_file();
+    client_log_set_log_levels("3");
+    client_log_set_recorder_level(G_LOG_LEVEL_DEBUG);
+    g_assert_nonnull(freopen(log_path, "w", stderr));
+
+    int i;
+    for (i = 0; i < 2000; ++i)
+        g_debug("recorded %d", i);
+    g_info("recorded info");
+    g_message("logged message");
+    client_log_flush();
+
+    g_autofree gchar * contents = NULL;
+    g_assert_true(g_file_get_contents(log_path, &contents, NULL, NULL));
+    g_assert_cmpuint(count_lines(contents), ==, 1);
+    g_assert_null(strstr(contents, "recorded"));
+
+    client_log_dump_recorder("test");
+    g_free(contents);
+    g_assert_true(g_file_get_contents(log_path, &contents, NULL, NULL));
+    // Header, the last slots and footer
+    g_assert_cmpuint(count_lines(contents), ==, 1 + 1 + 1024 + 1);
+    g_assert_nonnull(strstr(contents, "before test"));
+    g_assert_null(strstr(contents, "recorded 976\n"));
+    g_assert_nonnull(strstr(contents, "recorded 977\n"));
+    g_assert_nonnull(strstr(contents, "-INFO: recorded info\n"));
+
+    // Only new lines are dumped again
+    g_debug("recorded again");
+    client_log_dump_recorder("second test");
+    g_free(contents);
+    g_assert_true(g_file_get_contents(log_path, &contents, NULL, NULL));
+    g_assert_cmpuint(count_lines(contents), ==, 1 + 1 + 1024 + 1 + 3);
+    client_log_set_recorder_level(0);
+}
+
+
+void test_client_log_rotation() {
+    // Test that the log file is rotated and old segments compressed, in a subprocess
+    // because the log file replaces stdout
+    if (g_test_subprocess()) {
+        g_setenv("FLEXVDI_LOG_FILE", g_getenv("TEST_LOG_FILE"), TRUE);
+        g_setenv("FLEXVDI_LOG_ROTATE", "16K,3", TRUE);
+        client_log_setup();
+        client_log_set_log_levels("5");
+        int i;
+        for (i = 0; i < 5000; ++i) {
+            g_debug("line %d", i);
+            if (i % 100 == 0) client_log_flush();
+        }
+        return;
+    }
+
+    g_autofree gchar * dir = g_dir_make_tmp("test_client_log-XXXXXX", NULL);
+    g_autofree gchar * path = g_build_filename(dir, "client.log", NULL);
+    g_autofree gchar * path1 = g_strconcat(path, ".1.gz", NULL);
+    g_autofree gchar * path2 = g_strconcat(path, ".2.gz", NULL);
+
+    g_setenv("TEST_LOG_FILE", path, TRUE);
+    g_test_trap_subprocess(NULL, 0, 0);
+    g_test_trap_assert_passed();
+
+    g_autofree gchar * contents = NULL;
+    g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+    g_assert_nonnull(strstr(contents, "line 4999\n"));
+    g_assert_null(strstr(contents, "line 0\n"));
+
+    gsize length;
+    g_autofree gchar * archive = NULL;
+    g_assert_true(g_file_get_contents(path1, &archive, &length, NULL));
+    g_assert_cmpuint(length, >, 2);
+    g_assert_cmpint((guchar)archive[0], ==, 0x1f);
+    g_assert_cmpint((guchar)archive[1], ==, 0x8b);
+    g_assert_true(g_file_test(path2, G_FILE_TEST_EXISTS));
+
+    // Only the log file and two archives are kept
+    g_autoptr(GDir) gdir = g_dir_open(dir, 0, NULL);
+    const gchar * name;
+    int num_files = 0;
+    while ((name = g_dir_read_name(gdir))) {
+        g_autofree gchar * file = g_build_filename(dir, name, NULL);
+        g_unlink(file);
+        ++num_files;
+    }
+    g_assert_cmpint(num_files, ==, 3);
+    g_rmdir(dir);
+}
+
+
+static double log_lines(int num_lines) {
+    int i;
+    gint64 start = g_get_monotonic_time();
+    for (i = 0; i < num_lines; ++i)
+        g_debug("WS tunnel %p read %d bytes from local", &i, i);
+    return (g_get_monotonic_time() - start) / 1000000.0;
+}
+
+
+void test_client_log_perf() {
+    // Measure the cost of debug lines for the logging thread, and the write throughput
+    setup_log_file();
+    const int num_lines = 200000;
+
+    client_log_set_log_levels("4");
+    client_log_set_recorder_level(0);
+    double disabled = log_lines(num_lines);
+    client_log_set_recorder_level(G_LOG_LEVEL_DEBUG);
+    double recorded = log_lines(num_lines);
+    client_log_set_recorder_level(0);
+
+    client_log_set_log_levels("5");
+    g_assert_nonnull(freopen(log_path, "w", stderr));
+    gint64 start = g_get_monotonic_time();
+    double enqueue = log_lines(num_lines);
+    client_log_flush();
+    double total = (g_get_monotonic_time() - start) / 1000000.0;
+
+    g_test_minimized_result((enqueue - disabled) * 1e9 / num_lines,
+                            "debug line overhead: %.0f ns", (enqueue - disabled) * 1e9 / num_lines);
+    g_test_minimized_result((recorded - disabled) * 1e9 / num_lines,
+                            "recorded line overhead: %.0f ns", (recorded - disabled) * 1e9 / num_lines);
+    g_test_maximized_result(num_lines / total, "written: %.0f lines/s", num_lines / total);
+
+    g_autofree gchar * contents = NULL;
+    g_assert_true(g_file_get_contents(log_path, &contents, NULL, NULL));
+    g_assert_cmpuint(count_lines(contents), ==, num_lines);
+}
+
+
 int main(int argc, char * argv[]) {
     g_test_init(&argc, &argv, NULL);
 
     g_test_add_func("/misc/client_log", test_client_log);
+    g_test_add_func("/misc/client_log_enabled", test_client_log_enabled);
+    g_test_add_func("/misc/client_log_batched", test_client_log_batched);
+    g_test_add_func("/misc/client_log_recorder", test_client_log_recorder);
+    g_test_add_func("/misc/client_log_rotation", test_client_log_rotation);
+    if (g_test_perf())
+        g_test_add_func("/misc/client_log_perf", test_client_log_perf);
 
-    return g_test_run();
+    int result = g_test_run();
+    if (log_path) {
+        g_unlink(log_path);
+        g_free(log_path);
+    }
+    return result;
 }
@@ -17,9 +17,12 @@
     along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
 #include <glib.h>
+#include <libsoup/soup.h>
 #include "src/client-log.h"
 #include "src/client-request.h"
+#include "test/test_tls_cert.h"
 
 
 typedef struct _Fixture {
@@ -28,6 +31,13 @@ typedef struct _Fixture {
     ClientRequest * req;
     GError * error;
     JsonNode * resp;
+    // Stand-in broker
+    SoupServer * server;
+    gint desktop_requests;
+    gboolean desktop_ready;
+    gboolean long_poll;
+    GList * held;
+    gint prewarms;
 } Fixture;
 
 static void f_setup(Fixture * f, gconstpointer user_data) {
@@ -95,6 +105,190 @@ static void test_client_request_post(Fixture *f, gconstpointer user_data) {
 }
 
 
+static void set_json_response(SoupMessage * msg, const gchar * body) {
+    soup_message_set_status(msg, SOUP_STATUS_OK);
+    soup_message_set_response(msg, "application/json", SOUP_MEMORY_COPY, body, strlen(body));
+}
+
+
+/*
+ * Stand-in broker desktop handler. While the desktop is not ready, it holds long
+ * poll requests if it supports them, and answers Pending to the rest.
+ */
+static void desktop_handler(SoupServer * server, SoupMessage * msg, const char * path,
+                            GHashTable * query, SoupClientContext * client, gpointer user_data) {
+    Fixture * f = (Fixture *)user_data;
+    const gchar * prefer = soup_message_headers_get_one(msg->request_headers, "Prefer");
+    f->desktop_requests++;
+    if (f->desktop_ready) {
+        set_json_response(msg, "{\"status\": \"OK\"}");
+    } else if (f->long_poll && prefer && g_str_has_prefix(prefer, "wait=")) {
+        soup_server_pause_message(server, msg);
+        f->held = g_list_append(f->held, msg);
+    } else {
+        set_json_response(msg, "{\"status\": \"Pending\"}");
+        soup_message_headers_replace(msg->response_headers, "Retry-After", "7");
+    }
+}
+
+
+/*
+ * Stand-in broker handler for any other path, like the root the connections are
+ * pre-warmed with.
+ */
+static void default_handler(SoupServer * server, SoupMessage * msg, const char * path,
+                            GHashTable * query, SoupClientContext * client, gpointer user_data) {
+    Fixture * f = (Fixture *)user_data;
+    if (msg->method == SOUP_METHOD_HEAD)
+        f->prewarms++;
+    soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+}
+
+
+static gboolean desktop_ready(gpointer user_data) {
+    Fixture * f = (Fixture *)user_data;
+    GList * i;
+    f->desktop_ready = TRUE;
+    for (i = f->held; i; i = i->next) {
+        SoupMessage * msg = (SoupMessage *)i->data;
+        soup_message_headers_replace(msg->response_headers, "Preference-Applied", "wait=25");
+        set_json_response(msg, "{\"status\": \"OK\"}");
+        soup_server_unpause_message(f->server, msg);
+    }
+    g_clear_pointer(&f->held, g_list_free);
+    return G_SOURCE_REMOVE;
+}
+
+
+static void f_broker_setup(Fixture * f, gconstpointer user_data) {
+    g_autoptr(GError) error = NULL;
+    memset(f, 0, sizeof(Fixture));
+    f->loop = g_main_loop_new(NULL, FALSE);
+    f->conf = client_conf_new();
+
+    g_autoptr(GTlsCertificate) cert = g_tls_certificate_new_from_pem(test_tls_cert_pem, -1, &error);
+    g_assert_no_error(error);
+    f->server = soup_server_new(SOUP_SERVER_TLS_CERTIFICATE, cert, NULL);
+    soup_server_add_handler(f->server, "/vdi/desktop", desktop_handler, f, NULL);
+    soup_server_add_handler(f->server, NULL, default_handler, f, NULL);
+    soup_server_listen_local(f->server, 0,
+        SOUP_SERVER_LISTEN_HTTPS | SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+    g_assert_no_error(error);
+
+    GSList * uris = soup_server_get_uris(f->server);
+    g_autofree gchar * port = g_strdup_printf("%u", soup_uri_get_port((SoupURI *)uris->data));
+    g_slist_free_full(uris, (GDestroyNotify)soup_uri_free);
+    client_conf_set_host(f->conf, "127.0.0.1");
+    client_conf_set_port(f->conf, port);
+}
+
+
+static void f_broker_teardown(Fixture * f, gconstpointer user_data) {
+    f_teardown(f, user_data);
+    g_object_unref(f->server);
+}
+
+
+static void test_client_request_long_poll(Fixture *f, gconstpointer user_data) {
+    // Test that a long poll request is held until the desktop is ready
+    f->long_poll = TRUE;
+    g_timeout_add(200, desktop_ready, f);
+    gint64 start = g_get_monotonic_time();
+    f->req = client_request_new_long_poll(f->conf, "/vdi/desktop",
+        "{}", "{}", 25, request_result, f);
+
+    g_main_loop_run(f->loop);
+
+    g_assert_no_error(f->error);
+    g_assert_cmpint(f->desktop_requests, ==, 1);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 200000);
+    g_assert_true(client_request_long_poll_applied(f->req));
+    JsonObject * response = json_node_get_object(f->resp);
+    g_assert_cmpstr(json_object_get_string_member(response, "status"), ==, "OK");
+}
+
+
+static void test_client_request_retry_after(Fixture *f, gconstpointer user_data) {
+    // Test that brokers without long polling answer right away, with their poll delay
+    f->req = client_request_new_long_poll(f->conf, "/vdi/desktop",
+        "{}", "{}", 25, request_result, f);
+
+    g_main_loop_run(f->loop);
+
+    g_assert_no_error(f->error);
+    g_assert_false(client_request_long_poll_applied(f->req));
+    g_assert_cmpint(client_request_get_retry_after(f->req), ==, 7);
+    JsonObject * response = json_node_get_object(f->resp);
+    g_assert_cmpstr(json_object_get_string_member(response, "status"), ==, "Pending");
+}
+
+
+static void test_client_request_new_connection(Fixture *f, gconstpointer user_data) {
+    // Test that the first request opens a new connection, and the next one reuses it
+    f->req = client_request_new_with_data(f->conf, "/vdi/desktop", "{}", "{}", request_result, f);
+    g_main_loop_run(f->loop);
+    g_assert_no_error(f->error);
+    g_assert_false(client_request_reused_connection(f->req));
+
+    g_object_unref(f->req);
+    f->req = client_request_new_with_data(f->conf, "/vdi/desktop", "{}", "{}", request_result, f);
+    g_main_loop_run(f->loop);
+    g_assert_no_error(f->error);
+    g_assert_true(client_request_reused_connection(f->req));
+}
+
+
+static gboolean request_desktop(gpointer user_data) {
+    Fixture * f = (Fixture *)user_data;
+    f->req = client_request_new_with_data(f->conf, "/vdi/desktop", "{}", "{}", request_result, f);
+    return G_SOURCE_REMOVE;
+}
+
+
+static void test_client_request_prewarm(Fixture *f, gconstpointer user_data) {
+    // Test that a request after pre-warming starts on the pre-warmed connection
+    client_request_prewarm(f->conf, NULL);
+    g_timeout_add(200, request_desktop, f);
+    g_main_loop_run(f->loop);
+
+    g_assert_no_error(f->error);
+    g_assert_cmpint(f->prewarms, ==, 1);
+    g_assert_true(client_request_reused_connection(f->req));
+}
+
+
+static void poll_desktop(ClientRequest * req, gpointer user_data) {
+    Fixture * f = (Fixture *)user_data;
+    JsonNode * root = client_request_get_result(req, &f->error);
+    g_assert_no_error(f->error);
+    const gchar * status = json_object_get_string_member(json_node_get_object(root), "status");
+    if (g_str_equal(status, "OK")) {
+        g_main_loop_quit(f->loop);
+    } else {
+        g_object_unref(f->req);
+        f->req = client_request_new_long_poll(f->conf, "/vdi/desktop",
+            "{}", "{}", 25, poll_desktop, f);
+    }
+}
+
+
+static void test_client_request_desktop_latency(Fixture *f, gconstpointer user_data) {
+    // Measure the time from the desktop being ready to the client knowing it,
+    // which was up to the 3 seconds of the poll interval
+    const gint ready_ms = 500;
+    f->long_poll = TRUE;
+    g_timeout_add(ready_ms, desktop_ready, f);
+    gint64 start = g_get_monotonic_time();
+    f->req = client_request_new_with_data(f->conf, "/vdi/desktop", "{}", "{}", poll_desktop, f);
+
+    g_main_loop_run(f->loop);
+
+    double latency = (g_get_monotonic_time() - start) / 1000.0 - ready_ms;
+    g_test_minimized_result(latency, "desktop ready to response: %.1f ms", latency);
+    g_assert_cmpint(f->desktop_requests, ==, 2);
+}
+
+
 int main(int argc, char * argv[]) {
     g_test_init(&argc, &argv, NULL);
 
@@ -112,6 +306,22 @@ int main(int argc, char * argv[]) {
     g_test_add("/client-request/post",
         Fixture, NULL, f_setup, test_client_request_post, f_teardown);
 
+    g_test_add("/client-request/long-poll",
+        Fixture, NULL, f_broker_setup, test_client_request_long_poll, f_broker_teardown);
+
+    g_test_add("/client-request/retry-after",
+        Fixture, NULL, f_broker_setup, test_client_request_retry_after, f_broker_teardown);
+
+    g_test_add("/client-request/new-connection",
+        Fixture, NULL, f_broker_setup, test_client_request_new_connection, f_broker_teardown);
+
+    g_test_add("/client-request/prewarm",
+        Fixture, NULL, f_broker_setup, test_client_request_prewarm, f_broker_teardown);
+
+    if (g_test_perf())
+        g_test_add("/client-request/desktop-latency",
+            Fixture, NULL, f_broker_setup, test_client_request_desktop_latency, f_broker_teardown);
+
     // TODO: Don't know how to check if a request has been canceled,
     // because the main loop runs forever
 
@@ -0,0 +1,121 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+#include "src/client-timeline.h"
+
+
+static gpointer thread_span(gpointer data) {
+    client_timeline_begin("thread-work");
+    g_usleep(1000);
+    client_timeline_end("thread-work");
+    return NULL;
+}
+
+
+void test_timeline_summary() {
+    // Test that instants and spans show up in order, with their durations
+    client_timeline_reset();
+    client_timeline_start();
+    client_timeline_begin("outer");
+    client_timeline_begin("inner");
+    g_usleep(2000);
+    client_timeline_end("inner");
+    client_timeline_mark("instant");
+    client_timeline_end("outer");
+    client_timeline_begin("unfinished");
+
+    g_autofree gchar * summary = client_timeline_summary();
+    gchar ** items = g_strsplit(summary, " ", 0);
+    g_assert_cmpuint(g_strv_length(items), ==, 4);
+    g_assert_true(g_str_has_prefix(items[0], "outer="));
+    g_assert_true(g_str_has_prefix(items[1], "inner="));
+    g_assert_true(g_str_has_prefix(items[2], "instant="));
+    g_assert_null(strchr(items[2], '+'));
+    g_assert_true(g_str_has_prefix(items[3], "unfinished="));
+    g_assert_true(g_str_has_suffix(items[3], "+?"));
+    double inner = g_ascii_strtod(strchr(items[1], '+') + 1, NULL);
+    double outer = g_ascii_strtod(strchr(items[0], '+') + 1, NULL);
+    g_assert_cmpfloat(inner, >=, 2.0);
+    g_assert_cmpfloat(outer, >=, inner);
+    g_strfreev(items);
+}
+
+
+void test_timeline_trace() {
+    // Test that the trace is valid JSON in Chrome trace format, with a tid per thread
+    client_timeline_reset();
+    client_timeline_mark("main-\"quoted\"");
+    GThread * thread = g_thread_new("timeline", thread_span, NULL);
+    g_thread_join(thread);
+
+    g_autofree gchar * file_name = NULL;
+    gint fd = g_file_open_tmp("test_timeline-XXXXXX.json", &file_name, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    g_close(fd, NULL);
+    g_assert_true(client_timeline_write_trace(file_name, NULL));
+
+    g_autoptr(JsonParser) parser = json_parser_new();
+    g_assert_true(json_parser_load_from_file(parser, file_name, NULL));
+    g_unlink(file_name);
+    JsonObject * root = json_node_get_object(json_parser_get_root(parser));
+    JsonArray * trace_events = json_object_get_array_member(root, "traceEvents");
+    g_assert_cmpuint(json_array_get_length(trace_events), ==, 2);
+
+    JsonObject * mark = json_array_get_object_element(trace_events, 0);
+    g_assert_cmpstr(json_object_get_string_member(mark, "name"), ==, "main-\"quoted\"");
+    g_assert_cmpstr(json_object_get_string_member(mark, "ph"), ==, "i");
+    JsonObject * span = json_array_get_object_element(trace_events, 1);
+    g_assert_cmpstr(json_object_get_string_member(span, "ph"), ==, "X");
+    g_assert_cmpint(json_object_get_int_member(span, "dur"), >=, 1000);
+    g_assert_cmpint(json_object_get_int_member(span, "tid"), !=,
+                    json_object_get_int_member(mark, "tid"));
+}
+
+
+void test_timeline_after_report() {
+    // Test that nothing is recorded once the timeline has been reported
+    client_timeline_reset();
+    client_timeline_begin("startup");
+    client_timeline_report();
+    client_timeline_end("startup");
+    client_timeline_mark("late");
+    g_autofree gchar * summary = client_timeline_summary();
+    g_assert_cmpstr(summary, ==, "startup=0.0+?");
+
+    // Test that a reset allows recording again
+    client_timeline_reset();
+    client_timeline_mark("again");
+    g_autofree gchar * again = client_timeline_summary();
+    g_assert_true(g_str_has_prefix(again, "again="));
+}
+
+
+int main(int argc, char * argv[]) {
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/timeline/summary", test_timeline_summary);
+    g_test_add_func("/timeline/trace", test_timeline_trace);
+    g_test_add_func("/timeline/after_report", test_timeline_after_report);
+
+    return g_test_run();
+}
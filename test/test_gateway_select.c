@@ -0,0 +1,279 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include "src/client-log.h"
+#include "src/gateway-select.h"
+#include "test/test_tls_cert.h"
+
+
+// Network of the stand-in gateways, all of them on the loopback interface
+#define LOOPBACK_NETWORK "127.0.0.0/24"
+
+
+/*
+ * Stand-in gateway. It accepts connections right away, but answers the TLS
+ * handshake after a delay, to emulate a distant gateway.
+ */
+typedef struct {
+    GSocketService * service;
+    gchar * address;
+    guint delay;
+    gint connections;
+} Gateway;
+
+typedef struct {
+    GMainLoop * loop;
+    ClientConf * conf;
+    GTlsCertificate * cert;
+    Gateway near, far;
+    gchar * selected;
+    GError * error;
+} Fixture;
+
+
+static void handshake_done(GObject * source, GAsyncResult * res, gpointer user_data) {
+    g_tls_connection_handshake_finish(G_TLS_CONNECTION(source), res, NULL);
+    g_object_unref(source);
+}
+
+
+static gboolean start_handshake(gpointer user_data) {
+    GIOStream * tls = G_IO_STREAM(user_data);
+    g_tls_connection_handshake_async(G_TLS_CONNECTION(tls), G_PRIORITY_DEFAULT, NULL,
+                                     handshake_done, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+
+static gboolean incoming(GSocketService * service, GSocketConnection * connection,
+                         GObject * source_object, gpointer user_data) {
+    Fixture * f = (Fixture *)user_data;
+    Gateway * gw = service == f->near.service ? &f->near : &f->far;
+    gw->connections++;
+    GIOStream * tls = g_tls_server_connection_new(G_IO_STREAM(connection), f->cert, NULL);
+    g_assert_nonnull(tls);
+    g_timeout_add(gw->delay, start_handshake, tls);
+    return TRUE;
+}
+
+
+static void gateway_setup(Fixture * f, Gateway * gw, guint delay) {
+    g_autoptr(GError) error = NULL;
+    gw->service = g_socket_service_new();
+    guint16 port = g_socket_listener_add_any_inet_port(G_SOCKET_LISTENER(gw->service), NULL, &error);
+    g_assert_no_error(error);
+    gw->address = g_strdup_printf("127.0.0.1:%u", port);
+    gw->delay = delay;
+    g_signal_connect(gw->service, "incoming", G_CALLBACK(incoming), f);
+    g_socket_service_start(gw->service);
+}
+
+
+static void gateway_teardown(Gateway * gw) {
+    g_socket_service_stop(gw->service);
+    g_socket_listener_close(G_SOCKET_LISTENER(gw->service));
+    g_object_unref(gw->service);
+    g_free(gw->address);
+}
+
+
+static void f_setup(Fixture * f, gconstpointer user_data) {
+    g_autoptr(GError) error = NULL;
+    memset(f, 0, sizeof(Fixture));
+    f->loop = g_main_loop_new(NULL, FALSE);
+    f->conf = client_conf_new();
+    client_conf_wait_loaded(f->conf);
+    f->cert = g_tls_certificate_new_from_pem(test_tls_cert_pem, -1, &error);
+    g_assert_no_error(error);
+    gateway_setup(f, &f->near, 0);
+    gateway_setup(f, &f->far, 300);
+}
+
+
+static void f_teardown(Fixture * f, gconstpointer user_data) {
+    gateway_teardown(&f->near);
+    gateway_teardown(&f->far);
+    g_clear_error(&f->error);
+    g_free(f->selected);
+    g_object_unref(f->cert);
+    g_object_unref(f->conf);
+    g_main_loop_unref(f->loop);
+
+    // Forget the selected gateways
+    g_autofree gchar * config_file =
+        g_build_filename(g_get_user_config_dir(), "flexvdi-client", "settings.ini", NULL);
+    g_unlink(config_file);
+}
+
+
+static void gateway_selected(GObject * source, GAsyncResult * res, gpointer user_data) {
+    Fixture * f = (Fixture *)user_data;
+    g_clear_pointer(&f->selected, g_free);
+    g_clear_error(&f->error);
+    f->selected = gateway_select_finish(f->conf, res, &f->error);
+    g_main_loop_quit(f->loop);
+}
+
+
+static void select_gateway(Fixture * f, const gchar * first, const gchar * second) {
+    const gchar * candidates[] = { first, second, NULL };
+    gateway_select_async(f->conf, (gchar **)candidates, NULL, gateway_selected, f);
+    g_main_loop_run(f->loop);
+}
+
+
+static void test_gateway_select_fastest(Fixture * f, gconstpointer user_data) {
+    // Test that the gateway that completes the handshake first is selected
+    select_gateway(f, f->far.address, f->near.address);
+
+    g_assert_no_error(f->error);
+    g_assert_cmpstr(f->selected, ==, f->near.address);
+    g_assert_cmpint(f->near.connections, ==, 1);
+    g_autofree gchar * cached = client_conf_get_network_gateway(f->conf, LOOPBACK_NETWORK);
+    g_assert_cmpstr(cached, ==, f->near.address);
+}
+
+
+static void test_gateway_select_unreachable(Fixture * f, gconstpointer user_data) {
+    // Test that gateways that refuse the connection are skipped
+    select_gateway(f, "127.0.0.1:1", f->far.address);
+
+    g_assert_no_error(f->error);
+    g_assert_cmpstr(f->selected, ==, f->far.address);
+}
+
+
+static void test_gateway_select_none(Fixture * f, gconstpointer user_data) {
+    // Test that an error is returned when no gateway answers
+    select_gateway(f, "127.0.0.1:1", "127.0.0.1:2");
+
+    g_assert_error(f->error, G_IO_ERROR, G_IO_ERROR_HOST_UNREACHABLE);
+    g_assert_null(f->selected);
+}
+
+
+static gboolean cache_refreshed(gpointer user_data) {
+    Fixture * f = (Fixture *)user_data;
+    g_autofree gchar * cached = client_conf_get_network_gateway(f->conf, LOOPBACK_NETWORK);
+    if (g_strcmp0(cached, f->far.address))
+        return G_SOURCE_CONTINUE;
+    g_main_loop_quit(f->loop);
+    return G_SOURCE_REMOVE;
+}
+
+
+static void test_gateway_select_cached(Fixture * f, gconstpointer user_data) {
+    // Test that the gateway selected before on this network is selected right away,
+    // and that the background probes refresh the choice for the next time
+    select_gateway(f, f->far.address, f->near.address);
+    g_assert_cmpstr(f->selected, ==, f->near.address);
+
+    f->near.delay = 600;
+    f->far.delay = 0;
+    gint64 start = g_get_monotonic_time();
+    select_gateway(f, f->far.address, f->near.address);
+    g_assert_no_error(f->error);
+    g_assert_cmpstr(f->selected, ==, f->near.address);
+    g_assert_cmpint(g_get_monotonic_time() - start, <, 300000);
+
+    g_timeout_add(10, cache_refreshed, f);
+    g_main_loop_run(f->loop);
+    g_autofree gchar * cached = client_conf_get_network_gateway(f->conf, LOOPBACK_NETWORK);
+    g_assert_cmpstr(cached, ==, f->far.address);
+}
+
+
+static void test_gateway_select_candidates(Fixture * f, gconstpointer user_data) {
+    // Test that candidates come from the desktop response, then the configuration,
+    // without repetitions
+    g_autoptr(GKeyFile) file = g_key_file_new();
+    g_key_file_set_string(file, "General", "gateway", "gw2.example.com;gw3.example.com:8443");
+    g_autofree gchar * config_dir = g_build_filename(g_get_user_config_dir(), "flexvdi-client", NULL);
+    g_autofree gchar * config_file = g_build_filename(config_dir, "settings.ini", NULL);
+    g_mkdir_with_parents(config_dir, 0700);
+    g_assert_true(g_key_file_save_to_file(file, config_file, NULL));
+    g_autoptr(ClientConf) conf = client_conf_new();
+    client_conf_wait_loaded(conf);
+
+    g_autoptr(JsonParser) parser = json_parser_new();
+    g_assert_true(json_parser_load_from_data(parser,
+        "{\"spice_address\": \"gw1.example.com\","
+        " \"gateways\": [\"gw1.example.com\", \"gw2.example.com\", 42]}", -1, NULL));
+    g_auto(GStrv) candidates =
+        gateway_select_candidates(conf, json_node_get_object(json_parser_get_root(parser)));
+
+    g_assert_cmpint(g_strv_length(candidates), ==, 3);
+    g_assert_cmpstr(candidates[0], ==, "gw1.example.com");
+    g_assert_cmpstr(candidates[1], ==, "gw2.example.com");
+    g_assert_cmpstr(candidates[2], ==, "gw3.example.com:8443");
+}
+
+
+static void test_gateway_select_latency(Fixture * f, gconstpointer user_data) {
+    // Measure the time to select a gateway, which is bounded by the nearest one
+    gint64 start = g_get_monotonic_time();
+    select_gateway(f, f->far.address, f->near.address);
+    double elapsed = (g_get_monotonic_time() - start) / 1000.0;
+    g_test_minimized_result(elapsed, "gateway selection: %.1f ms", elapsed);
+    g_assert_cmpstr(f->selected, ==, f->near.address);
+}
+
+
+int main(int argc, char * argv[]) {
+    g_test_init(&argc, &argv, NULL);
+
+    g_setenv("FLEXVDI_LOG_STDERR", "1", TRUE);
+    g_setenv("FLEXVDI_FATAL_LEVEL", "0", TRUE);
+    client_log_setup();
+    client_log_set_log_levels("5");
+
+    // Keep the selected gateways away from the user settings
+    g_autofree gchar * config_dir = g_dir_make_tmp("test_gateway_select-XXXXXX", NULL);
+    g_setenv("XDG_CONFIG_HOME", config_dir, TRUE);
+
+    g_test_add("/gateway-select/fastest",
+        Fixture, NULL, f_setup, test_gateway_select_fastest, f_teardown);
+
+    g_test_add("/gateway-select/unreachable",
+        Fixture, NULL, f_setup, test_gateway_select_unreachable, f_teardown);
+
+    g_test_add("/gateway-select/none",
+        Fixture, NULL, f_setup, test_gateway_select_none, f_teardown);
+
+    g_test_add("/gateway-select/cached",
+        Fixture, NULL, f_setup, test_gateway_select_cached, f_teardown);
+
+    g_test_add("/gateway-select/candidates",
+        Fixture, NULL, f_setup, test_gateway_select_candidates, f_teardown);
+
+    if (g_test_perf())
+        g_test_add("/gateway-select/latency",
+            Fixture, NULL, f_setup, test_gateway_select_latency, f_teardown);
+
+    int result = g_test_run();
+
+    g_autofree gchar * flexvdi_dir = g_build_filename(config_dir, "flexvdi-client", NULL);
+    g_rmdir(flexvdi_dir);
+    g_rmdir(config_dir);
+    return result;
+}
@@ -0,0 +1,92 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include "src/printclient-priv.h"
+
+
+void test_job_options() {
+    // Test that options are parsed into name/value pairs
+    GHashTable * options = job_options_parse(
+        "printer=\"HP LaserJet 4/copy\" title=\"My \xc3\xa1 document\" copies=3 noCollate "
+        "sides=two-sided-long-edge media=A4 media-source=1 Resolution=600 color");
+    g_assert_cmpstr(job_options_get(options, "printer"), ==, "HP LaserJet 4/copy");
+    g_assert_cmpstr(job_options_get(options, "title"), ==, "My \xc3\xa1 document");
+    g_assert_cmpint(job_options_get_int(options, "copies", 1), ==, 3);
+    g_assert_cmpstr(job_options_get(options, "noCollate"), ==, "");
+    g_assert_cmpstr(job_options_get(options, "sides"), ==, "two-sided-long-edge");
+    g_assert_cmpstr(job_options_get(options, "media"), ==, "A4");
+    g_assert_cmpint(job_options_get_int(options, "media-source", 0), ==, 1);
+    g_assert_cmpint(job_options_get_int(options, "media-type", 0), ==, 0);
+    g_assert_cmpint(job_options_get_int(options, "Resolution", 0), ==, 600);
+    g_assert_cmpstr(job_options_get(options, "color"), ==, "");
+    g_assert_null(job_options_get(options, "Collate"));
+    g_assert_null(job_options_get(options, "med"));
+    g_hash_table_unref(options);
+
+    // Test corner cases: repeated options, empty values and unterminated quotes
+    options = job_options_parse("  copies=2 copies=5 media= title=\"unterminated");
+    g_assert_cmpint(job_options_get_int(options, "copies", 1), ==, 2);
+    g_assert_cmpstr(job_options_get(options, "media"), ==, "");
+    g_assert_cmpstr(job_options_get(options, "title"), ==, "unterminated");
+    g_hash_table_unref(options);
+
+    options = job_options_parse("");
+    g_assert_cmpuint(g_hash_table_size(options), ==, 0);
+    g_hash_table_unref(options);
+}
+
+
+void test_job_options_perf() {
+    // Measure parsing and mapping long option strings, as done once per job
+    const char * names[] = { "media", "media-source", "media-type", "sides", "copies",
+                             "noCollate", "Resolution", "color", "printer", "title" };
+    int num_extra[] = { 10, 100, 1000 }, i, j, k;
+    for (i = 0; i < G_N_ELEMENTS(num_extra); ++i) {
+        GString * str = g_string_new(NULL);
+        for (j = 0; j < num_extra[i]; ++j)
+            g_string_append_printf(str, "extra-option-%d=\"some value %d\" ", j, j);
+        g_string_append(str, "printer=\"Printer\" title=\"Title\" copies=2 noCollate color");
+
+        int iterations = 1000;
+        GTimer * timer = g_timer_new();
+        for (j = 0; j < iterations; ++j) {
+            GHashTable * options = job_options_parse(str->str);
+            for (k = 0; k < G_N_ELEMENTS(names); ++k)
+                job_options_get(options, names[k]);
+            g_hash_table_unref(options);
+        }
+        g_timer_stop(timer);
+        double per_job = g_timer_elapsed(timer, NULL) / iterations;
+        g_test_minimized_result(per_job, "%" G_GSIZE_FORMAT " bytes of options: %.3f us per job",
+                                str->len, per_job * 1000000.0);
+        g_timer_destroy(timer);
+        g_string_free(str, TRUE);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/printing/job_options", test_job_options);
+    if (g_test_perf())
+        g_test_add_func("/printing/job_options_perf", test_job_options_perf);
+
+    return g_test_run();
+}
@@ -0,0 +1,174 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "src/PPDGenerator.h"
+
+
+static PPDGenerator * new_generator(int num_papers) {
+    int i;
+    PPDGenerator * ppd = ppd_generator_new("Test_Printer");
+    ppd_generator_set_color(ppd, TRUE);
+    ppd_generator_set_duplex(ppd, TRUE);
+    ppd_generator_add_paper_size(ppd, g_strdup("A4"), 595, 842, 12, 12, 583, 830);
+    ppd_generator_add_paper_size(ppd, g_strdup("Letter"), 612, 792, 12, 12, 600, 780);
+    for (i = 0; i < num_papers; ++i) {
+        ppd_generator_add_paper_size(ppd, g_strdup_printf("Custom %d", i),
+                                     100 + i, 200 + i, 10, 10, 90 + i, 190 + i);
+    }
+    ppd_generator_set_default_paper_size(ppd, g_strdup("A4"));
+    ppd_generator_add_resolution(ppd, 300);
+    ppd_generator_add_resolution(ppd, 600);
+    ppd_generator_set_default_resolution(ppd, 600);
+    ppd_generator_add_tray(ppd, g_strdup("Auto"));
+    ppd_generator_add_tray(ppd, g_strdup("Manual"));
+    ppd_generator_add_media_type(ppd, g_strdup("Plain"));
+    ppd_generator_add_media_type(ppd, g_strdup("Glossy"));
+    return ppd;
+}
+
+
+void test_ppd_generator() {
+    // Test that the PPD contains the printer capabilities
+    g_autoptr(PPDGenerator) ppd = new_generator(0);
+    gsize length;
+    const char * contents = ppd_generator_generate(ppd, &length);
+    g_assert_nonnull(contents);
+    g_assert_cmpuint(strlen(contents), ==, length);
+    g_assert_true(g_str_has_prefix(contents, "*PPD-Adobe: \"4.3\"\n"));
+    g_assert_nonnull(strstr(contents, "*ModelName: \"Test Printer\"\n"));
+    g_assert_nonnull(strstr(contents, "*ColorDevice: True\n"));
+    g_assert_nonnull(strstr(contents, "*DefaultPageSize: a4\n"));
+    g_assert_nonnull(strstr(contents, "*PageSize letter/Letter: "));
+    g_assert_nonnull(strstr(contents, "*DefaultResolution: 600dpi\n"));
+    g_assert_nonnull(strstr(contents, "*Resolution 300dpi: "));
+    g_assert_nonnull(strstr(contents, "*OpenUI *Duplex/Double-Sided Printing: PickOne\n"));
+    g_assert_nonnull(strstr(contents, "*InputSlot manual/Manual: \"\"\n"));
+    g_assert_nonnull(strstr(contents, "*MediaType glossy/Glossy: \"\"\n"));
+
+    // Test that the file output mode writes the same contents
+    g_autofree gchar * file_contents = NULL;
+    gsize file_length;
+    const char * filename = ppd_generator_run(ppd);
+    g_assert_nonnull(filename);
+    g_assert_true(g_file_get_contents(filename, &file_contents, &file_length, NULL));
+    g_assert_cmpuint(file_length, ==, length);
+    g_assert_cmpstr(file_contents, ==, contents);
+    g_unlink(filename);
+}
+
+
+static int count_occurrences(const char * str, const char * needle) {
+    int count = 0;
+    while ((str = strstr(str, needle)) != NULL) {
+        ++count;
+        str += strlen(needle);
+    }
+    return count;
+}
+
+
+void test_ppd_generator_dedupe() {
+    // Test that repeated capabilities are only emitted once
+    g_autoptr(PPDGenerator) ppd = new_generator(0);
+    ppd_generator_add_paper_size(ppd, g_strdup("A4"), 595, 842, 12, 12, 583, 830);
+    ppd_generator_add_resolution(ppd, 300);
+    ppd_generator_add_tray(ppd, g_strdup("Manual"));
+    ppd_generator_add_media_type(ppd, g_strdup("Plain"));
+    const char * contents = ppd_generator_generate(ppd, NULL);
+    g_assert_nonnull(contents);
+    g_assert_cmpint(count_occurrences(contents, "*PageSize a4/A4: "), ==, 1);
+    g_assert_cmpint(count_occurrences(contents, "*Resolution 300dpi: "), ==, 1);
+    g_assert_cmpint(count_occurrences(contents, "*InputSlot manual/Manual: "), ==, 1);
+    g_assert_cmpint(count_occurrences(contents, "*MediaType plain/Plain: "), ==, 1);
+
+    // Test that paper sizes and resolutions are sorted
+    g_assert_true(strstr(contents, "*PageSize a4/A4: ") < strstr(contents, "*PageSize letter/Letter: "));
+    g_assert_true(strstr(contents, "*Resolution 300dpi: ") < strstr(contents, "*Resolution 600dpi: "));
+}
+
+
+// Returns the position of the option among the entries of a PPD keyword
+static int option_index(const char * contents, const char * keyword, const char * option) {
+    g_autofree gchar * entry = g_strdup_printf("%s %s/", keyword, option);
+    const char * found = strstr(contents, entry);
+    int index = 0;
+    g_assert_nonnull(found);
+    while ((contents = strstr(contents, keyword)) != NULL && contents < found) {
+        // Skip *OpenUI, *Default and other keywords that only share the prefix
+        if (contents[strlen(keyword)] == ' ' && contents[-1] == '\n') ++index;
+        contents += strlen(keyword);
+    }
+    return index;
+}
+
+
+void test_ppd_generator_order() {
+    // Test that the index of a chosen tray or media type maps back to the
+    // backend value, as printclient-cups.c does with media-source and media-type
+    const char * sources[] = { "auto", "main", "manual", "envelope" };
+    const char * types[] = { "stationery", "transparency", "envelope", "labels" };
+    g_autoptr(PPDGenerator) ppd = ppd_generator_new("Test_Printer");
+    int i;
+    ppd_generator_add_paper_size(ppd, g_strdup("A4"), 595, 842, 12, 12, 583, 830);
+    ppd_generator_set_default_paper_size(ppd, g_strdup("A4"));
+    for (i = 0; i < G_N_ELEMENTS(sources); ++i)
+        ppd_generator_add_tray(ppd, g_strdup(sources[i]));
+    for (i = 0; i < G_N_ELEMENTS(types); ++i)
+        ppd_generator_add_media_type(ppd, g_strdup(types[i]));
+    const char * contents = ppd_generator_generate(ppd, NULL);
+    g_assert_nonnull(contents);
+    for (i = 0; i < G_N_ELEMENTS(sources); ++i)
+        g_assert_cmpstr(sources[option_index(contents, "*InputSlot", sources[i])], ==, sources[i]);
+    for (i = 0; i < G_N_ELEMENTS(types); ++i)
+        g_assert_cmpstr(types[option_index(contents, "*MediaType", types[i])], ==, types[i]);
+}
+
+
+void test_ppd_generator_perf() {
+    // Measure generation time for printers with large media lists; the time
+    // per media should stay flat as the list grows
+    int sizes[] = { 250, 500, 1000, 2000 }, i;
+    for (i = 0; i < G_N_ELEMENTS(sizes); ++i) {
+        GTimer * timer = g_timer_new();
+        g_autoptr(PPDGenerator) ppd = new_generator(sizes[i]);
+        gsize length;
+        g_assert_nonnull(ppd_generator_generate(ppd, &length));
+        g_timer_stop(timer);
+        double elapsed = g_timer_elapsed(timer, NULL);
+        g_test_minimized_result(elapsed,
+                                "%d media: %.3f ms (%.3f us per media), %" G_GSIZE_FORMAT " bytes",
+                                sizes[i], elapsed * 1000.0, elapsed * 1000000.0 / sizes[i], length);
+        g_timer_destroy(timer);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/printing/ppd_generator", test_ppd_generator);
+    g_test_add_func("/printing/ppd_generator_dedupe", test_ppd_generator_dedupe);
+    g_test_add_func("/printing/ppd_generator_order", test_ppd_generator_order);
+    if (g_test_perf())
+        g_test_add_func("/printing/ppd_generator_perf", test_ppd_generator_perf);
+
+    return g_test_run();
+}
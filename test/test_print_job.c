@@ -0,0 +1,143 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include "src/printclient.h"
+#include "src/printclient-priv.h"
+
+
+// Plays the role of the guest agent, sending a job in chunks of a certain size
+static void send_job(PrintJobManager * pjb, uint32_t id, const char * options,
+                     const char * data, gsize size, gsize chunk) {
+    gsize options_len = strlen(options), offset = 0, length;
+    FlexVDIPrintJobMsg * job = g_malloc(sizeof(FlexVDIPrintJobMsg) + options_len);
+    job->id = id;
+    job->optionsLength = options_len;
+    memcpy(job->options, options, options_len);
+    print_job_manager_handle_message(pjb, FLEXVDI_PRINTJOB, job);
+    do {
+        // The last message has no data
+        length = MIN(chunk, size - offset);
+        FlexVDIPrintJobDataMsg * msg = g_malloc(sizeof(FlexVDIPrintJobDataMsg) + length);
+        msg->id = id;
+        msg->dataLength = length;
+        memcpy(msg->data, data + offset, length);
+        print_job_manager_handle_message(pjb, FLEXVDI_PRINTJOBDATA, msg);
+        offset += length;
+    } while (length);
+}
+
+
+static GBytes * deflate(const char * data, gsize size) {
+    GZlibCompressor * compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1);
+    GOutputStream * memory = g_memory_output_stream_new_resizable();
+    GOutputStream * out = g_converter_output_stream_new(memory, G_CONVERTER(compressor));
+    g_assert_true(g_output_stream_write_all(out, data, size, NULL, NULL, NULL));
+    g_assert_true(g_output_stream_close(out, NULL, NULL));
+    GBytes * result = g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(memory));
+    g_object_unref(out);
+    g_object_unref(memory);
+    g_object_unref(compressor);
+    return result;
+}
+
+
+// Jobs without a printer are not printed, so they end up in the pdf signal
+static void pdf_received(PrintJobManager * pjb, gpointer file, gpointer user_data) {
+    GBytes ** result = (GBytes **)user_data;
+    gchar * contents;
+    gsize length;
+    g_assert_true(g_file_get_contents(file, &contents, &length, NULL));
+    *result = g_bytes_new_take(contents, length);
+    g_unlink(file);
+}
+
+
+static GBytes * receive_job(PrintJobManager * pjb) {
+    GBytes * result = NULL;
+    gulong id = g_signal_connect(pjb, "pdf", G_CALLBACK(pdf_received), &result);
+    while (!result)
+        g_main_context_iteration(NULL, TRUE);
+    g_signal_handler_disconnect(pjb, id);
+    return result;
+}
+
+
+static GString * test_document(gsize size) {
+    GString * document = g_string_new("%PDF-1.4\n");
+    int i;
+    for (i = 0; document->len < size; ++i)
+        g_string_append_printf(document, "%d 0 obj << /Length %d >> endobj\n", i, i * 7 % 1000);
+    return document;
+}
+
+
+void test_print_job() {
+    // Test that a plain job arrives intact
+    PrintJobManager * pjb = print_job_manager_new();
+    g_autoptr(GString) document = test_document(1024 * 1024);
+    send_job(pjb, 1, "title=plain", document->str, document->len, 16 * 1024);
+    g_autoptr(GBytes) received = receive_job(pjb);
+    g_assert_cmpmem(g_bytes_get_data(received, NULL), g_bytes_get_size(received),
+                    document->str, document->len);
+
+    // Test that the job is accounted in the statistics, once per stage
+    PrintJobStats stats;
+    int stage, bucket;
+    print_job_manager_get_stats(pjb, &stats);
+    g_assert_cmpuint(stats.jobs, ==, 1);
+    g_assert_cmpuint(stats.failed, ==, 0);
+    g_assert_cmpuint(stats.print_failed, ==, 0);
+    g_assert_cmpuint(stats.fallbacks, ==, 0);
+    g_assert_cmpuint(stats.bytes, ==, document->len);
+    for (stage = 0; stage < PRINT_STAGE_LAST; ++stage) {
+        guint count = 0;
+        for (bucket = 0; bucket < PRINT_STATS_BUCKETS; ++bucket)
+            count += stats.histograms[stage][bucket];
+        g_assert_cmpuint(count, ==, 1);
+    }
+    g_object_unref(pjb);
+}
+
+
+void test_print_job_deflate() {
+    // Test that a compressed job is decompressed, with chunks not aligned to anything
+    PrintJobManager * pjb = print_job_manager_new();
+    g_autoptr(GString) document = test_document(1024 * 1024);
+    g_autoptr(GBytes) compressed = deflate(document->str, document->len);
+    gsize size;
+    const char * data = g_bytes_get_data(compressed, &size);
+    g_assert_cmpuint(size, <, document->len);
+    send_job(pjb, 2, "title=deflated compression=deflate", data, size, 7001);
+    g_autoptr(GBytes) received = receive_job(pjb);
+    g_assert_cmpmem(g_bytes_get_data(received, NULL), g_bytes_get_size(received),
+                    document->str, document->len);
+    g_object_unref(pjb);
+}
+
+
+int main(int argc, char * argv[]) {
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/printing/print_job", test_print_job);
+    g_test_add_func("/printing/print_job_deflate", test_print_job_deflate);
+    return g_test_run();
+}
@@ -0,0 +1,316 @@
+/*
+    Copyright (C) 2014-2018 Flexible Software Solutions S.L.U.
+
+    This file is part of flexVDI Client.
+
+    flexVDI Client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    flexVDI Client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pty.h>
+#include <sys/resource.h>
+#include <glib.h>
+#include "src/serialredir.h"
+
+
+/*
+ * The serial port is the slave side of a pty, and the test plays the role of
+ * the device on the master side. Data for the guest is collected by a sink.
+ */
+typedef struct Loopback {
+    int master;
+    gchar * params[2];
+    GByteArray * received;
+    guint chunks;
+    gsize max_chunk;
+} Loopback;
+
+
+static void guest_sink(int port_number, const char * data, gsize size, gpointer user_data) {
+    Loopback * loop = (Loopback *)user_data;
+    g_byte_array_append(loop->received, (const guint8 *)data, size);
+    ++loop->chunks;
+    if (size > loop->max_chunk) loop->max_chunk = size;
+}
+
+
+static void loopback_open(Loopback * loop, const char * options) {
+    int slave;
+    g_assert_cmpint(openpty(&loop->master, &slave, NULL, NULL, NULL), ==, 0);
+    loop->params[0] = g_strdup_printf("%s,115200,8N1%s", ttyname(slave), options);
+    loop->params[1] = NULL;
+    loop->received = g_byte_array_new();
+    loop->chunks = 0;
+    loop->max_chunk = 0;
+    serial_port_setup(loop->params);
+    serial_port_set_guest_sink(guest_sink, loop);
+    g_assert_true(serial_port_start(0));
+    close(slave);
+}
+
+
+static void loopback_close(Loopback * loop) {
+    serial_port_stop(0);
+    serial_port_set_guest_sink(NULL, NULL);
+    close(loop->master);
+    g_byte_array_unref(loop->received);
+    g_free(loop->params[0]);
+}
+
+
+static void wait_received(Loopback * loop, gsize size) {
+    while (loop->received->len < size)
+        g_main_context_iteration(NULL, TRUE);
+}
+
+
+typedef struct Writer {
+    int fd;
+    const char * data;
+    gsize size;
+} Writer;
+
+// Writes from a thread, because the pty blocks when its buffer is full
+static gpointer write_thread(gpointer user_data) {
+    Writer * writer = (Writer *)user_data;
+    gsize offset = 0;
+    while (offset < writer->size) {
+        ssize_t written = write(writer->fd, writer->data + offset, writer->size - offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        offset += written;
+    }
+    return NULL;
+}
+
+
+typedef struct Reader {
+    int fd;
+    GByteArray * data;
+    gsize size;
+    // A slow device reads small blocks with a pause in between
+    gsize block;
+    gulong pause;
+} Reader;
+
+// Plays the device that consumes the data written by the serial port
+static gpointer read_thread(gpointer user_data) {
+    Reader * reader = (Reader *)user_data;
+    guint8 buffer[4096];
+    gsize block = reader->block ? reader->block : sizeof(buffer);
+    while (reader->data->len < reader->size) {
+        ssize_t size = read(reader->fd, buffer, block);
+        if (size < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        g_byte_array_append(reader->data, buffer, size);
+        if (reader->pause) g_usleep(reader->pause);
+    }
+    return NULL;
+}
+
+
+// Sends data as the guest would, in messages of varying size, as fast as possible
+static void write_messages(const GByteArray * data) {
+    gsize offset = 0, size = 1;
+    while (offset < data->len) {
+        size = MIN(size * 3 % 2000 + 1, data->len - offset);
+        serial_port_write(0, data->data + offset, size);
+        offset += size;
+    }
+}
+
+
+static GByteArray * test_data(gsize size) {
+    GByteArray * data = g_byte_array_sized_new(size);
+    gsize i;
+    for (i = 0; i < size; ++i) {
+        guint8 byte = i * 31 + i / 256;
+        g_byte_array_append(data, &byte, 1);
+    }
+    return data;
+}
+
+
+void test_serial_read() {
+    Loopback loop;
+    loopback_open(&loop, ",64,5");
+
+    // Test that a burst of data is sent in full chunks, not byte by byte
+    g_autoptr(GByteArray) data = test_data(1000);
+    Writer writer = { loop.master, (const char *)data->data, data->len };
+    GThread * thread = g_thread_new("serial-writer", write_thread, &writer);
+    wait_received(&loop, data->len);
+    g_thread_join(thread);
+    g_assert_cmpmem(loop.received->data, loop.received->len, data->data, data->len);
+    g_assert_cmpuint(loop.max_chunk, <=, 64);
+    g_assert_cmpuint(loop.chunks, <, data->len / 8);
+
+    // Test that a short message is sent after the inter-byte timeout
+    guint chunks = loop.chunks;
+    g_assert_cmpint(write(loop.master, "0123456789", 10), ==, 10);
+    wait_received(&loop, data->len + 10);
+    g_assert_cmpuint(loop.chunks, ==, chunks + 1);
+    g_assert_cmpmem(loop.received->data + data->len, 10, "0123456789", 10);
+
+    SerialPortStats stats;
+    g_assert_true(serial_port_get_stats(0, &stats));
+    g_assert_cmpuint(stats.to_guest_bytes, ==, data->len + 10);
+    g_assert_cmpuint(stats.to_guest_messages, ==, loop.chunks);
+    g_assert_cmpint(stats.to_guest_latency_max, >, 0);
+
+    loopback_close(&loop);
+}
+
+
+void test_serial_write() {
+    Loopback loop;
+    loopback_open(&loop, "");
+
+    // Test that messages from the guest reach the device in order
+    g_autoptr(GByteArray) data = test_data(256 * 1024);
+    Reader reader = { loop.master, g_byte_array_new(), data->len, 0, 0 };
+    GThread * thread = g_thread_new("serial-reader", read_thread, &reader);
+    write_messages(data);
+    g_thread_join(thread);
+    g_assert_cmpmem(reader.data->data, reader.data->len, data->data, data->len);
+    g_byte_array_unref(reader.data);
+
+    SerialPortStats stats;
+    g_assert_true(serial_port_get_stats(0, &stats));
+    g_assert_cmpuint(stats.to_device_bytes, ==, data->len);
+    g_assert_cmpint(stats.to_device_latency_max, >, 0);
+
+    loopback_close(&loop);
+}
+
+
+void test_serial_write_slow() {
+    Loopback loop;
+    loopback_open(&loop, "");
+
+    // Test that writing to a device much slower than the guest never blocks,
+    // and that every byte still reaches it in order
+    g_autoptr(GByteArray) data = test_data(256 * 1024);
+    Reader reader = { loop.master, g_byte_array_new(), data->len, 256, 500 };
+    GThread * thread = g_thread_new("serial-reader", read_thread, &reader);
+    gint64 start = g_get_monotonic_time();
+    write_messages(data);
+    g_assert_cmpint(g_get_monotonic_time() - start, <, G_TIME_SPAN_SECOND / 4);
+    g_thread_join(thread);
+    g_assert_cmpmem(reader.data->data, reader.data->len, data->data, data->len);
+    g_byte_array_unref(reader.data);
+
+    SerialPortStats stats;
+    g_assert_true(serial_port_get_stats(0, &stats));
+    g_assert_cmpuint(stats.to_device_bytes, ==, data->len);
+    g_assert_cmpuint(stats.to_device_queued_max, >, data->len / 2);
+
+    loopback_close(&loop);
+}
+
+
+static double cpu_time() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+
+void test_serial_read_perf() {
+    // Measure throughput and CPU time from the device to the guest. A chunk of
+    // one byte behaves like reading byte by byte.
+    const char * options[] = { ",1,0", ",64,5", ",256,5", ",4096,5" };
+    g_autoptr(GByteArray) data = test_data(4 * 1024 * 1024);
+    int i;
+    for (i = 0; i < G_N_ELEMENTS(options); ++i) {
+        Loopback loop;
+        loopback_open(&loop, options[i]);
+        Writer writer = { loop.master, (const char *)data->data, data->len };
+        double cpu = cpu_time();
+        GTimer * timer = g_timer_new();
+        GThread * thread = g_thread_new("serial-writer", write_thread, &writer);
+        wait_received(&loop, data->len);
+        g_thread_join(thread);
+        g_timer_stop(timer);
+        double elapsed = g_timer_elapsed(timer, NULL);
+        cpu = cpu_time() - cpu;
+        g_assert_cmpmem(loop.received->data, loop.received->len, data->data, data->len);
+        g_test_maximized_result(data->len / elapsed / 1024 / 1024,
+                                "chunk%s: %.1f MiB/s, %.3f s CPU per MiB, %u messages",
+                                options[i], data->len / elapsed / 1024 / 1024,
+                                cpu * 1024 * 1024 / data->len, loop.chunks);
+        g_timer_destroy(timer);
+        loopback_close(&loop);
+    }
+}
+
+
+// The guest outruns the device in the write benchmark, that is not an error there
+static gboolean slow_device_not_fatal(const gchar * log_domain, GLogLevelFlags log_level,
+                                      const gchar * message, gpointer user_data) {
+    return !strstr(message, "is slow");
+}
+
+
+void test_serial_write_perf() {
+    // Measure throughput, CPU time and latency from the guest to the device
+    g_autoptr(GByteArray) data = test_data(4 * 1024 * 1024);
+    Loopback loop;
+    loopback_open(&loop, "");
+    g_test_log_set_fatal_handler(slow_device_not_fatal, NULL);
+    Reader reader = { loop.master, g_byte_array_new(), data->len, 0, 0 };
+    double cpu = cpu_time();
+    GTimer * timer = g_timer_new();
+    GThread * thread = g_thread_new("serial-reader", read_thread, &reader);
+    write_messages(data);
+    g_thread_join(thread);
+    g_timer_stop(timer);
+    double elapsed = g_timer_elapsed(timer, NULL);
+    cpu = cpu_time() - cpu;
+    g_assert_cmpmem(reader.data->data, reader.data->len, data->data, data->len);
+    SerialPortStats stats;
+    serial_port_get_stats(0, &stats);
+    g_test_maximized_result(data->len / elapsed / 1024 / 1024,
+                            "%.1f MiB/s, %.3f s CPU per MiB, %u writes, "
+                            "latency avg %.3f ms max %.3f ms, up to %" G_GSIZE_FORMAT " bytes queued",
+                            data->len / elapsed / 1024 / 1024, cpu * 1024 * 1024 / data->len,
+                            stats.to_device_writes,
+                            stats.to_device_latency / 1000.0 / MAX(stats.to_device_writes, 1),
+                            stats.to_device_latency_max / 1000.0, stats.to_device_queued_max);
+    g_timer_destroy(timer);
+    g_byte_array_unref(reader.data);
+    loopback_close(&loop);
+}
+
+
+int main(int argc, char * argv[]) {
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/serial/read", test_serial_read);
+    g_test_add_func("/serial/write", test_serial_write);
+    g_test_add_func("/serial/write_slow", test_serial_write_slow);
+    if (g_test_perf()) {
+        g_test_add_func("/serial/read_perf", test_serial_read_perf);
+        g_test_add_func("/serial/write_perf", test_serial_write_perf);
+    }
+
+    return g_test_run();
+}
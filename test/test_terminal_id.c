@@ -17,7 +17,10 @@
     along with flexVDI Client. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
 #include <glib.h>
+#include <glib/gstdio.h>
+#include "src/configuration.h"
 
 gchar * discover_terminal_id();
 
@@ -42,10 +45,96 @@ void test_terminal_id() {
     g_assert_cmpstr(terminal_id, ==, terminal_id2);
 }
 
+static gchar * get_config_file() {
+    return g_build_filename(g_get_user_config_dir(), "flexvdi-client", "settings.ini", NULL);
+}
+
+void test_terminal_id_cached() {
+    // Test that the discovered terminal ID is saved with its origin in the config file
+    g_autofree gchar * config_file = get_config_file();
+
+    g_autofree gchar * terminal_id = discover_terminal_id();
+    ClientConf * conf = client_conf_new();
+    g_assert_cmpstr(client_conf_get_terminal_id(conf), ==, terminal_id);
+    g_object_unref(conf);
+
+    g_autoptr(GKeyFile) file = g_key_file_new();
+    g_assert_true(g_key_file_load_from_file(file, config_file, G_KEY_FILE_NONE, NULL));
+    g_autofree gchar * saved_id = g_key_file_get_string(file, "General", "terminal-id", NULL);
+    g_assert_cmpstr(saved_id, ==, terminal_id);
+    g_assert_true(g_key_file_get_boolean(file, "General", "terminal-id-discovered", NULL));
+
+    g_unlink(config_file);
+}
+
+
+// Runs the configuration through the same steps as the application startup
+static ClientConf * start_conf() {
+    ClientConf * conf = client_conf_new();
+    GApplication * app = g_application_new(NULL, G_APPLICATION_NON_UNIQUE);
+    gchar * arguments[] = { "test_terminal_id", NULL };
+    g_autoptr(GVariantDict) options = g_variant_dict_new(NULL);
+    gint result;
+    client_conf_set_original_arguments(conf, arguments);
+    client_conf_set_application_options(conf, app);
+    g_signal_emit_by_name(app, "handle-local-options", options, &result);
+    g_assert_cmpint(result, ==, -1);
+    g_object_unref(app);
+    client_conf_wait_loaded(conf);
+    return conf;
+}
+
+void test_terminal_id_cold_start() {
+    // Test that without a saved ID, getting it waits for the discovery thread
+    g_autofree gchar * config_file = get_config_file();
+    g_unlink(config_file);
+    g_autofree gchar * terminal_id = discover_terminal_id();
+    ClientConf * conf = start_conf();
+    g_assert_cmpstr(client_conf_get_terminal_id(conf), ==, terminal_id);
+    g_assert_true(client_conf_has_terminal_id(conf));
+    g_object_unref(conf);
+    g_unlink(config_file);
+}
+
+void test_terminal_id_warm_start() {
+    // Test that a saved ID is used right away and replaced when the validation
+    // finishes, while the string handed out before stays valid
+    g_autofree gchar * config_file = get_config_file();
+    g_autofree gchar * config_dir = g_path_get_dirname(config_file);
+    g_mkdir_with_parents(config_dir, 0700);
+    g_autoptr(GKeyFile) file = g_key_file_new();
+    g_key_file_set_string(file, "General", "terminal-id", "02:00:00:00:00:01");
+    g_key_file_set_boolean(file, "General", "terminal-id-discovered", TRUE);
+    g_assert_true(g_key_file_save_to_file(file, config_file, NULL));
+
+    g_autofree gchar * terminal_id = discover_terminal_id();
+    ClientConf * conf = start_conf();
+    g_assert_true(client_conf_has_terminal_id(conf));
+    const gchar * old_id = client_conf_get_terminal_id(conf);
+    g_assert_cmpstr(old_id, ==, "02:00:00:00:00:01");
+    while (!g_strcmp0(client_conf_get_terminal_id(conf), old_id))
+        g_main_context_iteration(NULL, TRUE);
+    g_assert_cmpstr(client_conf_get_terminal_id(conf), ==, terminal_id);
+    g_assert_cmpstr(old_id, ==, "02:00:00:00:00:01");
+    g_object_unref(conf);
+    g_unlink(config_file);
+}
+
 int main(int argc, char * argv[]) {
     g_test_init(&argc, &argv, NULL);
 
+    // Keep the saved terminal IDs away from the user settings
+    g_autofree gchar * config_dir = g_dir_make_tmp("test_terminal_id-XXXXXX", NULL);
+    g_setenv("XDG_CONFIG_HOME", config_dir, TRUE);
+
     g_test_add_func("/misc/terminalid", test_terminal_id);
+    g_test_add_func("/misc/terminalid_cached", test_terminal_id_cached);
+    g_test_add_func("/misc/terminalid_cold_start", test_terminal_id_cold_start);
+    g_test_add_func("/misc/terminalid_warm_start", test_terminal_id_warm_start);
 
-    return g_test_run();
+    int result = g_test_run();
+    g_autofree gchar * flexvdi_dir = g_build_filename(config_dir, "flexvdi-client", NULL);
+    g_rmdir(flexvdi_dir);
+    g_rmdir(config_dir);
+    return result;
 }